@@ -0,0 +1,293 @@
+// This file is a part of the IncludeOS unikernel - www.includeos.org
+//
+// Copyright 2018-2019 IncludeOS AS, Oslo, Norway
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <os>
+#include <microLB>
+#include <liveupdate>
+#include <net/tcp/stream.hpp>
+#if defined(MICROLB_TLS)
+#include <net/openssl/tls_stream.hpp>
+#endif
+#include <cinttypes>
+#include <cstring>
+#include "mem_stream.hpp"
+
+#define NODES            64
+#define SESSIONS         100000
+#define QUEUE_SIZE       10000
+#define QUEUE_SCANS      1000
+#define FLUSH_BYTES      (64 * 1024 * 1024)
+#define FLUSH_BATCH      16
+#define SERIAL_SESSIONS  50000
+
+using namespace microLB;
+typedef std::unique_ptr<Balancer> balancer_ptr;
+
+static uint64_t nanos_now()
+{
+  return os::nanos_since_boot();
+}
+static void report(const char* name, const int64_t ops, const uint64_t nanos,
+                   const int64_t bytes = 0)
+{
+  printf("%-40s %9" PRId64 " ops %10.1f ns/op", name, ops, nanos / (double) ops);
+  if (bytes > 0) printf(" %9.1f MB/s", bytes * 1000.0 / nanos);
+  printf("\n");
+}
+
+// connections that complete at once, or when the benchmark says so
+static std::vector<node_connect_result_t> pending;
+static void connect_now(timeout_t, node_connect_result_t callback)
+{
+  callback(net::Stream_ptr(new Mem_stream));
+}
+static void connect_later(timeout_t, node_connect_result_t callback)
+{
+  pending.push_back(std::move(callback));
+}
+
+static balancer_ptr create_balancer(node_connect_function_t connect)
+{
+  balancer_ptr lb(new Balancer(false));
+  for (int i = 0; i < NODES; i++) {
+    lb->nodes.add_node(net::Socket{net::ip4::Addr(10, 0, 0, 1), uint16_t(6000 + i)},
+                       connect);
+  }
+  lb->get_frontend(0);
+  return lb;
+}
+static net::Stream_ptr client(const int i)
+{
+  return net::Stream_ptr(
+      new Mem_stream({net::ip4::Addr(10, 1, i >> 8, i & 0xff), uint16_t(i)}));
+}
+
+static void bench_assign()
+{
+  auto lb = create_balancer({connect_now});
+  lb->nodes.create_connections(SESSIONS);
+  assert(lb->nodes.pool_size() == SESSIONS);
+
+  const uint64_t t0 = nanos_now();
+  for (int i = 0; i < SESSIONS; i++) {
+    auto conn = lb->nodes.assign(client(i));
+    assert(conn == nullptr);
+  }
+  report("Nodes::assign", SESSIONS, nanos_now() - t0);
+}
+
+static void bench_sessions()
+{
+  auto lb = create_balancer({connect_now});
+  std::vector<int> indices;
+  indices.reserve(SESSIONS);
+
+  uint64_t t0 = nanos_now();
+  for (int i = 0; i < SESSIONS; i++) {
+    auto& session = lb->nodes.create_session(
+        client(i), net::Stream_ptr(new Mem_stream), i % NODES);
+    indices.push_back(session.self);
+  }
+  report("Nodes::create_session", SESSIONS, nanos_now() - t0);
+
+  t0 = nanos_now();
+  for (const int idx : indices) {
+    lb->nodes.close_session(idx);
+  }
+  report("Nodes::close_session", SESSIONS, nanos_now() - t0);
+}
+
+static void bench_queue()
+{
+  auto lb = create_balancer({connect_later});
+  for (int i = 0; i < QUEUE_SIZE; i++) {
+    lb->incoming(client(i), 0);
+  }
+  assert(lb->wait_queue() == QUEUE_SIZE);
+  auto handle_queue = lb->get_pool_signal();
+
+  // nothing can be assigned, so this is the cost of looking
+  uint64_t t0 = nanos_now();
+  for (int i = 0; i < QUEUE_SCANS; i++) {
+    handle_queue();
+  }
+  report("Balancer::handle_queue (no pool)", QUEUE_SCANS, nanos_now() - t0);
+
+  // every connection assigns one client, and creates more connections
+  int64_t completed = 0;
+  t0 = nanos_now();
+  while (pending.empty() == false)
+  {
+    auto callback = std::move(pending.back());
+    pending.pop_back();
+    callback(net::Stream_ptr(new Mem_stream));
+    completed++;
+  }
+  report("Balancer::handle_queue (draining)", completed, nanos_now() - t0);
+  assert(lb->wait_queue() == 0);
+}
+
+// the streams made by the listeners and node connections are pooled,
+// and must get the direct forwarding paths, which Mem_stream never does
+static void check_forwarding()
+{
+  typedef Pooled<net::tcp::Stream> tcp_t;
+  assert(forwarding_for(typeid(tcp_t), typeid(tcp_t)) == FORWARD_TCP_TCP);
+  assert(forwarding_for(typeid(net::tcp::Stream), typeid(tcp_t)) == FORWARD_TCP_TCP);
+#if defined(MICROLB_TLS)
+  typedef Pooled<openssl::TLS_stream> tls_t;
+  assert(forwarding_for(typeid(tls_t), typeid(tcp_t)) == FORWARD_TLS_TCP);
+  assert(forwarding_for(typeid(tcp_t), typeid(tls_t)) == FORWARD_TCP_TLS);
+  assert(forwarding_for(typeid(tls_t), typeid(tls_t)) == FORWARD_TLS_TLS);
+#endif
+  assert(forwarding_for(typeid(Mem_stream), typeid(tcp_t)) == FORWARD_ANY);
+}
+
+// one network filling the limiter table must still be limited per source
+static void check_limiter()
+{
+  const int hosts = 2048;
+  Client_limits host, subnet;
+  host.sessions = 1;
+  subnet.sessions = hosts / 256;
+  Client_limiter limiter(4096, host, 24, subnet);
+  for (int i = 0; i < hosts; i++) {
+    const net::ip4::Addr source(10, 0, i >> 3, (i & 7) * 31);
+    if (limiter.admit(source, 0)) limiter.opened(source, 0);
+  }
+  assert(limiter.admitted == hosts);
+  int64_t limited = 0;
+  for (int i = 0; i < hosts; i++) {
+    const net::ip4::Addr source(10, 0, i >> 3, (i & 7) * 31);
+    if (limiter.admit(source, 0) == false) limited++;
+  }
+  // only sources without a slot get through
+  assert(limited >= hosts - limiter.overflows);
+  // a few sources find their probe full, out of both rounds
+  assert(limiter.overflows < hosts / 20);
+  // the /24s are full as well
+  assert(limiter.admit(net::ip4::Addr(10, 0, 0, 200), 0) == false);
+}
+
+// requests the node could frame differently are not reused or routed on
+static bool framed(const char* request)
+{
+  Http_exchange http;
+  http.request.feed((const uint8_t*) request, strlen(request));
+  return http.request.is_tunnel() == false && http.request.messages() == 1
+      && http.request.host() == "a";
+}
+static void check_http_framing()
+{
+  assert(framed("POST / HTTP/1.1\r\nHost: a\r\nContent-Length: 3\r\n\r\nabc"));
+  assert(framed("POST / HTTP/1.1\r\nHost: a\r\nTransfer-Encoding: chunked\r\n\r\n"
+                "3\r\nabc\r\n0\r\n\r\n"));
+  // chunked with a length
+  assert(!framed("POST / HTTP/1.1\r\nHost: a\r\nTransfer-Encoding: chunked\r\n"
+                 "Content-Length: 3\r\n\r\n0\r\n\r\n"));
+  // duplicate, and conflicting, lengths
+  assert(!framed("POST / HTTP/1.1\r\nHost: a\r\nContent-Length: 3\r\n"
+                 "Content-Length: 3\r\n\r\nabc"));
+  assert(!framed("POST / HTTP/1.1\r\nHost: a\r\nContent-Length: 3\r\n"
+                 "Content-Length: 0\r\n\r\nabc"));
+  // lengths that are not numbers
+  assert(!framed("POST / HTTP/1.1\r\nHost: a\r\nContent-Length: 3x\r\n\r\nabc"));
+  assert(!framed("POST / HTTP/1.1\r\nHost: a\r\nContent-Length: -3\r\n\r\nabc"));
+  assert(!framed("POST / HTTP/1.1\r\nHost: a\r\nContent-Length: \r\n\r\n"));
+  // a request body that does not end chunked
+  assert(!framed("POST / HTTP/1.1\r\nHost: a\r\nTransfer-Encoding: gzip\r\n\r\n"));
+
+  Http_exchange http;
+  const char* request = "POST / HTTP/1.1\r\nHost: a\r\nContent-Length: 3\r\n"
+                        "Content-Length: 5\r\n\r\nabc";
+  http.request.feed((const uint8_t*) request, strlen(request));
+  assert(http.request.host().empty() && http.request.target().empty());
+  const char* response = "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n";
+  http.response.feed((const uint8_t*) response, strlen(response));
+  assert(http.is_reusable() == false);
+}
+
+static void bench_flush()
+{
+  static const int chunk_sizes[] = {64, 512, 1460, 8192, 65536};
+  auto lb = create_balancer({connect_now});
+  auto* in = new Mem_stream;
+  auto* out = new Mem_stream;
+  auto& session = lb->nodes.create_session(
+      net::Stream_ptr(in), net::Stream_ptr(out), 0);
+  // NOTE: these are the virtual stream calls, not the direct TCP/TLS paths
+  assert(session.forwarding == FORWARD_ANY);
+
+  for (const int size : chunk_sizes)
+  {
+    // the same buffer is forwarded over and over
+    auto buffer = std::make_shared<std::vector<uint8_t>> (size);
+    const int64_t before = out->written;
+    int64_t chunks = 0;
+    const uint64_t t0 = nanos_now();
+    while (chunks * size < FLUSH_BYTES)
+    {
+      for (int b = 0; b < FLUSH_BATCH; b++) in->feed(buffer, false);
+      session.flush_incoming();
+      chunks += FLUSH_BATCH;
+    }
+    const uint64_t t1 = nanos_now();
+    char name[64];
+    snprintf(name, sizeof(name), "Session::flush_incoming (%d bytes)", size);
+    report(name, chunks, t1 - t0, out->written - before);
+  }
+}
+
+static void bench_liveupdate()
+{
+  auto lb = create_balancer({connect_now});
+  for (int i = 0; i < SERIAL_SESSIONS; i++) {
+    lb->nodes.create_session(client(i), net::Stream_ptr(new Mem_stream), i % NODES);
+  }
+  liu::LiveUpdate::register_partition("microlb", {lb.get(), &Balancer::serialize});
+  uint64_t t0 = nanos_now();
+  auto state = liu::LiveUpdate::store();
+  report("Balancer::serialize", SERIAL_SESSIONS, nanos_now() - t0, state.size());
+
+  auto restored = create_balancer({connect_now});
+  restored->de_helper.restore_stream =
+    [] (liu::Restore& store, int subid, bool) -> net::Stream_ptr {
+      assert(subid == Mem_stream::SUBID);
+      store.go_next();
+      return net::Stream_ptr(new Mem_stream);
+    };
+  t0 = nanos_now();
+  liu::LiveUpdate::resume_from_heap(state.data(), "microlb",
+                                    {restored.get(), &Balancer::resume_callback});
+  report("Balancer::deserialize", SERIAL_SESSIONS, nanos_now() - t0, state.size());
+  assert(restored->nodes.open_sessions() == SERIAL_SESSIONS);
+}
+
+void Service::start()
+{
+  // the trace ring would be part of every measurement
+  trace.enabled = false;
+
+  check_forwarding();
+  check_limiter();
+  check_http_framing();
+  bench_assign();
+  bench_sessions();
+  bench_queue();
+  bench_flush();
+  bench_liveupdate();
+  os::shutdown();
+}
@@ -0,0 +1,95 @@
+// This file is a part of the IncludeOS unikernel - www.includeos.org
+//
+// Copyright 2018-2019 IncludeOS AS, Oslo, Norway
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include <net/stream.hpp>
+#include <cstring>
+#include <deque>
+
+// An always connected stream kept in memory. Reads come from buffers
+// given to feed(), and writes are only counted.
+struct Mem_stream : public net::Stream {
+  // not used by any real stream
+  static const uint16_t SUBID = 0x6d62;
+
+  Mem_stream(net::Socket remote = {}) : m_remote(remote) {}
+
+  // queue data for reading, and tell the reader when asked to
+  void feed(buffer_t buffer, const bool signal = true)
+  {
+    readq.push_back(std::move(buffer));
+    if (signal && m_on_data) m_on_data();
+  }
+
+  // the peer closed, and the reader is told at once
+  void disconnect()
+  {
+    m_closed = true;
+    // NOTE: the callback may delete the stream
+    auto callback = std::move(m_on_close);
+    m_on_close = nullptr;
+    if (callback) callback();
+  }
+
+  void on_connect(ConnectCallback) override {}
+  void on_read(size_t, ReadCallback) override {}
+  void on_data(DataCallback cb) override { m_on_data = std::move(cb); }
+  size_t next_size() override {
+    return (readq.empty()) ? 0 : readq.front()->size();
+  }
+  buffer_t read_next() override {
+    assert(readq.empty() == false);
+    auto buffer = std::move(readq.front());
+    readq.pop_front();
+    return buffer;
+  }
+  void on_close(CloseCallback cb) override { m_on_close = std::move(cb); }
+  void on_write(WriteCallback) override {}
+  void write(const void*, size_t len) override { written += len; }
+  void write(buffer_t buffer) override { written += buffer->size(); }
+  void write(const std::string& str) override { written += str.size(); }
+  // NOTE: the close callback is not called, as a real close is asynchronous
+  void close() override { m_closed = true; }
+  void abort() override { m_closed = true; }
+  void reset_callbacks() override {
+    m_on_data  = nullptr;
+    m_on_close = nullptr;
+  }
+  net::Socket local() const override { return {}; }
+  net::Socket remote() const override { return m_remote; }
+  std::string to_string() const override { return "Mem_stream"; }
+  bool is_connected() const noexcept override { return !m_closed; }
+  bool is_writable() const noexcept override { return !m_closed; }
+  bool is_readable() const noexcept override { return !m_closed; }
+  bool is_closing() const noexcept override { return m_closed; }
+  bool is_closed() const noexcept override { return m_closed; }
+  int  get_cpuid() const noexcept override { return 0; }
+  net::Stream* transport() noexcept override { return nullptr; }
+  size_t serialize_to(void* loc, size_t len) const override {
+    if (len < sizeof(m_remote)) return 0;
+    std::memcpy(loc, &m_remote, sizeof(m_remote));
+    return sizeof(m_remote);
+  }
+  uint16_t serialization_subid() const override { return SUBID; }
+
+  int64_t written = 0;
+private:
+  std::deque<buffer_t> readq;
+  DataCallback  m_on_data  = nullptr;
+  CloseCallback m_on_close = nullptr;
+  net::Socket   m_remote;
+  bool          m_closed = false;
+};
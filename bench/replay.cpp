@@ -0,0 +1,209 @@
+// This file is a part of the IncludeOS unikernel - www.includeos.org
+//
+// Copyright 2018-2019 IncludeOS AS, Oslo, Norway
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <os>
+#include <microLB>
+#include <timers>
+#include <cinttypes>
+#include <cstdlib>
+#include <unordered_map>
+#include "mem_stream.hpp"
+
+// overridden by the CAPTURE and SPEED environment variables
+#define CAPTURE_FILE   "capture.mlb"
+#define DEFAULT_SPEED  1.0
+
+using namespace microLB;
+
+// Feeds a capture through a balancer whose nodes are in-memory streams.
+// Clients arrive, send, receive and leave when they did in the capture,
+// divided by the speed (0 is as fast as possible). Which node a session
+// gets is up to the replayed balancer, and not taken from the capture.
+static std::vector<uint8_t> data;
+static std::unique_ptr<Capture_reader> reader;
+static std::unique_ptr<Balancer> lb;
+static double   speed = DEFAULT_SPEED;
+static uint64_t started = 0;
+// the next record, or none at the end
+static Capture_record rec;
+static const uint8_t* payload = nullptr;
+static bool     more = false;
+// clients until their sessions open, by capture id
+static std::unordered_map<uint32_t, Mem_stream*> waiting;
+static std::unordered_map<const net::Stream*, uint32_t> client_ids;
+// open sessions, by capture id and by session index
+static std::unordered_map<uint32_t, int> sessions;
+static std::vector<uint32_t> session_ids;
+static int64_t records = 0, skipped = 0, opened = 0;
+static int64_t bytes[2] = {0, 0};
+
+static void connect_now(timeout_t, node_connect_result_t callback)
+{
+  callback(net::Stream_ptr(new Mem_stream));
+}
+
+static void load(const char* path)
+{
+  FILE* file = fopen(path, "rb");
+  if (file == nullptr) {
+    printf("Could not open %s\n", path);
+    os::shutdown();
+  }
+  uint8_t chunk[65536];
+  size_t len;
+  while ((len = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+    data.insert(data.end(), chunk, chunk + len);
+  }
+  fclose(file);
+  reader = std::make_unique<Capture_reader> (data.data(), data.size());
+}
+
+static void create_balancer()
+{
+  // as many nodes and frontends as the capture used
+  int nodes = 1, frontends = 1;
+  Capture_reader scan(data.data(), data.size());
+  Capture_record r;
+  const uint8_t* p;
+  while (scan.next(r, p)) {
+    if (r.type == CAPTURE_ASSIGN) nodes = std::max(nodes, r.a + 1);
+    if (r.type == CAPTURE_ACCEPT) frontends = std::max(frontends, r.a + 1);
+  }
+  lb.reset(new Balancer(false));
+  const node_connect_function_t connect {connect_now};
+  for (int i = 0; i < nodes; i++) {
+    lb->nodes.add_node(net::Socket{net::ip4::Addr(10, 0, 0, 1), uint16_t(6000 + i)},
+                       connect);
+  }
+  for (int i = 0; i < frontends; i++) lb->get_frontend(i);
+
+  lb->nodes.on_session_open = [] (Session& session) {
+    auto it = client_ids.find(session.incoming.get());
+    if (it == client_ids.end()) return;
+    const uint32_t id = it->second;
+    client_ids.erase(it);
+    waiting.erase(id);
+    sessions[id] = session.self;
+    if ((int) session_ids.size() <= session.self) session_ids.resize(session.self + 1);
+    session_ids[session.self] = id;
+    opened++;
+  };
+  lb->nodes.on_session_close = [] (int idx, int, int) {
+    if (idx >= (int) session_ids.size() || session_ids[idx] == 0) return;
+    sessions.erase(session_ids[idx]);
+    session_ids[idx] = 0;
+  };
+}
+
+static Mem_stream* client_of(const uint32_t id)
+{
+  auto sit = sessions.find(id);
+  if (sit != sessions.end()) {
+    return (Mem_stream*) lb->nodes.get_session(sit->second).incoming.get();
+  }
+  auto wit = waiting.find(id);
+  return (wit != waiting.end()) ? wit->second : nullptr;
+}
+static Mem_stream* node_of(const uint32_t id)
+{
+  auto it = sessions.find(id);
+  if (it == sessions.end()) return nullptr;
+  return (Mem_stream*) lb->nodes.get_session(it->second).outgoing.get();
+}
+
+static void apply()
+{
+  records++;
+  switch (rec.type) {
+  case CAPTURE_ACCEPT: {
+    auto* stream = new Mem_stream({net::ip4::Addr(rec.b), uint16_t(rec.id)});
+    waiting[rec.id] = stream;
+    client_ids[stream] = rec.id;
+    auto& frontend = lb->get_frontend(rec.a);
+    const int64_t rejected = frontend.rejected;
+    lb->incoming(net::Stream_ptr(stream), -1, rec.a);
+    // the stream is gone
+    if (frontend.rejected != rejected) {
+      waiting.erase(rec.id);
+      client_ids.erase(stream);
+    }
+    } break;
+  case CAPTURE_DATA: {
+    auto* stream = (rec.dir == Shaper::UPLOAD) ? client_of(rec.id) : node_of(rec.id);
+    if (stream == nullptr) {
+      skipped++;
+      break;
+    }
+    // the leading bytes from the capture, when it has them
+    auto buffer = std::make_shared<std::vector<uint8_t>> (rec.a);
+    memcpy(buffer->data(), payload, rec.payload);
+    bytes[rec.dir] += rec.a;
+    stream->feed(std::move(buffer));
+    } break;
+  case CAPTURE_CLOSE: {
+    auto* stream = client_of(rec.id);
+    if (stream == nullptr) break;
+    if (waiting.erase(rec.id) > 0) client_ids.erase(stream);
+    stream->disconnect();
+    } break;
+  default:
+    // node choices are made again
+    break;
+  }
+}
+
+static void finish()
+{
+  const double elapsed = (os::nanos_since_boot() - started) / 1e9;
+  printf("Replayed %" PRId64 " records in %.3f s (speed %.1f)\n",
+         records, elapsed, speed);
+  printf("%" PRId64 " sessions, %" PRId64 " bytes up, %" PRId64 " bytes down,"
+         " %" PRId64 " records without a stream\n",
+         opened, bytes[Shaper::UPLOAD], bytes[Shaper::DOWNLOAD], skipped);
+  printf("%d sessions still open, %d clients waiting\n",
+         lb->nodes.open_sessions(), lb->wait_queue());
+  os::shutdown();
+}
+
+static void replay_due()
+{
+  const uint64_t now = os::nanos_since_boot() - started;
+  while (more && (speed <= 0.0 || rec.nanos / speed <= now)) {
+    apply();
+    more = reader->next(rec, payload);
+  }
+  if (more == false) {
+    finish();
+    return;
+  }
+  const uint64_t due = rec.nanos / speed - now;
+  Timers::oneshot(std::chrono::nanoseconds(due), [] (int) { replay_due(); });
+}
+
+void Service::start()
+{
+  // the trace ring would be part of the replay
+  trace.enabled = false;
+
+  const char* path = getenv("CAPTURE");
+  if (getenv("SPEED")) speed = atof(getenv("SPEED"));
+  load((path) ? path : CAPTURE_FILE);
+  create_balancer();
+
+  started = os::nanos_since_boot();
+  more = reader->next(rec, payload);
+  replay_due();
+}
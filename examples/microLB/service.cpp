@@ -129,8 +129,21 @@ void print_stats(int)
     printf("CPU usage unavailable due to lack of samples\n");
   }
 
+  // where the load balancer spends its cycles
+  microLB::cycles.print(stdout);
   // heap statistics
   print_heap_info();
+  const auto usage = balancer->memory_usage();
+  printf("Memory pressure %d  Held %zu Kb (waiting %zu sessions %zu pools %zu tls %zu)\n",
+         balancer->memory_pressure(), usage.total() / 1024, usage.waiting / 1024,
+         usage.sessions / 1024, usage.pools / 1024, usage.tls / 1024);
+  if (balancer->nodes.buffers_responses()) {
+    printf("Buffered responses %zu Kb\n", balancer->nodes.response_bytes() / 1024);
+  }
+  if (microLB::capture.enabled) {
+    printf("Capture %zu Kb (%ld records dropped)\n",
+           microLB::capture.buffer().size() / 1024, microLB::capture.dropped());
+  }
   // stack sampling
   StackSampler::print(3);
 }
@@ -16,46 +16,212 @@
 
 #pragma once
 
+#include "capture.hpp"
+#include "client_hello.hpp"
+#include "cycles.hpp"
+#include "flows.hpp"
+#include "http2.hpp"
+#include "limiter.hpp"
+#include "memory.hpp"
+#include "nat.hpp"
 #include "nodes.hpp"
+#include "router.hpp"
+#include "stream_pool.hpp"
+#include "trace.hpp"
+#include <list>
 namespace net {
   class Inet;
+  namespace tcp {
+    class Listener;
+  }
 }
 
 namespace microLB
 {
   typedef net::Inet netstack_t;
 
+  // A listener with its own limits and node group (virtual service).
+  // All frontends share the nodes, event loop and statistics.
+  struct Frontend {
+    Frontend(int idx, const std::string& name, int group);
+
+    const int   idx;
+    std::string name;
+    int   group;
+    int   waitq_limit   = 0; // 0 is unlimited
+    int   session_limit = 0; // 0 is unlimited
+    int   priority_class = 0;
+    // offer HTTP/2 with ALPN (TLS only)
+    bool  http2 = false;
+    // TLS forwarded untouched, routed on the server name of the ClientHello
+    bool  passthrough  = false;
+    // and each server name kept on one node of its group
+    bool  sni_affinity = false;
+    void* tls_context   = nullptr;
+    delegate<void()> tls_free = nullptr;
+    // per-client limits (when enabled)
+    std::unique_ptr<Client_limiter> limiter = nullptr;
+    // bandwidth of each session, and of all of them (when enabled)
+    Rate_limits session_rates;
+    std::unique_ptr<Shaper> shaper = nullptr;
+    // gathering of small writes towards the clients
+    Coalescing coalesce;
+    // statistics
+    int     waiting  = 0;
+    int     sessions = 0;
+    int64_t total    = 0;
+    int64_t rejected = 0;
+  };
+
+  // Holds clients after boot, until enough nodes are up and every node
+  // group has warm connections, or until the timeout. Clients are accepted
+  // and wait in their queues, so they are served by warm connections
+  // instead of waiting on a node that is still cold.
+  struct Warm_start {
+    int nodes = 0; // active nodes
+    int pool  = 0; // pooled connections per node group
+    std::chrono::seconds timeout {10};
+    bool enabled() const noexcept { return nodes > 0 || pool > 0; }
+  };
+
+  struct Balancer;
   struct Waiting {
-    Waiting(net::Stream_ptr);
+    Waiting(net::Stream_ptr, Frontend&, int group = 0);
+    ~Waiting();
+    Waiting(const Waiting&) = delete;
+    Waiting& operator=(const Waiting&) = delete;
 #if defined(LIVEUPDATE)
-    Waiting(liu::Restore&, DeserializationHelper&);
+    Waiting(liu::Restore&, Balancer&);
     void serialize(liu::Storage&);
 #endif
 
     net::Stream_ptr conn;
+    Frontend* frontend = nullptr;
+    // counted by the frontends limiter, until handed to a session
+    net::ip4::Addr source;
     int total = 0;
+    // node group, or -1 until the request header has been read
+    int group = 0;
+    // priority class, whose queue holds the client
+    int cls = 0;
+    // hash of the server name, for the node it is kept on (0 is none)
+    uint32_t affinity = 0;
+    // identifies the client in a capture (when capturing)
+    uint32_t capture_id = 0;
+    readq_t readq;
+    std::unique_ptr<Http_framer> request = nullptr;
+    std::unique_ptr<Client_hello> hello  = nullptr;
+  };
+
+  // Waiting clients are sorted into classes by listener, source subnet or
+  // TLS server name. Pool connections go to the lowest priority value
+  // first, and are shared by weight between classes of the same priority.
+  struct Priority_class {
+    typedef std::list<Waiting> queue_t;
+    Priority_class(int idx, const std::string& name);
+
+    const int   idx;
+    std::string name;
+    int   priority    = 0; // lower is served first
+    int   weight      = 1; // share within the same priority
+    int   queue_limit = 0; // 0 is unlimited
+    // NOTE: clients are referenced by their callbacks, and must not move
+    queue_t queue;
+    // deficit round-robin, and the scan position, used by handle_queue
+    int   credit = 0;
+    queue_t::iterator cursor;
+    // statistics
+    int64_t served   = 0;
+    int64_t rejected = 0;
   };
 
   struct Balancer {
     Balancer(bool active_check);
     ~Balancer();
 
+    // NOTE: declared first, as everything else may hold pooled streams
+    Stream_pools stream_pools;
+
     static Balancer* from_config();
 
     // Frontend/Client-side of the load balancer
-    void open_for_tcp(netstack_t& interface, uint16_t port);
-    void open_for_s2n(netstack_t& interface, uint16_t port, const std::string& cert, const std::string& key);
-    void open_for_ossl(netstack_t& interface, uint16_t port, const std::string& cert, const std::string& key);
+    // NOTE: frontend 0 is created on demand, the others with add_frontend
+    int  add_frontend(const std::string& name, int group = 0,
+                      int waitq_limit = 0, int session_limit = 0);
+    Frontend& get_frontend(int idx);
+    // priority classes for waiting clients
+    // NOTE: class 0 is created on demand, the others with add_class
+    int  add_class(const std::string& name, int priority = 0,
+                   int weight = 1, int queue_limit = 0);
+    int  find_class(const std::string& name) const;
+    Priority_class& get_class(int idx);
+    // clients from the subnet go to the class, the longest prefix wins
+    void classify_subnet(net::ip4::Addr, int prefix, int cls);
+    // startup gate for all listeners
+    // NOTE: must be set before opening any of them
+    void warm_start(const Warm_start&);
+    inline bool is_warm() const noexcept;
+    // heap budget, with graded actions under pressure
+    // NOTE: must be set before opening any listeners
+    void memory_budget(const Memory_budget&);
+    inline memory_pressure_t memory_pressure() const noexcept;
+    Memory_usage memory_usage() const;
+    // bandwidth shaping for the clients of a frontend
+    void shape_clients(int frontend, const Rate_limits& per_session,
+                       const Rate_limits& total);
+    void open_for_tcp(netstack_t& interface, uint16_t port, int frontend = 0);
+    void open_for_s2n(netstack_t& interface, uint16_t port, const std::string& cert, const std::string& key,
+                      int frontend = 0);
+    void open_for_ossl(netstack_t& interface, uint16_t port, const std::string& cert, const std::string& key,
+                      int frontend = 0);
+    // TLS terminated by the nodes, and routed on the server name (SNI)
+    // NOTE: the nodes must be connected with TCP
+    void open_for_passthrough(netstack_t& interface, uint16_t port, int frontend = 0,
+                              bool sni_affinity = false);
+    // UDP flows, balanced over a node group
+    // NOTE: the nodes must be added first
+    Udp_service& open_for_udp(netstack_t& interface, uint16_t port,
+                              netstack_t& nodes, int group = 0,
+                              const Udp_config& = {});
+    // TCP forwarded per packet to a node group, without sessions
+    // NOTE: the nodes must be added first
+    Nat_service& open_for_nat(netstack_t& interface, uint16_t port,
+                              netstack_t& nodes, int group = 0,
+                              const Nat_config& = {});
     // Backend/Application side of the load balancer
-    static node_connect_function_t connect_with_tcp(netstack_t& interface, net::Socket);
+    static node_connect_function_t connect_with_tcp(netstack_t& interface, net::Socket,
+                                                    Stream_pools* = nullptr);
+    static node_connect_function_t connect_with_tls(netstack_t& interface, net::Socket, void* tls_ctx,
+                                                    Stream_pools* = nullptr);
+    // client-side TLS context used by connect_with_tls (when enabled)
+    void* create_node_tls_context(bool verify_peer, const std::string& ca_cert = "");
     // Setup and automatic resume (if applicable)
     // NOTE: Be sure to have configured it properly BEFORE calling this
 
+    // preallocate stream wrappers for this many sessions
+    void init_stream_pools(int session_limit);
+
     inline int  wait_queue() const;
+    // any client, session or HTTP/2 stream waited for a node of the group
+    // when connections were last handled
+    inline bool has_waiting(int group) const noexcept;
     inline int  connect_throws() const noexcept;
     // add a client stream to the load balancer
     // NOTE: the stream must be connected prior to calling this function
     void incoming(net::Stream_ptr);
+    // group -1 routes the client on its first request header,
+    // and class -1 is chosen by the source subnet or the frontend
+    // counted is the source the listener counted in the frontends limiter
+    void incoming(net::Stream_ptr, int group, int frontend = 0, int cls = -1,
+                  net::ip4::Addr counted = {});
+    // a client that negotiated HTTP/2
+    void incoming_http2(net::Stream_ptr, int frontend, net::ip4::Addr counted = {});
+    // concurrency is counted from the TCP connect, so that it
+    // includes TLS handshakes, and released when the client leaves
+    net::ip4::Addr count_client(int frontend, net::Socket remote);
+    void release_client(int frontend, net::ip4::Addr source);
+    // called by HTTP/2 connections as they close
+    void h2_closed();
 
 #if defined(LIVEUPDATE)
     void init_liveupdate();
@@ -64,29 +230,84 @@ namespace microLB
 #endif
 
     Nodes nodes;
+    Router router;
+    std::deque<Frontend> frontends;
+    std::deque<Priority_class> classes;
+    std::deque<Udp_service> udp_services;
+    std::deque<Nat_service> nat_services;
+    // routed packets that belong to no NAT service
+    int64_t nat_dropped = 0;
+    // NOTE: connections are referenced by their callbacks, and must not move
+    std::list<Http2_connection> h2_clients;
+    // HTTP/2 streams waiting for node connections
+    int h2_waiting = 0;
     inline pool_signal_t get_pool_signal();
     DeserializationHelper de_helper;
 
   private:
     void handle_connections();
     void handle_queue();
+    void route_request(Waiting&);
+    void route_server_name(Waiting&);
+    int  classify(const net::Stream&, const Frontend&) const;
+    void serve_classes(size_t begin, size_t end);
+    // the forwarder of every interface with NAT services
+    void nat_forward(net::IP4::IP_packet_ptr, net::Inet&, net::Conntrack::Entry_ptr);
+    bool serve_next(Priority_class&);
+    void limit_clients(net::tcp::Listener&, int frontend);
+    void check_warm();
+    void open_gate(bool timed_out);
+    void check_memory();
 #if defined(LIVEUPDATE)
      void deserialize(liu::Restore&);
 #endif
     std::vector<net::Socket> parse_node_confg();
 
-    std::deque<Waiting> queue;
+    // class indices, by priority
+    std::vector<int> class_order;
+    struct Subnet_class {
+      uint32_t addr;
+      uint32_t mask;
+      int prefix;
+      int cls;
+    };
+    // longest prefix first
+    std::vector<Subnet_class> class_subnets;
     int throw_retry_timer = -1;
+    // waiting clients per group, counted by handle_connections
+    std::vector<int> group_waiting;
+    int h2_cleanup_timer = -1;
     int throw_counter = 0;
+    // startup gate (when enabled)
+    Warm_start m_warm_start;
+    bool     m_warm = true;
+    int      warm_timer = -1;
+    uint64_t warm_deadline = 0;
+    // memory budget (when enabled)
+    Memory_budget m_memory;
+    memory_pressure_t m_pressure = MEMORY_OK;
+    int      memory_timer = -1;
     // TLS stuff (when enabled)
-    void* tls_context = nullptr;
-    delegate<void()> tls_free = nullptr;
+    void* node_tls_context = nullptr;
+    delegate<void()> node_tls_free = nullptr;
   };
 
   int Balancer::wait_queue() const
-  { return this->queue.size(); }
+  {
+    int total = 0;
+    for (const auto& cls : classes) total += cls.queue.size();
+    return total;
+  }
+  bool Balancer::has_waiting(const int group) const noexcept {
+    return group >= 0 && group < (int) group_waiting.size()
+        && group_waiting[group] > 0;
+  }
   int Balancer::connect_throws() const noexcept
   { return this->throw_counter; }
+  bool Balancer::is_warm() const noexcept
+  { return this->m_warm; }
+  memory_pressure_t Balancer::memory_pressure() const noexcept
+  { return this->m_pressure; }
   pool_signal_t Balancer::get_pool_signal()
   { return {this, &Balancer::handle_queue}; }
 
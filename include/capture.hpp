@@ -0,0 +1,93 @@
+// This file is a part of the IncludeOS unikernel - www.includeos.org
+//
+// Copyright 2018-2019 IncludeOS AS, Oslo, Norway
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include <net/stream.hpp>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+namespace microLB
+{
+  enum capture_type_t : uint8_t {
+    CAPTURE_ACCEPT = 1,   // frontend, client address
+    CAPTURE_ASSIGN,       // node
+    CAPTURE_DATA,         // bytes, in the direction of dir
+    CAPTURE_CLOSE
+  };
+
+  struct Capture_record {
+    uint64_t nanos;    // since the capture started
+    uint32_t id;       // of the client, and later of its session
+    uint8_t  type;
+    uint8_t  dir;      // Shaper::direction_t
+    uint16_t payload;  // bytes of payload following the record
+    int32_t  a;
+    uint32_t b;
+  };
+  static_assert(sizeof(Capture_record) == 24, "Capture records are 24 bytes");
+
+  struct Capture_config {
+    size_t limit   = 64 << 20; // bytes kept, recording stops when full
+    int    payload = 0;        // leading bytes kept of each data record
+  };
+
+  // Records when clients arrive, which nodes they get and how much each
+  // side sends, so that the traffic can be replayed (see bench/replay.cpp).
+  // The capture is kept in memory, and written out by the service.
+  struct Capture {
+    // starts over, with an empty capture
+    void start(const Capture_config&);
+    void stop() noexcept { this->enabled = false; }
+    inline uint32_t next_id() noexcept;
+
+    void accept(uint32_t id, int frontend, net::Socket client);
+    void assign(uint32_t id, int node);
+    void data(uint32_t id, int dir, const uint8_t* data, size_t len);
+    void close(uint32_t id);
+
+    // the capture so far, header included
+    const std::vector<uint8_t>& buffer() const noexcept { return m_buffer; }
+    // records left out after reaching the limit
+    int64_t dropped() const noexcept { return m_dropped; }
+    bool write(FILE*) const;
+
+    bool enabled = false;
+  private:
+    void add(const Capture_record&, const uint8_t* payload = nullptr);
+
+    Capture_config m_config;
+    std::vector<uint8_t> m_buffer;
+    uint64_t m_start   = 0;
+    uint32_t m_last_id = 0;
+    int64_t  m_dropped = 0;
+  };
+  extern Capture capture;
+
+  // Reads the records of a capture, oldest first
+  struct Capture_reader {
+    // throws std::runtime_error when it is not a capture
+    Capture_reader(const uint8_t* data, size_t len);
+    // returns false after the last record
+    bool next(Capture_record&, const uint8_t*& payload);
+  private:
+    const uint8_t* m_pos;
+    const uint8_t* m_end;
+  };
+
+  uint32_t Capture::next_id() noexcept
+  { return ++m_last_id; }
+}
@@ -0,0 +1,58 @@
+// This file is a part of the IncludeOS unikernel - www.includeos.org
+//
+// Copyright 2018-2019 IncludeOS AS, Oslo, Norway
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace microLB
+{
+  // Reads the server name (SNI) from the ClientHello that opens a TLS
+  // connection, without terminating TLS. The records are neither modified
+  // nor kept, so the caller forwards what it fed afterwards.
+  struct Client_hello {
+    enum result_t : uint8_t { MORE, DONE, INVALID };
+    result_t feed(const uint8_t* data, size_t len);
+
+    inline result_t result() const noexcept;
+    // empty when the client sent no server name
+    inline const std::string& server_name() const noexcept;
+    // of the lowercase server name, 0 when there is none
+    inline uint32_t server_name_hash() const noexcept;
+
+  private:
+    result_t parse_message(size_t len);
+    bool     parse_server_name(const uint8_t*, const uint8_t* end);
+
+    result_t m_result = MORE;
+    // record header being read, and what is left of the record
+    uint8_t  header[5];
+    int      header_len = 0;
+    uint32_t remaining  = 0;
+    // the handshake message, which may span records
+    std::vector<uint8_t> message;
+    std::string m_server_name;
+    uint32_t m_hash = 0;
+  };
+
+  Client_hello::result_t Client_hello::result() const noexcept
+  { return m_result; }
+  const std::string& Client_hello::server_name() const noexcept
+  { return m_server_name; }
+  uint32_t Client_hello::server_name_hash() const noexcept
+  { return m_hash; }
+}
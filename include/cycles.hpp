@@ -0,0 +1,145 @@
+// This file is a part of the IncludeOS unikernel - www.includeos.org
+//
+// Copyright 2018-2019 IncludeOS AS, Oslo, Norway
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include "stream_pool.hpp"
+#include <net/stream.hpp>
+#include <cstdint>
+#include <cstdio>
+
+namespace microLB
+{
+  enum cycle_stage_t : uint8_t {
+    STAGE_ACCEPT = 0,   // listener callbacks
+    STAGE_TLS,          // handshakes, and encrypting or decrypting records
+    STAGE_QUEUE,        // handle_queue
+    STAGE_CONNECTIONS,  // handle_connections
+    STAGE_ASSIGN,       // Nodes::assign
+    STAGE_FORWARD,      // session data in both directions
+    STAGE_TEARDOWN,     // closing sessions
+    STAGE_MAX
+  };
+
+  struct Stage_counter {
+    uint64_t cycles = 0;
+    uint64_t calls  = 0;
+  };
+
+  // Cumulative TSC cycles spent in each stage. Stages nest, and an outer
+  // stage only counts the cycles outside of its inner stages, so that the
+  // stages add up to the time spent in the load balancer.
+  struct Cycle_stats {
+    inline const Stage_counter& get(cycle_stage_t s) const noexcept
+    { return stage[s]; }
+    void reset() noexcept;
+    // prints every stage, with its share of all the counted cycles
+    void print(FILE*) const;
+    static const char* stage_name(cycle_stage_t);
+
+    bool enabled = true;
+  private:
+    friend struct Stage_scope;
+    Stage_counter stage[STAGE_MAX];
+    // the innermost stage, and when it last started counting
+    int      current = -1;
+    uint64_t mark = 0;
+  };
+  extern Cycle_stats cycles;
+
+  uint64_t cycle_clock() noexcept;
+
+  // Counts the cycles until the end of the scope towards a stage
+  struct Stage_scope {
+    inline Stage_scope(cycle_stage_t, bool active = true) noexcept;
+    inline ~Stage_scope();
+    Stage_scope(const Stage_scope&) = delete;
+    Stage_scope& operator=(const Stage_scope&) = delete;
+  private:
+    static const int INACTIVE = -2;
+    int parent;
+  };
+
+  // Counts the callbacks of a stream towards a stage, such as the TLS
+  // record processing done by a TLS stream on top of this one
+  struct Stage_stream : public net::Stream {
+    Stage_stream(net::Stream_ptr inner, cycle_stage_t s)
+      : m_inner(std::move(inner)), m_stage(s) {}
+
+    void on_connect(ConnectCallback) override;
+    void on_read(size_t, ReadCallback) override;
+    void on_data(DataCallback) override;
+    size_t next_size() override { return m_inner->next_size(); }
+    buffer_t read_next() override { return m_inner->read_next(); }
+    void on_close(CloseCallback cb) override { m_inner->on_close(std::move(cb)); }
+    void on_write(WriteCallback cb) override { m_inner->on_write(std::move(cb)); }
+    void write(const void* data, size_t len) override { m_inner->write(data, len); }
+    void write(buffer_t buffer) override { m_inner->write(std::move(buffer)); }
+    void write(const std::string& str) override { m_inner->write(str); }
+    void close() override { m_inner->close(); }
+    void abort() override { m_inner->abort(); }
+    void reset_callbacks() override;
+    net::Socket local() const override { return m_inner->local(); }
+    net::Socket remote() const override { return m_inner->remote(); }
+    std::string to_string() const override { return m_inner->to_string(); }
+    bool is_connected() const noexcept override { return m_inner->is_connected(); }
+    bool is_writable() const noexcept override { return m_inner->is_writable(); }
+    bool is_readable() const noexcept override { return m_inner->is_readable(); }
+    bool is_closing() const noexcept override { return m_inner->is_closing(); }
+    bool is_closed() const noexcept override { return m_inner->is_closed(); }
+    int  get_cpuid() const noexcept override { return m_inner->get_cpuid(); }
+    net::Stream* transport() noexcept override { return m_inner.get(); }
+    size_t serialize_to(void* loc, size_t len) const override {
+      return m_inner->serialize_to(loc, len);
+    }
+    uint16_t serialization_subid() const override {
+      return m_inner->serialization_subid();
+    }
+
+  private:
+    net::Stream_ptr   m_inner;
+    const cycle_stage_t m_stage;
+    ConnectCallback m_on_connect = nullptr;
+    ReadCallback    m_on_read = nullptr;
+    DataCallback    m_on_data = nullptr;
+  };
+
+  // the transport of a TLS stream, counted towards a stage while cycles
+  // are counted, and as it is otherwise
+  net::Stream_ptr stage_transport(net::Stream_ptr, cycle_stage_t, Arena*);
+
+  Stage_scope::Stage_scope(const cycle_stage_t s, const bool active) noexcept
+    : parent(cycles.current)
+  {
+    if (active == false || cycles.enabled == false) {
+      this->parent = INACTIVE;
+      return;
+    }
+    // the outer stage pauses
+    const uint64_t now = cycle_clock();
+    if (parent >= 0) cycles.stage[parent].cycles += now - cycles.mark;
+    cycles.current = s;
+    cycles.mark = now;
+    cycles.stage[s].calls++;
+  }
+  Stage_scope::~Stage_scope()
+  {
+    if (parent == INACTIVE) return;
+    const uint64_t now = cycle_clock();
+    cycles.stage[cycles.current].cycles += now - cycles.mark;
+    cycles.current = parent;
+    cycles.mark = now;
+  }
+}
@@ -0,0 +1,105 @@
+// This file is a part of the IncludeOS unikernel - www.includeos.org
+//
+// Copyright 2018-2019 IncludeOS AS, Oslo, Norway
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include <net/addr.hpp>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+namespace net {
+  class Inet;
+  class UDPSocket;
+}
+
+namespace microLB
+{
+  struct Nodes;
+
+  struct Udp_config {
+    int table_size = 4096;    // concurrent flows
+    std::chrono::seconds idle_timeout {30};
+    uint16_t node_port = 0;   // 0 uses the port of each node
+    int virtual_nodes  = 64;  // points on the hash ring per node
+  };
+
+  // Balances UDP flows (client address and port) over a node group.
+  // New flows are placed by consistent hashing, and placed again when
+  // their node goes down. Each flow has its own upstream socket, so that
+  // replies find their way back. Flows live in a fixed-size
+  // open-addressing table, and expire when idle.
+  struct Udp_service {
+    Udp_service(Nodes&, net::Inet& clients, uint16_t port,
+                net::Inet& nodes, int group, const Udp_config&);
+    ~Udp_service();
+    Udp_service(const Udp_service&) = delete;
+    Udp_service& operator=(const Udp_service&) = delete;
+
+    inline int active_flows() const noexcept { return this->flows; }
+    inline int capacity() const noexcept { return table.size(); }
+    // expire idle flows, done periodically
+    void sweep();
+
+    // statistics
+    int64_t created = 0;
+    int64_t expired = 0;
+    int64_t datagrams = 0;
+    // datagrams without a flow slot, an active node or an upstream port
+    int64_t dropped = 0;
+    // new flows that could not bind an upstream socket
+    int64_t no_port = 0;
+    // flows placed again, after their node went down
+    int64_t moved = 0;
+
+  private:
+    enum state_t : uint8_t {
+      EMPTY = 0,
+      ACTIVE,
+      EXPIRED // reusable, but keeps probe chains intact
+    };
+    struct Flow {
+      uint32_t addr;
+      uint16_t port;
+      state_t  state;
+      uint8_t  unused;
+      int32_t  node;
+      uint32_t last;       // seconds
+      uint32_t generation; // guards replies from reused slots
+      net::UDPSocket* upstream;
+    };
+    static_assert(sizeof(Flow) == 32, "Flows are 32 bytes");
+
+    void from_client(net::Addr, uint16_t, const char*, size_t);
+    void from_node(uint32_t slot, uint32_t gen, const char*, size_t);
+    Flow* lookup(uint32_t addr, uint16_t port, uint32_t now);
+    int   pick_node(uint32_t hash) const;
+    void  expire(Flow&);
+    void  build_ring();
+
+    Nodes&          m_nodes;
+    net::Inet&      m_netout;
+    net::UDPSocket& m_socket;
+    const int       m_group;
+    const Udp_config m_config;
+    std::vector<Flow> table;
+    uint32_t        mask = 0;
+    int             flows = 0;
+    uint32_t        generation = 0;
+    int             sweep_timer = -1;
+    // sorted points on the hash ring, and their nodes
+    std::vector<std::pair<uint32_t, int>> ring;
+  };
+}
@@ -0,0 +1,70 @@
+// This file is a part of the IncludeOS unikernel - www.includeos.org
+//
+// Copyright 2018-2019 IncludeOS AS, Oslo, Norway
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include <cstdint>
+#include <vector>
+
+// slots checked for a key before giving up
+#define MAX_PROBES  8
+
+namespace microLB
+{
+  inline uint32_t mix(uint64_t key) noexcept
+  {
+    // finalizer from MurmurHash3
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdull;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ull;
+    key ^= key >> 33;
+    return key;
+  }
+
+  // Fixed-size tables use open addressing over a power of two slots,
+  // so that the hash can be masked, and have room for at least one probe.
+  inline uint32_t probe_table_size(const int entries) noexcept
+  {
+    uint32_t size = MAX_PROBES;
+    while (size < (uint32_t) entries) size <<= 1;
+    return size;
+  }
+
+  // Probes the slots following hash. Returns the slot where match() holds,
+  // setting found, or else the first empty() or reusable() slot, or nullptr.
+  // An empty slot ends the probe, a reusable one does not.
+  template <typename T, typename Match, typename Empty, typename Reusable>
+  T* probe(std::vector<T>& table, const uint32_t mask, const uint32_t hash,
+           bool& found, Match match, Empty empty, Reusable reusable)
+  {
+    found = false;
+    T* slot = nullptr;
+    for (uint32_t i = 0; i < MAX_PROBES; i++)
+    {
+      auto& entry = table[(hash + i) & mask];
+      if (match(entry)) {
+        found = true;
+        return &entry;
+      }
+      if (empty(entry)) {
+        if (slot == nullptr) slot = &entry;
+        break;
+      }
+      if (slot == nullptr && reusable(entry)) slot = &entry;
+    }
+    return slot;
+  }
+}
@@ -0,0 +1,57 @@
+// This file is a part of the IncludeOS unikernel - www.includeos.org
+//
+// Copyright 2018-2019 IncludeOS AS, Oslo, Norway
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace microLB
+{
+  typedef std::pair<std::string, std::string> header_t;
+  typedef std::vector<header_t> header_list_t;
+
+  // HPACK (RFC 7541) header block decoding, with a dynamic table
+  // of at most the size we advertise.
+  struct Hpack_decoder {
+    Hpack_decoder(size_t max_table_size = 4096) : max_size(max_table_size) {}
+
+    // appends the headers of a complete block, returns false on errors
+    bool decode(const uint8_t* data, size_t len, header_list_t&);
+
+  private:
+    const header_t* lookup(uint64_t index) const;
+    void insert(header_t);
+    void evict(size_t limit);
+
+    // newest entry first
+    std::deque<header_t> table;
+    size_t table_size = 0;
+    size_t size_limit = 4096;
+    const size_t max_size;
+  };
+
+  // Header block encoding, without the dynamic table, so that there
+  // is no encoder state to keep in sync with the peer.
+  struct Hpack_encoder {
+    void encode(const std::string& name, const std::string& value,
+                std::vector<uint8_t>& out) const;
+    // the response status, indexed when it is in the static table
+    void encode_status(int status, std::vector<uint8_t>& out) const;
+  };
+}
@@ -0,0 +1,105 @@
+// This file is a part of the IncludeOS unikernel - www.includeos.org
+//
+// Copyright 2018-2019 IncludeOS AS, Oslo, Norway
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include <cstdint>
+#include <deque>
+#include <string>
+
+namespace microLB
+{
+  // Finds HTTP/1.x message boundaries in a byte stream, without
+  // modifying or buffering the messages themselves.
+  struct Http_framer {
+    enum kind_t { REQUEST, RESPONSE };
+    // responses are framed against the requests they answer
+    Http_framer(kind_t, Http_framer* requests = nullptr);
+
+    void feed(const uint8_t* data, size_t len);
+
+    // between messages
+    inline bool is_idle() const noexcept;
+    // no longer HTTP (upgrades, CONNECT, framing errors, and messages
+    // with conflicting or duplicate lengths)
+    inline bool is_tunnel() const noexcept;
+    // all messages so far allow the connection to be reused
+    inline bool keep_alive() const noexcept;
+    // completed requests, or completed final responses
+    inline int  messages() const noexcept;
+    // requests: number of headers seen, and the last Host and target
+    inline int  headers() const noexcept;
+    inline const std::string& host() const noexcept;
+    inline const std::string& target() const noexcept;
+
+  private:
+    enum state_t {
+      HEADER, BODY, CHUNK_SIZE, CHUNK_DATA, CHUNK_CRLF, TRAILER,
+      UNTIL_CLOSE, TUNNEL
+    };
+    enum method_t : uint8_t { M_OTHER, M_HEAD, M_CONNECT };
+    size_t parse_header(const uint8_t*, size_t);
+    size_t parse_line(const uint8_t*, size_t);
+    void   parse_message_header();
+    void   message_complete();
+    void   begin_body(bool chunked, int64_t length);
+    void   tunnel();
+
+    const kind_t kind;
+    Http_framer* requests;
+    state_t  state = HEADER;
+    bool     m_keep_alive = true;
+    int      m_messages = 0;
+    int      m_headers  = 0;
+    int64_t  remaining  = 0;
+    std::string header;
+    std::string line;
+    std::string m_host;
+    std::string m_target;
+    // methods of requests that have not been answered yet
+    std::deque<method_t> methods;
+  };
+
+  // both directions of an HTTP/1.1 connection
+  struct Http_exchange {
+    Http_framer request  {Http_framer::REQUEST};
+    Http_framer response {Http_framer::RESPONSE, &request};
+
+    // every request is answered, and the node connection can be reused
+    inline bool is_reusable() const noexcept;
+  };
+
+  bool Http_exchange::is_reusable() const noexcept
+  {
+    return request.is_idle() && response.is_idle()
+        && request.messages() == response.messages()
+        && request.keep_alive() && response.keep_alive();
+  }
+
+  bool Http_framer::is_idle() const noexcept
+  { return state == HEADER && header.empty(); }
+  bool Http_framer::is_tunnel() const noexcept
+  { return state == TUNNEL; }
+  bool Http_framer::keep_alive() const noexcept
+  { return m_keep_alive; }
+  int  Http_framer::messages() const noexcept
+  { return m_messages; }
+  int  Http_framer::headers() const noexcept
+  { return m_headers; }
+  const std::string& Http_framer::host() const noexcept
+  { return m_host; }
+  const std::string& Http_framer::target() const noexcept
+  { return m_target; }
+}
@@ -0,0 +1,168 @@
+// This file is a part of the IncludeOS unikernel - www.includeos.org
+//
+// Copyright 2018-2019 IncludeOS AS, Oslo, Norway
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include "hpack.hpp"
+#include <net/addr.hpp>
+#include <net/stream.hpp>
+#include <deque>
+#include <map>
+
+namespace microLB
+{
+  struct Balancer;
+
+  // Incremental parser for HTTP/1.1 responses from the nodes. Headers
+  // are lowercased without the hop-by-hop ones, and the body is taken
+  // out of its chunked encoding.
+  struct Http1_response {
+    void reset(bool head_request);
+    // returns false when the response is malformed
+    bool feed(const uint8_t* data, size_t len);
+    // the node closed the connection, returns false if that was early
+    bool finish();
+
+    int  status = 0;
+    header_list_t headers;
+    bool headers_done = false;
+    bool complete     = false;
+    // the connection can take another request afterwards
+    bool keep_alive   = true;
+    // body data not yet taken by the caller
+    std::vector<uint8_t> body;
+
+  private:
+    enum state_t : uint8_t {
+      STATUS, HEADER, BODY, CHUNK_SIZE, CHUNK_DATA, CHUNK_END,
+      TRAILER, UNTIL_CLOSE, DONE
+    };
+    bool read_line(const uint8_t*& p, const uint8_t* end);
+    bool parse_status();
+    bool parse_header();
+    bool end_headers();
+    void done();
+
+    state_t  state = STATUS;
+    bool     head  = false;
+    bool     http10 = false;
+    bool     chunked = false;
+    int64_t  content_length = -1;
+    uint64_t remaining = 0;
+    size_t   header_bytes = 0;
+    std::string line;
+  };
+
+  // One client connection that negotiated HTTP/2. Every stream becomes an
+  // HTTP/1.1 request on a pooled node connection, which goes back to the
+  // pool when the response is complete.
+  struct Http2_connection {
+    Http2_connection(Balancer&, net::Stream_ptr client, int frontend,
+                     net::ip4::Addr source = {});
+    ~Http2_connection();
+    Http2_connection(const Http2_connection&) = delete;
+    Http2_connection& operator=(const Http2_connection&) = delete;
+
+    void start();
+    inline bool is_alive() const noexcept { return !m_closed; }
+    inline int  open_streams() const noexcept { return streams.size(); }
+    // streams waiting for node connections (called by the balancer)
+    void count_waiting(std::vector<int>& per_group) const;
+    void serve_waiting();
+
+    const int frontend;
+    // counted by the frontends limiter, until the connection closes
+    const net::ip4::Addr source;
+    // statistics
+    int64_t requests = 0;
+    int64_t resets   = 0;
+
+  private:
+    struct H2_stream {
+      uint32_t id    = 0;
+      int      group = 0;
+      int      node  = -1;
+      net::Stream_ptr upstream = nullptr;
+      // request towards the node, until it has been written
+      std::vector<uint8_t> request;
+      bool     chunked      = false;
+      bool     request_done = false;
+      bool     waiting      = false;
+      int64_t  recv_window  = 0;
+      // request body written to the node, not yet acknowledged
+      int64_t  unacked      = 0;
+      Http1_response response;
+      bool     headers_sent = false;
+      bool     end_sent     = false;
+      // response body, until the flow-control windows allow it
+      std::vector<uint8_t> pending;
+      int64_t  send_window  = 0;
+    };
+
+    void read_client();
+    void client_closed();
+    bool process_input();
+    bool handle_frame(uint8_t type, uint8_t flags, uint32_t id,
+                      const uint8_t* payload, uint32_t len);
+    bool handle_headers(uint8_t flags, uint32_t id, const uint8_t*, uint32_t);
+    bool handle_data(uint8_t flags, uint32_t id, const uint8_t*, uint32_t);
+    bool handle_settings(uint8_t flags, uint32_t id, const uint8_t*, uint32_t);
+    bool handle_window_update(uint32_t id, const uint8_t*, uint32_t);
+    bool end_headers();
+    void open_stream(uint32_t id, const header_list_t&, bool end_stream);
+    void attach(H2_stream&, bool signal);
+    void forward_request(H2_stream&);
+    void read_upstream(uint32_t id);
+    void upstream_closed(uint32_t id);
+    void progress(H2_stream&);
+    void send_headers(uint32_t id, const std::vector<uint8_t>& block, bool end_stream);
+    void respond(uint32_t id, int status, bool end_request);
+    void release_upstream(H2_stream&);
+    void fail_stream(H2_stream&);
+    void reset_stream(uint32_t id, uint32_t code);
+    void close_stream(uint32_t id);
+    void connection_error(uint32_t code);
+    void write_frame(uint8_t type, uint8_t flags, uint32_t id,
+                     const void* payload, size_t len);
+    void window_update(uint32_t id, uint32_t increment);
+    void flush();
+    void close();
+
+    Balancer& m_lb;
+    net::Stream_ptr client;
+    std::map<uint32_t, H2_stream> streams;
+    // stream ids waiting for node connections, oldest first
+    std::deque<uint32_t> waiting;
+    Hpack_decoder decoder;
+    Hpack_encoder encoder;
+    std::vector<uint8_t> inbuf;
+    std::vector<uint8_t> outbuf;
+    // header block being assembled from CONTINUATION frames
+    std::vector<uint8_t> header_block;
+    uint32_t header_stream = 0;
+    bool     header_end_stream = false;
+    uint32_t last_stream = 0;
+    // flow control, and the peers limits
+    int64_t  conn_send_window = 65535;
+    int64_t  conn_recv_window = 65535;
+    int64_t  conn_unacked = 0;
+    int64_t  peer_initial_window = 65535;
+    uint32_t peer_max_frame = 16384;
+    bool     m_preface  = false;
+    bool     m_settings = false;
+    bool     m_goaway   = false;
+    bool     m_closed   = false;
+  };
+}
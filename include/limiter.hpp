@@ -0,0 +1,132 @@
+// This file is a part of the IncludeOS unikernel - www.includeos.org
+//
+// Copyright 2018-2019 IncludeOS AS, Oslo, Norway
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include <net/addr.hpp>
+#include <cstdint>
+#include <vector>
+
+namespace microLB
+{
+  // Refills at rate tokens per second, holding at most burst tokens.
+  struct Token_bucket {
+    Token_bucket() = default;
+    Token_bucket(float r, float b, uint64_t now_ns)
+      : rate(r), burst(b), tokens(b), last(now_ns) {}
+
+    inline void refill(uint64_t now_ns) noexcept;
+    inline bool consume(uint64_t now_ns, float n = 1.0f) noexcept;
+    // nanoseconds until n tokens are available (after refill)
+    inline uint64_t time_until(float n) const noexcept;
+
+    float    rate   = 0.0f;
+    float    burst  = 0.0f;
+    float    tokens = 0.0f;
+    uint64_t last   = 0;
+  };
+
+  // mask of an IPv4 subnet, as it is stored in an address
+  inline uint32_t prefix_mask(const int prefix) noexcept
+  {
+    // NOTE: IPv4 addresses are stored in network order
+    const uint32_t host_order = (prefix >= 32) ? 0xffffffff : ~(0xffffffff >> prefix);
+    return __builtin_bswap32(host_order);
+  }
+
+  // Limits for one source address or subnet. Zero means unlimited.
+  struct Client_limits {
+    float rate     = 0.0f; // new connections per second
+    float burst    = 0.0f;
+    int   sessions = 0;    // concurrent connections
+    inline bool enabled() const noexcept {
+      return rate > 0.0f || sessions > 0;
+    }
+  };
+
+  // Per-source (and per-subnet) connection limits for IPv4 clients.
+  // The table has a fixed size and uses open addressing. Entries that
+  // have no connections and a full bucket are stale, and are reused
+  // in place, so nothing is ever allocated or erased after creation.
+  struct Client_limiter {
+    Client_limiter(int table_size, const Client_limits& host,
+                   int subnet_prefix, const Client_limits& subnet);
+
+    // called on SYN, before any connection state exists
+    bool admit(net::ip4::Addr, uint64_t now_ms);
+    // concurrency accounting for accepted clients
+    void opened(net::ip4::Addr, uint64_t now_ms);
+    void closed(net::ip4::Addr);
+
+    inline int capacity() const noexcept;
+    int in_use(uint64_t now_ms) const;
+
+    // statistics
+    int64_t admitted = 0;
+    int64_t rate_limited = 0;
+    int64_t session_limited = 0;
+    // new sources that found no free slot, and were let through
+    int64_t overflows = 0;
+
+  private:
+    struct Entry {
+      uint32_t addr;
+      uint8_t  prefix; // 0 is an empty slot
+      uint8_t  unused;
+      uint16_t sessions;
+      float    tokens;
+      uint32_t last;   // milliseconds
+    };
+    static_assert(sizeof(Entry) == 16, "Entries are 16 bytes");
+
+    Entry* lookup(uint32_t addr, uint8_t prefix, uint32_t now, bool create);
+    bool   is_stale(const Entry&, uint32_t now) const noexcept;
+    inline const Client_limits& limits_for(uint8_t prefix) const noexcept;
+    void   refill(Entry&, uint32_t now) const noexcept;
+
+    std::vector<Entry> table;
+    uint32_t mask = 0;
+    const Client_limits host;
+    const Client_limits subnet;
+    const uint8_t  subnet_prefix;
+    const uint32_t subnet_mask;
+  };
+
+  void Token_bucket::refill(const uint64_t now_ns) noexcept
+  {
+    if (now_ns <= last) return;
+    tokens += (now_ns - last) * 1e-9 * rate;
+    if (tokens > burst) tokens = burst;
+    last = now_ns;
+  }
+  bool Token_bucket::consume(const uint64_t now_ns, const float n) noexcept
+  {
+    this->refill(now_ns);
+    if (tokens < n) return false;
+    tokens -= n;
+    return true;
+  }
+  uint64_t Token_bucket::time_until(const float n) const noexcept
+  {
+    if (tokens >= n) return 0;
+    if (rate <= 0.0f) return UINT64_MAX;
+    return (uint64_t) ((n - tokens) / rate * 1e9f) + 1;
+  }
+
+  int Client_limiter::capacity() const noexcept
+  { return table.size(); }
+  const Client_limits& Client_limiter::limits_for(const uint8_t prefix) const noexcept
+  { return (prefix == 32) ? host : subnet; }
+}
@@ -0,0 +1,60 @@
+// This file is a part of the IncludeOS unikernel - www.includeos.org
+//
+// Copyright 2018-2019 IncludeOS AS, Oslo, Norway
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace microLB
+{
+  // Heap budget for the whole service, as that is what runs out. Past
+  // each watermark (percent of the budget) more is done to stay within:
+  //  soft:     sessions stop reading while session_cap bytes are queued
+  //            towards the other side, and idle pools shrink to pool_keep
+  //  hard:     new clients are refused
+  //  critical: the sessions holding the most buffered data are closed,
+  //            until usage is back under the hard watermark
+  struct Memory_budget {
+    size_t bytes = 0; // 0 is disabled
+    int soft     = 70;
+    int hard     = 85;
+    int critical = 95;
+    int session_cap = 65536;
+    int pool_keep   = 1;
+    // estimated state of each connection, and of each TLS stream
+    int connection_size = 8192;
+    int tls_size        = 40960;
+    std::chrono::milliseconds period {100};
+    bool enabled() const noexcept { return bytes > 0; }
+  };
+
+  enum memory_pressure_t : uint8_t {
+    MEMORY_OK = 0,
+    MEMORY_SOFT,
+    MEMORY_HARD,
+    MEMORY_CRITICAL
+  };
+
+  // What the load balancer holds, partly estimated
+  struct Memory_usage {
+    size_t waiting  = 0; // queued clients, and what they sent while waiting
+    size_t sessions = 0; // session buffers, and data queued for sending
+    size_t pools    = 0; // idle node connections
+    size_t tls      = 0; // TLS state of clients and nodes
+    size_t total() const noexcept { return waiting + sessions + pools + tls; }
+  };
+}
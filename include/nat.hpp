@@ -0,0 +1,86 @@
+// This file is a part of the IncludeOS unikernel - www.includeos.org
+//
+// Copyright 2018-2019 IncludeOS AS, Oslo, Norway
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include <net/ip4/ip4.hpp>
+#include <net/nat/napt.hpp>
+#include <memory>
+
+namespace microLB
+{
+  struct Nodes;
+
+  struct Nat_config {
+    int table_size = 16384;   // tracked connections
+  };
+
+  // Forwards TCP segments for a virtual address and port straight to a
+  // node of a group, without terminating the connections. New connections
+  // are placed round-robin on active nodes, and the conntrack table keeps
+  // them there. Towards the nodes the source is masqueraded, so replies
+  // come back through the load balancer.
+  // NOTE: sessions, TLS and HTTP routing are not available in this mode
+  struct Nat_service {
+    using IP4 = net::IP4;
+    using Conntrack = net::Conntrack;
+    using Filter_verdict = net::Filter_verdict<IP4>;
+
+    Nat_service(Nodes&, net::Inet& clients, uint16_t port,
+                net::Inet& nodes, int group, const Nat_config&);
+    Nat_service(const Nat_service&) = delete;
+    Nat_service& operator=(const Nat_service&) = delete;
+
+    inline size_t active_flows() const noexcept;
+    // packets routed through one of the interfaces, which the balancer
+    // hands to the service of their connection
+    inline bool carries(const net::Inet& source, Conntrack::Entry_ptr) const noexcept;
+    void forward(IP4::IP_packet_ptr, net::Inet& source, Conntrack::Entry_ptr);
+
+    // statistics
+    int64_t created = 0;
+    int64_t forwarded = 0;
+    // packets for new connections without an active node
+    int64_t dropped = 0;
+
+  private:
+    Filter_verdict client_in(IP4::IP_packet_ptr, net::Inet&, Conntrack::Entry_ptr);
+    Filter_verdict client_out(IP4::IP_packet_ptr, net::Inet&, Conntrack::Entry_ptr);
+    Filter_verdict node_in(IP4::IP_packet_ptr, net::Inet&, Conntrack::Entry_ptr);
+    Filter_verdict node_out(IP4::IP_packet_ptr, net::Inet&, Conntrack::Entry_ptr);
+    // connections made to the virtual address
+    inline bool is_flow(Conntrack::Entry_ptr) const noexcept;
+
+    Nodes&      m_nodes;
+    net::Inet&  m_clients;
+    net::Inet&  m_netout;
+    const net::Socket m_vip;
+    const int   m_group;
+    std::shared_ptr<Conntrack> m_ct;
+    net::nat::NAPT m_napt;
+  };
+
+  size_t Nat_service::active_flows() const noexcept
+  { return m_ct->number_of_entries(); }
+  bool Nat_service::carries(const net::Inet& source, Conntrack::Entry_ptr ct) const noexcept
+  {
+    return (&source == &m_clients || &source == &m_netout) && is_flow(ct);
+  }
+  bool Nat_service::is_flow(Conntrack::Entry_ptr ct) const noexcept
+  {
+    return ct != nullptr && ct->proto == net::Protocol::TCP
+        && ct->first.dst == m_vip;
+  }
+}
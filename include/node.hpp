@@ -15,6 +15,7 @@
 // limitations under the License.
 
 #pragma once
+#include "shaper.hpp"
 #include <net/stream.hpp>
 #include <vector>
 #include <chrono>
@@ -26,7 +27,20 @@ namespace microLB
   typedef delegate<void(timeout_t, node_connect_result_t)> node_connect_function_t;
   typedef delegate<void()> pool_signal_t;
 
+  // Connect timeouts that follow the connect times seen for each node,
+  // and hedging: while the pool of a group is empty and clients wait for it,
+  // a connect that is still pending after hedge_delay is raced by one to
+  // another node.
+  struct Connect_policy {
+    float multiplier = 0; // of the p99 connect time, 0 is a fixed timeout
+    timeout_t floor   {200};
+    timeout_t ceiling {10000};
+    timeout_t hedge_delay {0}; // 0 disables hedging
+    bool adaptive() const noexcept { return multiplier > 0; }
+  };
+
   struct Balancer;
+  struct Nodes;
   struct Node {
     Node(Balancer&, net::Socket, node_connect_function_t,
          bool do_active = true, int idx = -1);
@@ -41,18 +55,46 @@ namespace microLB
     void perform_active_check(int);
     void stop_active_check();
     void connect();
+    // for the next connect, from the recent connect times (when adaptive)
+    timeout_t connect_timeout() const noexcept;
     net::Stream_ptr get_connection();
+    // give a connection back to the pool (HTTP keep-alive)
+    void return_connection(net::Stream_ptr);
+    // closes the idle connections above keep, oldest first
+    int  shrink_pool(int keep);
+    // hedging: a connect to this node races one to another node,
+    // and the one that completes last is not pooled
+    void race(int other) noexcept { racing = other; race_lost = false; }
+    void lose_race() noexcept { racing = -1; race_lost = true; }
+    // bandwidth shared by all sessions on this node
+    void set_rates(const Rate_limits&);
+    Shaper* shaper() const noexcept { return m_shaper.get(); }
 
   private:
-    node_connect_function_t m_connect = nullptr;
-    pool_signal_t           m_pool_signal = nullptr;
+    // hot fields first, as they are touched on every assignment
     std::vector<net::Stream_ptr> pool;
-    net::Socket m_socket;
-    int         m_idx;
+    Nodes*      m_nodes;
+    const int   m_idx;
+    int32_t     connecting = 0;
     bool        active = false;
     const bool  do_active_check;
     int32_t     active_timer = -1;
-    int32_t     connecting = 0;
+    node_connect_function_t m_connect = nullptr;
+    pool_signal_t           m_pool_signal = nullptr;
+    net::Socket m_socket;
+    std::unique_ptr<Shaper> m_shaper = nullptr;
+    // recent connect times in microseconds, oldest overwritten first
+    std::vector<uint32_t> connect_times;
+    int32_t     connect_next = 0;
+    timeout_t   m_timeout;
+    int32_t     hedge_timer = -1;
+    int32_t     racing = -1;
+    bool        race_lost = false;
+
+    void connect_done(uint64_t start, bool success);
+    void arm_hedge();
+    // returns false when the connection lost the race
+    bool finish_race(bool success);
   };
 }
 
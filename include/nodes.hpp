@@ -15,6 +15,7 @@
 // limitations under the License.
 
 #pragma once
+#include "memory.hpp"
 #include "node.hpp"
 #include "session.hpp"
 #include <util/timer.hpp>
@@ -35,64 +36,241 @@ namespace microLB
     net::Inet* nodes   = nullptr;
     void* cli_ctx = nullptr;
     void* nod_ctx = nullptr;
+    // streams of other kinds, eg. in benchmarks (subid, outgoing)
+    delegate<net::Stream_ptr(liu::Restore&, int, bool)> restore_stream = nullptr;
+  };
+
+  // One bit per node, so that ready nodes are found a word at a time.
+  struct Node_index {
+    inline void resize(int bits);
+    inline void set(int idx, bool value) noexcept;
+    inline bool test(int idx) const noexcept;
+    // first set bit at or after idx, wrapping around, -1 when empty
+    inline int  next(int idx) const noexcept;
+    inline bool empty() const noexcept { return count == 0; }
+    inline int  size() const noexcept { return count; }
+
+    std::vector<uint64_t> words;
+    int bits  = 0;
+    int count = 0;
+  };
+
+  // Retrying sessions whose node fails before sending any response.
+  // Only a reset or refused TCP connection is a failure, a node that
+  // closes cleanly has answered.
+  struct Retry_policy {
+    int   buffer   = 0; // client bytes kept, 0 disables retries
+    int   attempts = 2; // per request
+    float budget   = 0; // retries per second for all sessions, 0 is unlimited
   };
 
   struct Balancer;
+  struct Waiting;
   struct Nodes {
     typedef std::deque<Node> nodevec_t;
     typedef nodevec_t::iterator iterator;
     typedef nodevec_t::const_iterator const_iterator;
 
-    Nodes(Balancer& b, bool ac) : m_lb(b), do_active_check(ac) {}
+    // named subset of the nodes, chosen by the Router
+    struct Group {
+      Group(const std::string& n) : name(n) {}
+      std::string      name;
+      std::vector<int> members;
+      // node indices where round-robin continues
+      int conn_iterator = 0;
+      int algo_iterator = 0;
+      int flow_iterator = 0;
+      // kept up to date by the nodes
+      int pool = 0;
+      int connecting = 0;
+      Node_index ready;  // nodes with pooled connections
+      Node_index active;
+    };
+
+    Nodes(Balancer& b, bool ac);
 
     inline size_t   size() const noexcept;
+    inline const Node& get_node(int idx) const;
+    inline Node& get_node(int idx);
     inline const_iterator begin() const;
     inline const_iterator end() const;
     inline int32_t open_sessions() const noexcept;
     inline int64_t total_sessions() const noexcept;
     inline int32_t timed_out_sessions() const noexcept;
-    int  pool_connecting() const;
-    int  pool_size() const;
+    inline int     waiting_sessions() const noexcept;
+    inline bool    http_mode() const noexcept;
+    void set_http_mode(bool);
+    inline int pool_connecting() const noexcept;
+    inline int pool_size() const noexcept;
+    inline int pool_connecting(int group) const;
+    inline int pool_size(int group) const;
+    // without active-checks every node counts as active
+    inline int active_nodes() const noexcept;
+
+    // group 0 is the default group
+    int  add_group(const std::string& name);
+    int  find_group(const std::string& name) const;
+    inline int group_count() const noexcept;
+    inline const Group& group(int) const;
 
     template <typename... Args>
     void add_node(Args&&... args);
-    void create_connections(int total);
+    template <typename... Args>
+    void add_group_node(int group, Args&&... args);
+    void create_connections(int total, int group = 0);
     // returns the connection back if the operation fails
-    net::Stream_ptr assign(net::Stream_ptr);
-    Session& create_session(net::Stream_ptr inc, net::Stream_ptr out);
+    net::Stream_ptr assign(net::Stream_ptr, int group = 0);
+    // next node for a forwarded flow, round-robin, or -1 when none are up
+    int select_node(int group);
+    // takes the client connection when successful
+    bool assign(Waiting&);
+    Session& create_session(net::Stream_ptr inc, net::Stream_ptr out,
+                            int node = -1, int frontend = 0);
     void     close_session(int);
+    // the node connection of a session closed
+    void     node_closed(int);
+    // frees a node stream after the callback it is closing from
+    void     retire(net::Stream_ptr);
     void destroy_sessions();
     Session& get_session(int);
     void     close_all_sessions();
+    // HTTP mode: node connections are only held during requests
+    bool reattach(Session&);
+    void detach(Session&);
+    // HTTP/2: node connections lent to one request at a time
+    net::Stream_ptr lend_connection(int& node, int group);
+    void return_connection(int node, net::Stream_ptr);
+    void serve_waiting();
+    void count_waiting(std::vector<int>& per_group) const;
+    inline bool routes_requests() const noexcept;
+    // bandwidth shaping (when enabled)
+    inline bool shaping() const noexcept;
+    void enable_shaping() { this->m_shaping = true; }
+    // sessions wait for the reader or shaper before reading more
+    inline bool throttling() const noexcept;
+    // memory pressure: bytes queued per direction before a session waits,
+    // 0 is unlimited
+    void set_buffer_cap(int bytes) { this->m_buffer_cap = bytes; }
+    inline int  buffer_cap() const noexcept;
+    // closes idle connections above keep per node, returning how many
+    int  shrink_pools(int keep);
+    void count_memory(Memory_usage&, const Memory_budget&) const;
+    // closes the sessions holding the most data, returning the bytes freed
+    size_t shed_sessions(size_t bytes);
+    void shape_nodes(const Rate_limits&);
+    // nanoseconds until the session may read again, 0 after taking tokens
+    uint64_t shape(Session&, Shaper::direction_t, size_t bytes);
+    void set_retry_policy(const Retry_policy&);
+    inline const Retry_policy& retry_policy() const noexcept;
+    void set_connect_policy(const Connect_policy&);
+    inline const Connect_policy& connect_policy() const noexcept;
+    // a connect to the node is slow, race one to another node
+    void hedge_connect(int node);
+    // forwarding once per event loop turn
+    // NOTE: must be set before any sessions are created
+    void set_batching(const Batching& b) { this->m_batching = b; }
+    inline bool batching() const noexcept;
+    // queues the session to be forwarded in the next turn
+    void mark_ready(Session&, Shaper::direction_t);
+    // takes bytes from the sessions share of a turn, or queues it again
+    bool batch_quota(Session&, Shaper::direction_t, size_t bytes);
+    // reading ahead of slow clients
+    void set_response_buffering(const Response_buffering& r) { this->m_response = r; }
+    inline const Response_buffering& response_buffering() const noexcept;
+    inline bool   buffers_responses() const noexcept;
+    // bytes held by all sessions, and whether the total allows more
+    inline size_t response_bytes() const noexcept;
+    inline bool   response_room() const noexcept;
+    void response_changed(int64_t delta);
+    // the session reads ahead again once the others have freed some room
+    void wait_for_room(Session&);
+    // gathering of small writes towards the nodes
+    void set_coalescing(const Coalescing& c) { this->m_coalesce = c; }
+    int  route_request(const Http_framer&, int frontend) const;
+    // called by the nodes, to keep aggregates and indices current
+    void node_pool_changed(int node, int delta);
+    void node_connecting_changed(int node, int delta);
+    void node_active_changed(int node);
+    // a connection was returned from inside a stream callback, so the
+    // waiting clients are served once that callback has returned
+    void signal_pool();
 #if defined(LIVEUPDATE)
     void serialize(liu::Storage&);
     void deserialize(liu::Restore&, DeserializationHelper&);
 #endif
     // make the microLB more testable
+    delegate<void(Session&)> on_session_open = nullptr;
     delegate<void(int idx, int current, int total)> on_session_close = nullptr;
 
   private:
+    net::Stream_ptr get_connection(int& node, int group, int avoid = -1);
+    void run_batch();
+    // prefers the node chosen by the key, while it has idle connections
+    net::Stream_ptr get_affine_connection(int& node, int group, uint32_t key);
+    void retry(Session&);
+
     Balancer& m_lb;
     nodevec_t nodes;
     int64_t   session_total = 0;
     int       session_cnt = 0;
-    int       conn_iterator = 0;
-    int       algo_iterator = 0;
+    int       m_pool = 0;
+    int       m_connecting = 0;
+    int       m_active = 0;
     const bool do_active_check;
+    bool      m_http_mode = false;
+    bool      m_routes_requests = false;
+    bool      m_shaping = false;
+    int       m_buffer_cap = 0;
+    Coalescing m_coalesce;
+    Retry_policy m_retry;
+    Connect_policy m_connect;
+    Response_buffering m_response;
+    size_t    m_response_bytes = 0;
+    Batching  m_batching;
+    // sessions queued for the next turn, and the ones in this turn
+    std::vector<int> ready_sessions;
+    std::vector<int> batch;
+    bool      m_in_batch = false;
+    int64_t   m_quota = 0;
+    Timer     batch_timer;
+    Timer     pool_timer;
+    // sessions waiting for room in the response buffering total
+    Timer     room_timer;
+    std::vector<int> room_waiting;
+    Token_bucket retry_budget;
+    std::vector<Group> groups;
+    std::vector<int>   node_groups;
     Timer cleanup_timer;
+    std::vector<net::Stream_ptr> retired;
     std::deque<Session> sessions;
     std::deque<int> free_sessions;
     std::deque<int> closed_sessions;
+    // sessions waiting for a node connection
+    std::deque<int> waiting;
   };
 
   template <typename... Args>
   inline void Nodes::add_node(Args&&... args) {
+    this->add_group_node(0, std::forward<Args> (args)...);
+  }
+  template <typename... Args>
+  inline void Nodes::add_group_node(int group, Args&&... args) {
+    groups.at(group).members.push_back(nodes.size());
+    node_groups.push_back(group);
+    for (auto& grp : groups) {
+      grp.ready.resize(nodes.size() + 1);
+      grp.active.resize(nodes.size() + 1);
+    }
     nodes.emplace_back(m_lb, std::forward<Args> (args)...,
                        this->do_active_check, nodes.size());
   }
 
   size_t Nodes::size() const noexcept
   { return nodes.size(); }
+  const Node& Nodes::get_node(int idx) const
+  { return nodes.at(idx); }
+  Node& Nodes::get_node(int idx)
+  { return nodes.at(idx); }
   Nodes::const_iterator Nodes::begin() const
   { return nodes.cbegin(); }
   Nodes::const_iterator Nodes::end() const
@@ -103,4 +281,79 @@ namespace microLB
   { return session_total; }
   int32_t Nodes::timed_out_sessions() const noexcept
   { return 0; }
+  int  Nodes::waiting_sessions() const noexcept
+  { return waiting.size(); }
+  bool Nodes::http_mode() const noexcept
+  { return m_http_mode; }
+  bool Nodes::routes_requests() const noexcept
+  { return m_routes_requests; }
+  int  Nodes::pool_connecting() const noexcept
+  { return m_connecting; }
+  int  Nodes::pool_size() const noexcept
+  { return m_pool; }
+  int  Nodes::pool_connecting(int group) const
+  { return groups.at(group).connecting; }
+  int  Nodes::pool_size(int group) const
+  { return groups.at(group).pool; }
+  int  Nodes::active_nodes() const noexcept
+  { return (do_active_check) ? m_active : nodes.size(); }
+  const Retry_policy& Nodes::retry_policy() const noexcept
+  { return m_retry; }
+  const Connect_policy& Nodes::connect_policy() const noexcept
+  { return m_connect; }
+  bool Nodes::shaping() const noexcept
+  { return m_shaping; }
+  bool Nodes::throttling() const noexcept
+  {
+    return m_shaping || m_buffer_cap > 0 || m_response.session > 0
+        || m_batching.quantum > 0;
+  }
+  bool Nodes::batching() const noexcept
+  { return m_batching.quantum > 0; }
+  const Response_buffering& Nodes::response_buffering() const noexcept
+  { return m_response; }
+  bool   Nodes::buffers_responses() const noexcept
+  { return m_response.session > 0; }
+  size_t Nodes::response_bytes() const noexcept
+  { return m_response_bytes; }
+  bool   Nodes::response_room() const noexcept
+  { return m_response.total == 0 || m_response_bytes < m_response.total; }
+  int  Nodes::buffer_cap() const noexcept
+  { return m_buffer_cap; }
+  int  Nodes::group_count() const noexcept
+  { return groups.size(); }
+  const Nodes::Group& Nodes::group(int idx) const
+  { return groups.at(idx); }
+
+  void Node_index::resize(const int nbits)
+  {
+    assert(nbits >= bits);
+    this->bits = nbits;
+    words.resize((nbits + 63) / 64, 0);
+  }
+  void Node_index::set(const int idx, const bool value) noexcept
+  {
+    if (test(idx) == value) return;
+    words[idx / 64] ^= uint64_t(1) << (idx % 64);
+    count += (value) ? 1 : -1;
+  }
+  bool Node_index::test(const int idx) const noexcept
+  {
+    return (words[idx / 64] >> (idx % 64)) & 1;
+  }
+  int Node_index::next(int idx) const noexcept
+  {
+    if (count == 0) return -1;
+    if (idx < 0 || idx >= bits) idx = 0;
+    size_t   w    = idx / 64;
+    uint64_t word = words[w] & (~uint64_t(0) << (idx % 64));
+    // one extra step for the bits below idx in the first word
+    for (size_t n = 0; n <= words.size(); n++)
+    {
+      if (word != 0) return w * 64 + __builtin_ctzll(word);
+      w = (w + 1) % words.size();
+      word = words[w];
+    }
+    return -1;
+  }
 }
@@ -0,0 +1,82 @@
+// This file is a part of the IncludeOS unikernel - www.includeos.org
+//
+// Copyright 2018-2019 IncludeOS AS, Oslo, Norway
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace microLB
+{
+  // Maps Host headers, path prefixes and TLS server names onto node
+  // groups, and TLS server names onto priority classes. Hosts are hashed
+  // (with *.domain wildcards), and paths are matched on the longest
+  // prefix in a trie for each host.
+  struct Router {
+    // an empty host matches any host, an empty path any path
+    void add_rule(const std::string& host, const std::string& path, int group);
+    void add_server_name(const std::string& name, int group);
+    void add_server_name_class(const std::string& name, int cls);
+
+    inline bool has_request_rules() const noexcept;
+    inline bool has_server_name_rules() const noexcept;
+    inline bool has_server_name_classes() const noexcept;
+
+    // returns -1 when there is no match
+    int route(std::string_view host, std::string_view path) const;
+    int route_server_name(std::string_view name) const;
+    int classify_server_name(std::string_view name) const;
+
+  private:
+    struct Trie {
+      void insert(std::string_view prefix, int group);
+      int  longest_match(std::string_view path) const;
+    private:
+      struct Vertex {
+        int group = -1;
+        // (byte, vertex) sorted by byte
+        std::vector<std::pair<char, int>> edges;
+      };
+      std::vector<Vertex> vertices {1};
+    };
+    template <typename T>
+    struct Host_table {
+      T* find(std::string_view host);
+      const T* find(std::string_view host) const;
+      T& insert(const std::string& host);
+      std::unordered_map<std::string, T> exact;
+      // keyed by ".domain" for "*.domain"
+      std::unordered_map<std::string, T> wildcard;
+    };
+
+    Host_table<Trie> hosts;
+    Trie any_host;
+    bool m_any_host = false;
+    Host_table<int> server_names;
+    Host_table<int> server_name_classes;
+  };
+
+  bool Router::has_request_rules() const noexcept
+  { return m_any_host || !hosts.exact.empty() || !hosts.wildcard.empty(); }
+  bool Router::has_server_name_rules() const noexcept
+  { return !server_names.exact.empty() || !server_names.wildcard.empty(); }
+  bool Router::has_server_name_classes() const noexcept
+  {
+    return !server_name_classes.exact.empty()
+        || !server_name_classes.wildcard.empty();
+  }
+}
@@ -16,29 +16,162 @@
 
 #pragma once
 #include <net/stream.hpp>
+#include <chrono>
+#include <deque>
+#include <typeinfo>
+#include <vector>
+#include "http.hpp"
+#include "shaper.hpp"
 
 namespace liu {
   struct Storage;
 }
+namespace net::tcp {
+  class Stream;
+}
 namespace microLB
 {
+  typedef std::vector<net::Stream::buffer_t> readq_t;
+
+  // Small writes are gathered into one write of up to size bytes,
+  // which is delayed by at most delay.
+  struct Coalescing {
+    int size = 0; // 0 is disabled
+    std::chrono::microseconds delay {500};
+  };
+
+  // Data callbacks only queue their session, and the queued sessions are
+  // forwarded together once per event loop turn. Each gets up to quantum
+  // bytes per direction, and a turn ends after tick bytes, so that busy
+  // sessions take turns with the others.
+  struct Batching {
+    int     quantum = 0; // 0 is disabled
+    int64_t tick    = 0; // 0 is unlimited
+  };
+
+  // Node data is read ahead of slow clients, into buffers of up to
+  // session bytes each and total bytes together, so that the nodes are
+  // done with their responses (and in HTTP mode, their connections) sooner.
+  // The buffers go to each client a window of bytes at a time.
+  struct Response_buffering {
+    int    session = 0; // 0 is disabled
+    size_t total   = 0; // 0 is unlimited
+    size_t window  = 65536;
+  };
+
+  // Client data sent to a node that has not responded yet, so that
+  // the session can be retried on another node if that one fails.
+  struct Retry_state {
+    readq_t sent;
+    int  bytes = 0;
+    int  attempts = 0;
+    int  avoid_node = -1;
+    bool armed = false;
+    // the node connection was reset, rather than closed
+    bool reset = false;
+  };
+
+  // Forwarding calls these pairs of client and node stream types directly,
+  // and any other pair through the virtual net::Stream interface.
+  enum forwarding_t : uint8_t {
+    FORWARD_ANY = 0,
+    FORWARD_TCP_TCP,
+    FORWARD_TCP_TLS,
+    FORWARD_TLS_TCP,
+    FORWARD_TLS_TLS
+  };
+  // for a client and node stream type, as made by typeid
+  forwarding_t forwarding_for(const std::type_info& client, const std::type_info& node);
+
   struct Nodes;
   struct Session {
-    Session(Nodes&, int idx, net::Stream_ptr in, net::Stream_ptr out);
+    Session(Nodes&, int idx, net::Stream_ptr in, net::Stream_ptr out, int node = -1);
     inline bool is_alive() const noexcept;
+    // in HTTP mode, sessions have no node connection between requests
+    inline bool is_attached() const noexcept;
+    void attach(net::Stream_ptr out, int node);
+    // forward client data that was read before the session existed
+    void replay(readq_t&);
 #if defined(LIVEUPDATE)
     void serialize(liu::Storage&);
 #endif
 
     Nodes&     parent;
     const int  self;
+    int        node;
+    int        group = 0;
+    int        frontend = 0;
+    // client address, when counted by the frontends limiter
+    net::ip4::Addr source;
     net::Stream_ptr incoming;
     net::Stream_ptr outgoing;
+    // HTTP mode (when enabled)
+    std::unique_ptr<Http_exchange> http = nullptr;
+    bool       waiting = false;
+    // request data read while choosing a node
+    readq_t    readq;
+    // bandwidth shaping (when enabled)
+    std::unique_ptr<Shaper> shaper = nullptr;
+    int        shape_timer[2] = {-1, -1};
+    // waiting for the destination to send what it has, per direction
+    bool       write_wait[2] = {false, false};
+    // write coalescing, indexed by direction (when enabled)
+    const Coalescing* coalesce[2] = {nullptr, nullptr};
+    net::Stream::buffer_t pending[2];
+    int        flush_timer[2] = {-1, -1};
+    // transparent retry (when enabled)
+    Retry_state retry;
+    // response buffering (when enabled)
+    std::deque<net::Stream::buffer_t> response;
+    size_t     response_bytes = 0;
+    // the node has closed, and the session closes once the client has it all
+    bool       draining = false;
+    // batching: directions with data, while queued
+    uint8_t    ready = 0;
+    // identifies the session in a capture (when capturing)
+    uint32_t   capture_id = 0;
+    // chosen when a node is attached
+    forwarding_t forwarding = FORWARD_ANY;
+    // the TCP streams under the client and node streams, when carried
+    // by TCP, and only valid while their stream is
+    net::tcp::Stream* client_tcp = nullptr;
+    net::tcp::Stream* node_tcp = nullptr;
 
     void flush_incoming();
     void flush_outgoing();
+    // batching: data callbacks queue the session instead
+    void incoming_ready();
+    void outgoing_ready();
+    // writes out coalesced data now
+    void flush_pending(Shaper::direction_t);
+    // response buffering: the node closed, returns true when the
+    // session stays open to send the client the rest
+    bool finish_response();
+    // bytes held for the session, including unsent data in its streams
+    size_t buffered() const;
+    // bytes not yet sent in a direction
+    size_t queued(Shaper::direction_t) const;
+    void stop_timers();
+  private:
+    // returns true when reading in this direction must wait
+    bool defer(Shaper::direction_t, size_t bytes);
+    void resume_after(Shaper::direction_t, uint64_t nanos);
+    // the destination of a direction has sent some of its data
+    void written(Shaper::direction_t);
+    void resume(Shaper::direction_t);
+    void flush_response();
+    void buffer_response(net::Stream::buffer_t);
+    void forward(Shaper::direction_t, net::Stream::buffer_t);
+    // the forwarding loops, for concrete stream types
+    template <typename Client, typename Node> void upload(Client&, Node&);
+    template <typename Client, typename Node> void download(Client&, Node&);
+    template <typename Dest>
+    void forward(Dest&, Shaper::direction_t, net::Stream::buffer_t);
+    void retain(const net::Stream::buffer_t&);
   };
 
   bool Session::is_alive() const noexcept
   { return incoming != nullptr; }
+  bool Session::is_attached() const noexcept
+  { return outgoing != nullptr; }
 }
@@ -0,0 +1,67 @@
+// This file is a part of the IncludeOS unikernel - www.includeos.org
+//
+// Copyright 2018-2019 IncludeOS AS, Oslo, Norway
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include "limiter.hpp"
+
+namespace microLB
+{
+  // Bytes per second in each direction. Zero is unlimited.
+  struct Rate_limits {
+    float upload   = 0.0f; // client to node
+    float download = 0.0f; // node to client
+    float burst    = 0.0f; // bytes, defaults to one second
+    inline bool enabled() const noexcept {
+      return upload > 0.0f || download > 0.0f;
+    }
+  };
+
+  // A pair of byte buckets. A bucket may go into debt by one read,
+  // so reads larger than the burst still get through, just later.
+  struct Shaper {
+    enum direction_t {
+      UPLOAD   = 0,
+      DOWNLOAD = 1
+    };
+    Shaper(const Rate_limits&, uint64_t now_ns);
+
+    // nanoseconds until the direction may read again, 0 if it may now
+    inline uint64_t wait_time(direction_t, uint64_t now_ns) noexcept;
+    inline void     consume(direction_t, size_t bytes) noexcept;
+
+    Token_bucket bucket[2];
+  };
+
+  inline Shaper::Shaper(const Rate_limits& limits, const uint64_t now)
+  {
+    const float up   = (limits.burst > 0.0f) ? limits.burst : limits.upload;
+    const float down = (limits.burst > 0.0f) ? limits.burst : limits.download;
+    bucket[UPLOAD]   = Token_bucket(limits.upload, up, now);
+    bucket[DOWNLOAD] = Token_bucket(limits.download, down, now);
+  }
+  uint64_t Shaper::wait_time(const direction_t dir, const uint64_t now) noexcept
+  {
+    auto& b = bucket[dir];
+    if (b.rate <= 0.0f) return 0;
+    b.refill(now);
+    return (b.tokens > 0.0f) ? 0 : b.time_until(1.0f);
+  }
+  void Shaper::consume(const direction_t dir, const size_t bytes) noexcept
+  {
+    auto& b = bucket[dir];
+    if (b.rate > 0.0f) b.tokens -= bytes;
+  }
+}
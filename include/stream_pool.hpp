@@ -0,0 +1,85 @@
+// This file is a part of the IncludeOS unikernel - www.includeos.org
+//
+// Copyright 2018-2019 IncludeOS AS, Oslo, Norway
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include <cstddef>
+#include <utility>
+
+namespace microLB
+{
+  // Recycles memory for objects of (roughly) one type. The slab is
+  // allocated on first use, sized for the given number of objects.
+  // When the slab is exhausted, objects come from the heap instead.
+  struct Arena {
+    Arena() = default;
+    ~Arena();
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    // NOTE: must be called before the first allocation
+    void set_capacity(size_t slots);
+    inline size_t capacity() const noexcept;
+    size_t in_use() const noexcept;
+
+    void* allocate(size_t bytes);
+    static void deallocate(void*) noexcept;
+
+    struct Slab;
+  private:
+    Slab*  slab = nullptr;
+    size_t m_capacity = 0;
+  };
+
+  size_t Arena::capacity() const noexcept
+  { return m_capacity; }
+
+  // Stream wrappers used by one balancer
+  struct Stream_pools {
+    Arena tcp;
+    Arena tls;
+    // under TLS streams, while cycles are counted
+    Arena stage;
+  };
+
+  // T allocated from an arena, and returned to it on delete,
+  // including when deleted through a net::Stream_ptr
+  template <typename T>
+  struct Pooled final : public T {
+    using T::T;
+
+    // a null arena means the object is allocated on the heap
+    static void* operator new(size_t size, Arena* arena) {
+      static_assert(alignof(T) <= 16, "Over-aligned types are not supported");
+      if (arena == nullptr) {
+        Arena heap;
+        return heap.allocate(size);
+      }
+      return arena->allocate(size);
+    }
+    static void operator delete(void* ptr) noexcept {
+      Arena::deallocate(ptr);
+    }
+    static void operator delete(void* ptr, Arena*) noexcept {
+      Arena::deallocate(ptr);
+    }
+  };
+
+  template <typename T, typename... Args>
+  inline T* make_pooled(Arena* arena, Args&&... args)
+  {
+    return new (arena) Pooled<T> (std::forward<Args> (args)...);
+  }
+}
@@ -0,0 +1,112 @@
+// This file is a part of the IncludeOS unikernel - www.includeos.org
+//
+// Copyright 2018-2019 IncludeOS AS, Oslo, Norway
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include <util/delegate.hpp>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+
+// number of records kept, must be a power of two
+#ifndef MICROLB_TRACE_SIZE
+#define MICROLB_TRACE_SIZE  8192
+#endif
+
+namespace microLB
+{
+  enum trace_event_t : uint16_t {
+    TRACE_NONE = 0,
+    TRACE_ACCEPT,         // frontend, group
+    TRACE_REJECT,         // frontend, reason, waiting
+    TRACE_QUEUE,          // frontend, group, queue size
+    TRACE_ROUTE,          // frontend, group, bytes read
+    TRACE_ASSIGN,         // session, node, frontend
+    TRACE_CONNECT_START,  // node, connecting
+    TRACE_CONNECT_END,    // node, success, pool size
+    TRACE_POOL_SIGNAL,    // node, pool size
+    TRACE_REATTACH,       // session, node
+    TRACE_DETACH,         // session, node
+    TRACE_SESSION_CLOSE,  // session, node, open sessions
+    TRACE_RETRY,          // session, failed node, attempt
+    TRACE_UDP_FLOW,       // node, active flows
+    TRACE_NAT_FLOW,       // node, tracked connections
+    TRACE_SERIALIZE,      // sessions
+    TRACE_DESERIALIZE,    // sessions
+    TRACE_WARM_START,     // active nodes, pool size, timed out
+    TRACE_H2_STREAM,      // stream, node, open streams
+    TRACE_MEMORY,         // pressure, heap percent, sessions closed
+    TRACE_HEDGE,          // slow node, other node
+    TRACE_EVENT_MAX
+  };
+  // reasons for TRACE_REJECT
+  enum trace_reject_t : int32_t {
+    REJECT_WAITQ = 0,
+    REJECT_LIMITER,
+    REJECT_WARMING,       // unused, kept so that the values stay
+    REJECT_CLASS,
+    REJECT_MEMORY
+  };
+
+  struct Trace_record {
+    uint64_t nanos;
+    uint16_t event;
+    uint16_t unused;
+    int32_t  a;
+    int32_t  b;
+    int32_t  c;
+  };
+  static_assert(sizeof(Trace_record) == 24, "Trace records are 24 bytes");
+
+  // Always-on ring of the most recent events. There is one writer (the
+  // event loop) and the only shared state is the head counter, so readers
+  // never block it. Old records are overwritten.
+  struct Trace_ring {
+    typedef delegate<void(const Trace_record&)> read_func_t;
+
+    inline void add(trace_event_t, int32_t a = 0, int32_t b = 0, int32_t c = 0) noexcept;
+    // records written so far, including the overwritten ones
+    inline uint64_t total() const noexcept;
+    static constexpr uint64_t capacity() noexcept { return MICROLB_TRACE_SIZE; }
+
+    // reads records from cursor until the newest, returning the next cursor
+    // NOTE: call again with the result to stream new records
+    uint64_t read(uint64_t cursor, read_func_t) const;
+    // prints the newest records, oldest first
+    void print(FILE*, uint64_t count = MICROLB_TRACE_SIZE) const;
+    static const char* event_name(uint16_t);
+
+    bool enabled = true;
+  private:
+    static_assert((MICROLB_TRACE_SIZE & (MICROLB_TRACE_SIZE-1)) == 0,
+                  "Trace size must be a power of two");
+    Trace_record ring[MICROLB_TRACE_SIZE];
+    std::atomic<uint64_t> head {0};
+  };
+  extern Trace_ring trace;
+
+  uint64_t trace_clock() noexcept;
+
+  void Trace_ring::add(const trace_event_t event,
+                       const int32_t a, const int32_t b, const int32_t c) noexcept
+  {
+    if (enabled == false) return;
+    const uint64_t idx = head.load(std::memory_order_relaxed);
+    ring[idx & (MICROLB_TRACE_SIZE-1)] = {trace_clock(), event, 0, a, b, c};
+    head.store(idx + 1, std::memory_order_release);
+  }
+  uint64_t Trace_ring::total() const noexcept
+  { return head.load(std::memory_order_acquire); }
+}
@@ -21,6 +21,179 @@
 
 namespace microLB
 {
+  static void add_node_list(Balancer& balancer, const rapidjson::Value& nodelist,
+                            netstack_t& netout, void* node_tls, const int group)
+  {
+    assert(nodelist.IsArray());
+    for (auto& node : nodelist.GetArray())
+    {
+      // nodes contain an array of [addr, port]
+      assert(node.IsArray());
+      const auto addr = node.GetArray();
+      assert(addr.Size() == 2);
+      // port must be valid
+      unsigned port = addr[1].GetUint();
+      assert(port > 0 && port < 65536 && "Port is a number between 1 and 65535");
+      // try to construct socket from string
+      net::Socket socket{
+        net::ip4::Addr{addr[0].GetString()}, (uint16_t) port
+      };
+      if (node_tls != nullptr)
+        balancer.nodes.add_group_node(group, socket,
+            Balancer::connect_with_tls(netout, socket, node_tls, &balancer.stream_pools));
+      else
+        balancer.nodes.add_group_node(group, socket,
+            Balancer::connect_with_tcp(netout, socket, &balancer.stream_pools));
+    }
+  }
+
+  static Client_limits read_limits(const rapidjson::Value& obj, const std::string& prefix)
+  {
+    Client_limits limits;
+    if (obj.HasMember((prefix + "rate").c_str())) {
+      limits.rate  = obj[(prefix + "rate").c_str()].GetFloat();
+      // without a burst, allow one second worth of connections
+      limits.burst = limits.rate;
+    }
+    if (obj.HasMember((prefix + "burst").c_str())) {
+      limits.burst = obj[(prefix + "burst").c_str()].GetFloat();
+    }
+    if (obj.HasMember((prefix + "sessions").c_str())) {
+      limits.sessions = obj[(prefix + "sessions").c_str()].GetUint();
+    }
+    if (limits.rate > 0.0f && limits.burst < 1.0f)
+        throw std::runtime_error("Client limit burst must be at least 1");
+    return limits;
+  }
+
+  static Rate_limits read_rates(const rapidjson::Value& obj)
+  {
+    Rate_limits limits;
+    if (obj.HasMember("upload"))   limits.upload   = obj["upload"].GetFloat();
+    if (obj.HasMember("download")) limits.download = obj["download"].GetFloat();
+    if (obj.HasMember("burst"))    limits.burst    = obj["burst"].GetFloat();
+    return limits;
+  }
+
+  static Coalescing read_coalescing(const rapidjson::Value& obj)
+  {
+    Coalescing config;
+    // by default, one TCP segment
+    config.size = 1460;
+    if (obj.HasMember("size")) config.size = obj["size"].GetUint();
+    if (obj.HasMember("delay_us")) {
+      config.delay = std::chrono::microseconds(obj["delay_us"].GetUint());
+    }
+    return config;
+  }
+
+  static void read_class(Balancer& balancer, const rapidjson::Value& obj)
+  {
+    const std::string name = obj["name"].GetString();
+    int priority = 0, weight = 1, queue_limit = 0;
+    if (obj.HasMember("priority"))    priority    = obj["priority"].GetInt();
+    if (obj.HasMember("weight"))      weight      = obj["weight"].GetUint();
+    if (obj.HasMember("queue_limit")) queue_limit = obj["queue_limit"].GetUint();
+    if (weight <= 0)
+        throw std::runtime_error("Priority class " + name + " must have a positive weight");
+    if (balancer.find_class(name) >= 0)
+        throw std::runtime_error("Duplicate priority class " + name);
+    const int cls = balancer.add_class(name, priority, weight, queue_limit);
+
+    if (obj.HasMember("subnets"))
+    {
+      for (auto& subnet : obj["subnets"].GetArray())
+      {
+        const std::string str = subnet.GetString();
+        const size_t slash = str.find('/');
+        const int prefix = (slash != std::string::npos) ? std::stoi(str.substr(slash+1)) : 32;
+        if (prefix < 0 || prefix > 32)
+            throw std::runtime_error("Invalid subnet " + str);
+        balancer.classify_subnet(net::ip4::Addr(str.substr(0, slash)), prefix, cls);
+      }
+    }
+    if (obj.HasMember("sni"))
+    {
+      for (auto& server_name : obj["sni"].GetArray()) {
+        balancer.router.add_server_name_class(server_name.GetString(), cls);
+      }
+    }
+  }
+
+  static void open_frontend(Balancer& balancer, const rapidjson::Value& service,
+                            netstack_t& netinc, const int port, const int frontend)
+  {
+    // per-client limits (optional)
+    if (service.HasMember("limits"))
+    {
+      auto& limits = service["limits"];
+      int table_size = 4096;
+      if (limits.HasMember("table_size")) {
+        table_size = limits["table_size"].GetUint();
+      }
+      int subnet_prefix = 24;
+      if (limits.HasMember("subnet_prefix")) {
+        subnet_prefix = limits["subnet_prefix"].GetUint();
+      }
+      if (subnet_prefix < 1 || subnet_prefix > 31)
+          throw std::runtime_error("Client limit subnet_prefix must be within 1-31");
+      balancer.get_frontend(frontend).limiter = std::make_unique<Client_limiter> (
+            table_size, read_limits(limits, ""),
+            subnet_prefix, read_limits(limits, "subnet_"));
+    }
+    // bandwidth shaping (optional)
+    if (service.HasMember("shaping"))
+    {
+      auto& shaping = service["shaping"];
+      Rate_limits per_session, total;
+      if (shaping.HasMember("session")) per_session = read_rates(shaping["session"]);
+      if (shaping.HasMember("total"))   total = read_rates(shaping["total"]);
+      balancer.shape_clients(frontend, per_session, total);
+    }
+    // write coalescing towards clients (optional)
+    if (service.HasMember("coalesce")) {
+      balancer.get_frontend(frontend).coalesce = read_coalescing(service["coalesce"]);
+    }
+    // priority class of its clients (optional)
+    if (service.HasMember("class"))
+    {
+      const std::string name = service["class"].GetString();
+      const int cls = balancer.find_class(name);
+      if (cls < 0) throw std::runtime_error("Unknown priority class " + name);
+      balancer.get_frontend(frontend).priority_class = cls;
+    }
+    // HTTP/2 clients, negotiated in the TLS handshake (optional)
+    if (service.HasMember("http2") && service["http2"].GetBool())
+    {
+      if (service.HasMember("certificate") == false)
+          throw std::runtime_error("HTTP/2 requires a TLS certificate");
+      balancer.get_frontend(frontend).http2 = true;
+    }
+    // TLS terminated by the nodes, routed on the server name (optional)
+    if (service.HasMember("passthrough") && service["passthrough"].GetBool())
+    {
+      if (service.HasMember("certificate") || balancer.get_frontend(frontend).http2)
+          throw std::runtime_error("TLS passthrough can not be combined with a certificate");
+      bool affinity = false;
+      if (service.HasMember("sni_affinity")) {
+        affinity = service["sni_affinity"].GetBool();
+      }
+      balancer.open_for_passthrough(netinc, port, frontend, affinity);
+    }
+    else if (service.HasMember("certificate"))
+    {
+      assert(service.HasMember("key") && "TLS-enabled microLB must also have key");
+      // open for load balancing over TLS
+      balancer.open_for_ossl(netinc, port,
+            service["certificate"].GetString(),
+            service["key"].GetString(), frontend);
+    }
+    else {
+      // open for TCP connections
+      balancer.open_for_tcp(netinc, port, frontend);
+    }
+  }
+
   Balancer* Balancer::from_config()
   {
     rapidjson::Document doc;
@@ -40,10 +213,8 @@ namespace microLB
     assert(CLIENT_PORT > 0 && CLIENT_PORT < 65536);
     // client wait queue limit
     const int CLIENT_WAITQ = clients["waitq_limit"].GetUint();
-    (void) CLIENT_WAITQ;
     // client session limit
     const int CLIENT_SLIMIT = clients["session_limit"].GetUint();
-    (void) CLIENT_SLIMIT;
 
     auto& nodes = obj["nodes"];
     // node interface
@@ -57,38 +228,271 @@ namespace microLB
 
     // create closed load balancer
     auto* balancer = new Balancer(use_active_check);
+    balancer->add_frontend("default", 0, CLIENT_WAITQ, CLIENT_SLIMIT);
+    int total_slimit = CLIENT_SLIMIT;
 
-    if (clients.HasMember("certificate"))
+    // node TLS (optional)
+    void* node_tls = nullptr;
+    if (nodes.HasMember("tls") && nodes["tls"].GetBool())
     {
-      assert(clients.HasMember("key") && "TLS-enabled microLB must also have key");
-      // open for load balancing over TLS
-      balancer->open_for_ossl(netinc, CLIENT_PORT,
-            clients["certificate"].GetString(),
-            clients["key"].GetString());
+      bool verify = false;
+      if (nodes.HasMember("tls_verify")) {
+        verify = nodes["tls_verify"].GetBool();
+      }
+      std::string ca_cert;
+      if (nodes.HasMember("ca_certificate")) {
+        ca_cert = nodes["ca_certificate"].GetString();
+      }
+      node_tls = balancer->create_node_tls_context(verify, ca_cert);
     }
-    else {
-      // open for TCP connections
-      balancer->open_for_tcp(netinc, CLIENT_PORT);
+
+    // startup gate (optional)
+    // NOTE: before any listener is opened
+    if (obj.HasMember("warm_start"))
+    {
+      auto& warm = obj["warm_start"];
+      Warm_start config;
+      if (warm.HasMember("nodes"))   config.nodes = warm["nodes"].GetUint();
+      if (warm.HasMember("pool"))    config.pool  = warm["pool"].GetUint();
+      if (warm.HasMember("timeout")) {
+        config.timeout = std::chrono::seconds(warm["timeout"].GetUint());
+      }
+      if (config.timeout.count() == 0)
+          throw std::runtime_error("Warm start timeout must be positive");
+      balancer->warm_start(config);
+    }
+    // heap budget (optional)
+    // NOTE: before any listener is opened
+    if (obj.HasMember("memory"))
+    {
+      auto& memory = obj["memory"];
+      Memory_budget config;
+      config.bytes = (size_t) memory["budget_mb"].GetUint() * 1024 * 1024;
+      if (memory.HasMember("soft"))     config.soft = memory["soft"].GetUint();
+      if (memory.HasMember("hard"))     config.hard = memory["hard"].GetUint();
+      if (memory.HasMember("critical")) config.critical = memory["critical"].GetUint();
+      if (memory.HasMember("session_cap")) config.session_cap = memory["session_cap"].GetUint();
+      if (memory.HasMember("pool_keep"))   config.pool_keep = memory["pool_keep"].GetUint();
+      if (memory.HasMember("connection_size")) {
+        config.connection_size = memory["connection_size"].GetUint();
+      }
+      if (memory.HasMember("tls_size")) config.tls_size = memory["tls_size"].GetUint();
+      if (memory.HasMember("period")) {
+        config.period = std::chrono::milliseconds(memory["period"].GetUint());
+      }
+      if (config.soft > config.hard || config.hard > config.critical || config.critical > 100)
+          throw std::runtime_error("Memory watermarks must be soft <= hard <= critical <= 100");
+      if (config.period.count() == 0)
+          throw std::runtime_error("Memory check period must be positive");
+      balancer->memory_budget(config);
+    }
+    // forwarding once per event loop turn (optional)
+    // NOTE: before any listener is opened
+    if (obj.HasMember("batching"))
+    {
+      auto& batching = obj["batching"];
+      Batching config;
+      config.quantum = 16384;
+      if (batching.HasMember("quantum")) config.quantum = batching["quantum"].GetUint();
+      if (batching.HasMember("tick"))    config.tick = batching["tick"].GetUint64();
+      balancer->nodes.set_batching(config);
+    }
+    // traffic capture, for replaying it later (optional)
+    if (obj.HasMember("capture"))
+    {
+      auto& cap = obj["capture"];
+      Capture_config config;
+      if (cap.HasMember("limit_mb")) config.limit = (size_t) cap["limit_mb"].GetUint() * 1024 * 1024;
+      if (cap.HasMember("payload"))  config.payload = cap["payload"].GetUint();
+      if (config.limit < 1024 * 1024 || config.payload > UINT16_MAX)
+          throw std::runtime_error("Capture needs limit_mb >= 1 and payload <= 65535");
+      capture.start(config);
+    }
+    // priority classes for waiting clients (optional)
+    if (obj.HasMember("classes"))
+    {
+      auto& classes = obj["classes"];
+      assert(classes.IsArray());
+      // class 0 is used by clients that match nothing else
+      for (auto& entry : classes.GetArray()) {
+        if (std::string(entry["name"].GetString()) == "default") read_class(*balancer, entry);
+      }
+      balancer->get_class(0);
+      for (auto& entry : classes.GetArray()) {
+        if (std::string(entry["name"].GetString()) != "default") read_class(*balancer, entry);
+      }
     }
+    open_frontend(*balancer, clients, netinc, CLIENT_PORT, 0);
     // by default its this interface for nodes
     balancer->de_helper.nodes = &netout;
 
-    auto& nodelist = nodes["list"];
-    assert(nodelist.IsArray());
-    for (auto& node : nodelist.GetArray())
+    // adaptive connect timeouts, and hedging (optional)
+    // NOTE: before the nodes, as they start connecting right away
+    if (nodes.HasMember("connect"))
     {
-      // nodes contain an array of [addr, port]
-      assert(node.IsArray());
-      const auto addr = node.GetArray();
-      assert(addr.Size() == 2);
-      // port must be valid
-      unsigned port = addr[1].GetUint();
-      assert(port > 0 && port < 65536 && "Port is a number between 1 and 65535");
-      // try to construct socket from string
-      net::Socket socket{
-        net::ip4::Addr{addr[0].GetString()}, (uint16_t) port
-      };
-      balancer->nodes.add_node(socket, Balancer::connect_with_tcp(netout, socket));
+      auto& connect = nodes["connect"];
+      Connect_policy policy;
+      policy.multiplier = 3;
+      if (connect.HasMember("multiplier")) policy.multiplier = connect["multiplier"].GetFloat();
+      if (connect.HasMember("floor_ms")) {
+        policy.floor = std::chrono::milliseconds(connect["floor_ms"].GetUint());
+      }
+      if (connect.HasMember("ceiling_ms")) {
+        policy.ceiling = std::chrono::milliseconds(connect["ceiling_ms"].GetUint());
+      }
+      if (connect.HasMember("hedge_ms")) {
+        policy.hedge_delay = std::chrono::milliseconds(connect["hedge_ms"].GetUint());
+      }
+      if (policy.multiplier < 0 || policy.floor > policy.ceiling || policy.ceiling.count() == 0)
+          throw std::runtime_error("Invalid node connect timeouts");
+      balancer->nodes.set_connect_policy(policy);
+    }
+    // default group
+    add_node_list(*balancer, nodes["list"], netout, node_tls, 0);
+    // named node groups (optional)
+    if (nodes.HasMember("groups"))
+    {
+      for (auto& grp : nodes["groups"].GetObject())
+      {
+        const int group = balancer->nodes.add_group(grp.name.GetString());
+        add_node_list(*balancer, grp.value["list"], netout, node_tls, group);
+      }
+    }
+    // retrying on another node, when one fails before responding (optional)
+    if (nodes.HasMember("retry"))
+    {
+      auto& retry = nodes["retry"];
+      Retry_policy policy;
+      policy.buffer = 16384;
+      if (retry.HasMember("buffer"))   policy.buffer   = retry["buffer"].GetUint();
+      if (retry.HasMember("attempts")) policy.attempts = retry["attempts"].GetUint();
+      if (retry.HasMember("budget"))   policy.budget   = retry["budget"].GetFloat();
+      balancer->nodes.set_retry_policy(policy);
+    }
+    // write coalescing towards nodes (optional)
+    if (nodes.HasMember("coalesce")) {
+      balancer->nodes.set_coalescing(read_coalescing(nodes["coalesce"]));
+    }
+    // reading responses ahead of slow clients (optional)
+    if (nodes.HasMember("buffer_responses"))
+    {
+      auto& buffering = nodes["buffer_responses"];
+      Response_buffering config;
+      config.session = 262144;
+      if (buffering.HasMember("session")) config.session = buffering["session"].GetUint();
+      if (buffering.HasMember("total"))   config.total   = buffering["total"].GetUint64();
+      if (buffering.HasMember("window"))  config.window  = buffering["window"].GetUint64();
+      if (config.session <= 0)
+          throw std::runtime_error("Response buffering needs a session budget");
+      if (config.window == 0)
+          throw std::runtime_error("Response buffering needs a client window");
+      balancer->nodes.set_response_buffering(config);
+    }
+    // bandwidth of each node (optional)
+    if (nodes.HasMember("shaping")) {
+      balancer->nodes.shape_nodes(read_rates(nodes["shaping"]));
+    }
+    // routing rules (optional)
+    if (obj.HasMember("routes"))
+    {
+      auto& routes = obj["routes"];
+      assert(routes.IsArray());
+      for (auto& route : routes.GetArray())
+      {
+        const std::string name = route["group"].GetString();
+        const int group = balancer->nodes.find_group(name);
+        if (group < 0)
+            throw std::runtime_error("Route to unknown node group " + name);
+        if (route.HasMember("sni")) {
+          balancer->router.add_server_name(route["sni"].GetString(), group);
+        }
+        if (route.HasMember("host") || route.HasMember("path"))
+        {
+          const std::string host = (route.HasMember("host")) ? route["host"].GetString() : "";
+          const std::string path = (route.HasMember("path")) ? route["path"].GetString() : "";
+          balancer->router.add_rule(host, path, group);
+        }
+      }
+    }
+    // additional listeners, each with its own limits and group (optional)
+    if (obj.HasMember("services"))
+    {
+      auto& services = obj["services"];
+      assert(services.IsArray());
+      for (auto& service : services.GetArray())
+      {
+        const std::string name = service["name"].GetString();
+        int group = 0;
+        if (service.HasMember("group"))
+        {
+          group = balancer->nodes.find_group(service["group"].GetString());
+          if (group < 0)
+              throw std::runtime_error("Service " + name + " uses unknown node group");
+        }
+        const int waitq  = service["waitq_limit"].GetUint();
+        const int slimit = service["session_limit"].GetUint();
+        const int port   = service["port"].GetUint();
+        assert(port > 0 && port < 65536);
+        auto& netsvc = net::Interfaces::get(service["iface"].GetInt());
+
+        const int fidx = balancer->add_frontend(name, group, waitq, slimit);
+        open_frontend(*balancer, service, netsvc, port, fidx);
+        total_slimit += slimit;
+      }
+    }
+    // UDP services (optional)
+    if (obj.HasMember("udp"))
+    {
+      auto& services = obj["udp"];
+      assert(services.IsArray());
+      for (auto& service : services.GetArray())
+      {
+        int group = 0;
+        if (service.HasMember("group"))
+        {
+          group = balancer->nodes.find_group(service["group"].GetString());
+          if (group < 0)
+              throw std::runtime_error("UDP service uses unknown node group");
+        }
+        Udp_config config;
+        if (service.HasMember("node_port"))    config.node_port  = service["node_port"].GetUint();
+        if (service.HasMember("table_size"))   config.table_size = service["table_size"].GetUint();
+        if (service.HasMember("idle_timeout")) {
+          config.idle_timeout = std::chrono::seconds(service["idle_timeout"].GetUint());
+        }
+        const int port = service["port"].GetUint();
+        assert(port > 0 && port < 65536);
+        auto& netsvc = net::Interfaces::get(service["iface"].GetInt());
+        balancer->open_for_udp(netsvc, port, netout, group, config);
+      }
+    }
+    // TCP services forwarded per packet (optional)
+    if (obj.HasMember("nat"))
+    {
+      auto& services = obj["nat"];
+      assert(services.IsArray());
+      for (auto& service : services.GetArray())
+      {
+        int group = 0;
+        if (service.HasMember("group"))
+        {
+          group = balancer->nodes.find_group(service["group"].GetString());
+          if (group < 0)
+              throw std::runtime_error("NAT service uses unknown node group");
+        }
+        Nat_config config;
+        if (service.HasMember("table_size")) config.table_size = service["table_size"].GetUint();
+        const int port = service["port"].GetUint();
+        assert(port > 0 && port < 65536);
+        auto& netsvc = net::Interfaces::get(service["iface"].GetInt());
+        balancer->open_for_nat(netsvc, port, netout, group, config);
+      }
+    }
+    balancer->init_stream_pools(total_slimit);
+    // HTTP/1.1 mode (optional)
+    // NOTE: after routes, as they decide whether requests are routed
+    if (clients.HasMember("http")) {
+      balancer->nodes.set_http_mode(clients["http"].GetBool());
     }
 
 #if defined(LIVEUPDATE)
@@ -19,6 +19,9 @@
 
 #define MAX_OUTGOING_ATTEMPTS    100
 #define CONNECT_THROW_PERIOD     20s
+// give up routing on the request header after this many bytes
+#define MAX_ROUTING_BYTES        16384
+#define WARM_CHECK_PERIOD        100ms
 
 #define LB_VERBOSE 0
 #if LB_VERBOSE
@@ -29,6 +32,15 @@
 
 using namespace std::chrono;
 
+static inline uint64_t millis_now()
+{
+  return os::nanos_since_boot() / 1000000;
+}
+static inline int session_limit(const microLB::Frontend& frontend)
+{
+  return (frontend.session_limit > 0) ? frontend.session_limit : INT32_MAX;
+}
+
 // NOTE: Do NOT move microLB::Balancer while in operation!
 // It uses tons of delegates that capture "this"
 namespace microLB
@@ -36,54 +48,492 @@ namespace microLB
   Balancer::Balancer(const bool da) : nodes {*this, da}  {}
   Balancer::~Balancer()
   {
-    queue.clear();
+    if (warm_timer != Timers::UNUSED_ID) Timers::stop(warm_timer);
+    if (memory_timer != Timers::UNUSED_ID) Timers::stop(memory_timer);
+    for (auto& cls : classes) cls.queue.clear();
+    h2_clients.clear();
+    if (h2_cleanup_timer != Timers::UNUSED_ID) Timers::stop(h2_cleanup_timer);
     nodes.close_all_sessions();
-    if (tls_free) tls_free();
+    for (auto& frontend : frontends) {
+      if (frontend.tls_free) frontend.tls_free();
+    }
+    if (node_tls_free) node_tls_free();
+  }
+  int Balancer::add_frontend(const std::string& name, const int group,
+                             const int waitq_limit, const int session_limit)
+  {
+    assert(group >= 0 && group < nodes.group_count());
+    const int idx = frontends.size();
+    frontends.emplace_back(idx, name, group);
+    frontends.back().waitq_limit   = waitq_limit;
+    frontends.back().session_limit = session_limit;
+    return idx;
+  }
+  Frontend& Balancer::get_frontend(const int idx)
+  {
+    if (idx == 0 && frontends.empty()) this->add_frontend("default");
+    return frontends.at(idx);
+  }
+  int Balancer::add_class(const std::string& name, const int priority,
+                          const int weight, const int queue_limit)
+  {
+    assert(weight > 0);
+    assert(find_class(name) < 0 && "Priority class names must be unique");
+    const int idx = classes.size();
+    classes.emplace_back(idx, name);
+    auto& cls = classes.back();
+    cls.priority    = priority;
+    cls.weight      = weight;
+    cls.queue_limit = queue_limit;
+    cls.credit      = weight;
+    // stable, so that equal priorities keep their order
+    auto it = std::upper_bound(class_order.begin(), class_order.end(), priority,
+        [this] (int prio, int other) { return prio < classes[other].priority; });
+    class_order.insert(it, idx);
+    return idx;
+  }
+  int Balancer::find_class(const std::string& name) const
+  {
+    for (const auto& cls : classes) {
+      if (cls.name == name) return cls.idx;
+    }
+    return -1;
+  }
+  Priority_class& Balancer::get_class(const int idx)
+  {
+    if (idx == 0 && classes.empty()) this->add_class("default");
+    return classes.at(idx);
+  }
+  void Balancer::classify_subnet(const net::ip4::Addr addr, const int prefix,
+                                 const int cls)
+  {
+    assert(prefix >= 0 && prefix <= 32);
+    assert(cls >= 0 && cls < (int) classes.size());
+    const uint32_t mask = prefix_mask(prefix);
+    auto it = std::upper_bound(class_subnets.begin(), class_subnets.end(), prefix,
+        [] (int pfx, const Subnet_class& other) { return pfx > other.prefix; });
+    class_subnets.insert(it, {addr.whole & mask, mask, prefix, cls});
+  }
+  int Balancer::classify(const net::Stream& conn, const Frontend& frontend) const
+  {
+    if (class_subnets.empty() == false)
+    {
+      const auto remote = conn.remote();
+      if (remote.address().is_v4())
+      {
+        const uint32_t addr = remote.address().v4().whole;
+        for (const auto& subnet : class_subnets) {
+          if ((addr & subnet.mask) == subnet.addr) return subnet.cls;
+        }
+      }
+    }
+    return frontend.priority_class;
+  }
+  void Balancer::shape_clients(const int idx, const Rate_limits& per_session,
+                               const Rate_limits& total)
+  {
+    auto& frontend = this->get_frontend(idx);
+    frontend.session_rates = per_session;
+    frontend.shaper = nullptr;
+    if (total.enabled()) {
+      frontend.shaper = std::make_unique<Shaper> (total, os::nanos_since_boot());
+    }
+    if (per_session.enabled() || total.enabled()) nodes.enable_shaping();
   }
   void Balancer::incoming(net::Stream_ptr conn)
+  {
+      this->incoming(std::move(conn), -1, 0);
+  }
+  void Balancer::incoming(net::Stream_ptr conn, int group, const int fidx,
+                          int cidx, const net::ip4::Addr counted)
   {
       assert(conn != nullptr);
-      queue.emplace_back(std::move(conn));
-      LBOUT("Queueing connection (q=%lu)\n", queue.size());
+      auto& frontend = this->get_frontend(fidx);
+      trace.add(TRACE_ACCEPT, fidx, group);
+      if (frontend.waitq_limit > 0 && frontend.waiting >= frontend.waitq_limit)
+      {
+        trace.add(TRACE_REJECT, fidx, REJECT_WAITQ, frontend.waiting);
+        frontend.rejected++;
+        this->release_client(fidx, counted);
+        conn->reset_callbacks();
+        conn->close();
+        return;
+      }
+      // accepted before the pressure rose, such as during a TLS handshake
+      if (m_pressure >= MEMORY_HARD)
+      {
+        trace.add(TRACE_REJECT, fidx, REJECT_MEMORY);
+        frontend.rejected++;
+        this->release_client(fidx, counted);
+        conn->reset_callbacks();
+        conn->close();
+        return;
+      }
+      if (cidx < 0) cidx = this->classify(*conn, frontend);
+      auto& cls = this->get_class(cidx);
+      if (cls.queue_limit > 0 && (int) cls.queue.size() >= cls.queue_limit)
+      {
+        trace.add(TRACE_REJECT, fidx, REJECT_CLASS, cls.queue.size());
+        cls.rejected++;
+        frontend.rejected++;
+        this->release_client(fidx, counted);
+        conn->reset_callbacks();
+        conn->close();
+        return;
+      }
+      // without routing rules everything goes to the frontends group
+      if (group < 0)
+      {
+        const bool rules = (frontend.passthrough)
+            ? router.has_server_name_rules() || frontend.sni_affinity
+            : router.has_request_rules();
+        if (rules == false) group = frontend.group;
+      }
+      cls.queue.emplace_back(std::move(conn), frontend, group);
+      auto& client = cls.queue.back();
+      client.cls = cidx;
+      if (capture.enabled) {
+        client.capture_id = capture.next_id();
+        capture.accept(client.capture_id, fidx, client.conn->remote());
+      }
+      // counted by the listener, and released when the client is done
+      client.source = counted;
+      trace.add(TRACE_QUEUE, fidx, group, cls.queue.size());
+      if (group < 0) {
+        if (frontend.passthrough) this->route_server_name(client);
+        else this->route_request(client);
+      }
       // IMPORTANT: try to handle queue, in case its ready
       // don't directly call handle_connections() from here!
       this->handle_queue();
   }
-  void Balancer::handle_queue()
+  void Balancer::incoming_http2(net::Stream_ptr conn, const int frontend,
+                                const net::ip4::Addr counted)
   {
-    // check waitq
-    while (nodes.pool_size() > 0 && queue.empty() == false)
+    trace.add(TRACE_ACCEPT, frontend, get_frontend(frontend).group);
+    if (m_pressure >= MEMORY_HARD)
     {
-      auto& client = queue.front();
-      assert(client.conn != nullptr);
-      if (client.conn->is_connected()) {
-        try {
-          // NOTE: explicitly want to copy buffers
-          net::Stream_ptr rval =
-              nodes.assign(std::move(client.conn));
-          if (rval == nullptr) {
-            // done with this queue item
-            queue.pop_front();
-          }
-          else {
-            // put connection back in queue item
-            client.conn = std::move(rval);
-          }
-        } catch (...) {
-          queue.pop_front(); // we have no choice
-          throw;
+      trace.add(TRACE_REJECT, frontend, REJECT_MEMORY);
+      get_frontend(frontend).rejected++;
+      this->release_client(frontend, counted);
+      conn->reset_callbacks();
+      conn->close();
+      return;
+    }
+    h2_clients.emplace_back(*this, std::move(conn), frontend, counted);
+    h2_clients.back().start();
+  }
+  void Balancer::h2_closed()
+  {
+    // closed connections are removed outside of their own callbacks
+    if (h2_cleanup_timer != Timers::UNUSED_ID) return;
+    h2_cleanup_timer = Timers::oneshot(std::chrono::milliseconds(0),
+    [this] (int) {
+        this->h2_cleanup_timer = Timers::UNUSED_ID;
+        h2_clients.remove_if(
+            [] (const Http2_connection& h2) {
+              return h2.is_alive() == false;
+            });
+    });
+  }
+  net::ip4::Addr Balancer::count_client(const int frontend, const net::Socket remote)
+  {
+    auto& fe = this->get_frontend(frontend);
+    if (fe.limiter == nullptr || remote.address().is_v4() == false) return {};
+    const auto source = remote.address().v4();
+    fe.limiter->opened(source, millis_now());
+    return source;
+  }
+  void Balancer::release_client(const int frontend, const net::ip4::Addr source)
+  {
+    if (source.whole != 0) this->get_frontend(frontend).limiter->closed(source);
+  }
+  void Balancer::limit_clients(net::tcp::Listener& listener, const int frontend)
+  {
+    auto* limiter = this->get_frontend(frontend).limiter.get();
+    if (limiter == nullptr && m_memory.enabled() == false) return;
+    // reject before the connection, or any stream, exists
+    listener.on_accept(
+      [this, limiter, frontend] (net::Socket remote) -> bool {
+        Stage_scope scope(STAGE_ACCEPT);
+        if (m_pressure >= MEMORY_HARD) {
+          trace.add(TRACE_REJECT, frontend, REJECT_MEMORY);
+          return false;
+        }
+        if (limiter == nullptr || remote.address().is_v4() == false) return true;
+        if (limiter->admit(remote.address().v4(), millis_now())) return true;
+        trace.add(TRACE_REJECT, frontend, REJECT_LIMITER);
+        return false;
+      });
+  }
+  void Balancer::warm_start(const Warm_start& config)
+  {
+    assert(config.timeout.count() > 0);
+    if (config.enabled() == false) return;
+    this->m_warm_start = config;
+    this->m_warm = false;
+    this->warm_deadline = millis_now() + duration_cast<milliseconds>(config.timeout).count();
+    // NOTE: the nodes are usually added after the listeners
+    this->warm_timer = Timers::periodic(WARM_CHECK_PERIOD, WARM_CHECK_PERIOD,
+      [this] (int) {
+        this->check_warm();
+      });
+  }
+  void Balancer::check_warm()
+  {
+    const auto& config = this->m_warm_start;
+    bool ready = nodes.active_nodes() >= std::min(config.nodes, (int) nodes.size());
+    for (int group = 0; group < nodes.group_count(); group++)
+    {
+      if (nodes.group(group).members.empty()) continue;
+      const int missing = config.pool - nodes.pool_size(group);
+      if (missing <= 0) continue;
+      ready = false;
+      // nobody is waiting yet, so the pools must be filled here
+      const int more = missing - nodes.pool_connecting(group);
+      if (more > 0) nodes.create_connections(more, group);
+    }
+    if (ready)
+        this->open_gate(false);
+    else if (millis_now() >= this->warm_deadline)
+        this->open_gate(true);
+  }
+  void Balancer::open_gate(const bool timed_out)
+  {
+    if (this->warm_timer != Timers::UNUSED_ID) {
+      Timers::stop(this->warm_timer);
+      this->warm_timer = Timers::UNUSED_ID;
+    }
+    this->m_warm = true;
+    trace.add(TRACE_WARM_START, nodes.active_nodes(), nodes.pool_size(), timed_out);
+    // the clients that arrived while warming
+    this->handle_queue();
+  }
+  void Balancer::memory_budget(const Memory_budget& config)
+  {
+    assert(config.soft <= config.hard && config.hard <= config.critical);
+    assert(config.period.count() > 0);
+    if (config.enabled() == false) return;
+    this->m_memory = config;
+    this->memory_timer = Timers::periodic(config.period, config.period,
+      [this] (int) {
+        this->check_memory();
+      });
+  }
+  void Balancer::check_memory()
+  {
+    const size_t used = os::total_memuse();
+    const int percent = used * 100 / m_memory.bytes;
+    memory_pressure_t level = MEMORY_OK;
+    if (percent >= m_memory.critical)  level = MEMORY_CRITICAL;
+    else if (percent >= m_memory.hard) level = MEMORY_HARD;
+    else if (percent >= m_memory.soft) level = MEMORY_SOFT;
+
+    int closed = 0;
+    if (level >= MEMORY_SOFT) {
+      // idle connections are the cheapest to give back
+      nodes.shrink_pools(m_memory.pool_keep);
+    }
+    if (level >= MEMORY_CRITICAL)
+    {
+      // back under the hard watermark
+      const size_t target = used - m_memory.bytes / 100 * m_memory.hard;
+      const int before = nodes.open_sessions();
+      nodes.shed_sessions(target);
+      closed = before - nodes.open_sessions();
+    }
+    if (level != m_pressure || closed > 0) {
+      trace.add(TRACE_MEMORY, level, percent, closed);
+    }
+    if (level != m_pressure) {
+      this->m_pressure = level;
+      nodes.set_buffer_cap((level >= MEMORY_SOFT) ? m_memory.session_cap : 0);
+    }
+  }
+  Memory_usage Balancer::memory_usage() const
+  {
+    Memory_usage usage;
+    const auto& budget = this->m_memory;
+    for (const auto& cls : classes)
+    {
+      for (const auto& client : cls.queue)
+      {
+        if (client.conn == nullptr) continue;
+        usage.waiting += budget.connection_size;
+        for (const auto& buffer : client.readq) usage.waiting += buffer->size();
+        if (client.conn->transport() != nullptr) usage.tls += budget.tls_size;
+      }
+    }
+    // HTTP/2 clients are always TLS
+    usage.sessions += h2_clients.size() * budget.connection_size;
+    usage.tls      += h2_clients.size() * budget.tls_size;
+    nodes.count_memory(usage, budget);
+    if (node_tls_context != nullptr) {
+      usage.tls += (size_t) nodes.pool_size() * budget.tls_size;
+    }
+    return usage;
+  }
+  void Balancer::route_request(Waiting& client)
+  {
+    client.request = std::make_unique<Http_framer> (Http_framer::REQUEST);
+    client.conn->on_data(
+    [this, &client] () {
+      // already routed, the session will read the rest
+      if (client.group >= 0) return;
+      auto& request = *client.request;
+      while (client.conn->next_size() > 0)
+      {
+        auto buffer = client.conn->read_next();
+        if (capture.enabled) {
+          capture.data(client.capture_id, Shaper::UPLOAD, buffer->data(), buffer->size());
+        }
+        request.feed(buffer->data(), buffer->size());
+        client.total += buffer->size();
+        client.readq.push_back(std::move(buffer));
+
+        if (request.headers() > 0) {
+          const int group = router.route(request.host(), request.target());
+          client.group = (group >= 0) ? group : client.frontend->group;
+        }
+        else if (request.is_tunnel() || client.total > MAX_ROUTING_BYTES) {
+          // not HTTP, or too large
+          client.group = client.frontend->group;
+        }
+        if (client.group >= 0)
+        {
+          trace.add(TRACE_ROUTE, client.frontend->idx, client.group, client.total);
+          client.request = nullptr;
+          this->handle_queue();
+          return;
         }
       }
-      else {
-        queue.pop_front();
+    });
+  }
+  void Balancer::route_server_name(Waiting& client)
+  {
+    client.hello = std::make_unique<Client_hello> ();
+    client.conn->on_data(
+    [this, &client] () {
+      // already routed, the session will read the rest
+      if (client.group >= 0) return;
+      auto& hello = *client.hello;
+      while (client.conn->next_size() > 0)
+      {
+        auto buffer = client.conn->read_next();
+        if (capture.enabled) {
+          capture.data(client.capture_id, Shaper::UPLOAD, buffer->data(), buffer->size());
+        }
+        const auto result = hello.feed(buffer->data(), buffer->size());
+        client.total += buffer->size();
+        client.readq.push_back(std::move(buffer));
+        if (result == Client_hello::MORE) continue;
+
+        // not TLS, or no server name, goes to the frontends group
+        auto& frontend = *client.frontend;
+        int group = -1;
+        if (hello.server_name().empty() == false) {
+          group = router.route_server_name(hello.server_name());
+        }
+        client.group = (group >= 0) ? group : frontend.group;
+        if (frontend.sni_affinity) client.affinity = hello.server_name_hash();
+        trace.add(TRACE_ROUTE, frontend.idx, client.group, client.total);
+        client.hello = nullptr;
+        this->handle_queue();
+        return;
       }
-    } // waitq check
+    });
+  }
+  void Balancer::handle_queue()
+  {
+    Stage_scope scope(STAGE_QUEUE);
+    // clients wait in the queues until the gate opens, while
+    // check_warm fills the pools
+    if (this->is_warm() == false) return;
+    // sessions between requests go first (HTTP mode)
+    nodes.serve_waiting();
+    if (h2_waiting > 0) {
+      for (auto& h2 : h2_clients) h2.serve_waiting();
+    }
+    // every queue is scanned at most once
+    for (auto& cls : classes) cls.cursor = cls.queue.begin();
+    // strict priority between levels
+    size_t level = 0;
+    while (level < class_order.size() && nodes.pool_size() > 0)
+    {
+      const int priority = classes[class_order[level]].priority;
+      size_t end = level + 1;
+      while (end < class_order.size()
+          && classes[class_order[end]].priority == priority) end++;
+      this->serve_classes(level, end);
+      level = end;
+    }
     // check if we need to create more connections
     this->handle_connections();
   }
+  void Balancer::serve_classes(const size_t begin, const size_t end)
+  {
+    // deficit round-robin over classes of the same priority,
+    // one client at a time, for as long as any can be served
+    while (nodes.pool_size() > 0)
+    {
+      bool progress = false;
+      for (size_t i = begin; i < end && nodes.pool_size() > 0; i++)
+      {
+        auto& cls = classes[class_order[i]];
+        if (cls.credit <= 0 || cls.cursor == cls.queue.end()) continue;
+        if (this->serve_next(cls)) {
+          cls.credit--;
+          progress = true;
+        }
+      }
+      if (progress) continue;
+      // everyone that can still be served has spent its credit
+      for (size_t i = begin; i < end; i++)
+      {
+        auto& cls = classes[class_order[i]];
+        if (cls.credit <= 0 && cls.cursor != cls.queue.end()) {
+          cls.credit = cls.weight;
+          progress = true;
+        }
+      }
+      if (progress == false) return;
+    }
+  }
+  bool Balancer::serve_next(Priority_class& cls)
+  {
+    auto& it = cls.cursor;
+    while (it != cls.queue.end() && nodes.pool_size() > 0)
+    {
+      auto& client = *it;
+      if (client.conn == nullptr || client.conn->is_connected() == false) {
+        it = cls.queue.erase(it);
+        continue;
+      }
+      // not routed yet, or no connections for its group
+      if (client.group < 0 || nodes.pool_size(client.group) == 0
+          || client.frontend->sessions >= session_limit(*client.frontend)) {
+        ++it;
+        continue;
+      }
+      try {
+        if (nodes.assign(client)) {
+          // done with this queue item
+          it = cls.queue.erase(it);
+          cls.served++;
+          return true;
+        }
+        ++it;
+      } catch (...) {
+        it = cls.queue.erase(it); // we have no choice
+        throw;
+      }
+    }
+    return false;
+  }
   void Balancer::handle_connections()
   {
-    LBOUT("Handle_connections. %lu waiting \n", queue.size());
+    Stage_scope scope(STAGE_CONNECTIONS);
+    LBOUT("Handle_connections. %d waiting \n", this->wait_queue());
     // stop any rethrow timer since this is a de-facto retry
     if (this->throw_retry_timer != Timers::UNUSED_ID) {
         Timers::stop(this->throw_retry_timer);
@@ -93,35 +543,55 @@ namespace microLB
     // prune dead clients because the "number of clients" is being
     // used in a calculation right after this to determine how many
     // nodes to connect to
-    auto new_end = std::remove_if(queue.begin(), queue.end(),
-        [](Waiting& client) {
-          return client.conn == nullptr || client.conn->is_connected() == false;
-        });
-    queue.erase(new_end, queue.end());
-
-    // calculating number of connection attempts to create
-    int np_connecting = nodes.pool_connecting();
-    int estimate = queue.size() - (np_connecting + nodes.pool_size());
-    estimate = std::min(estimate, MAX_OUTGOING_ATTEMPTS);
-    estimate = std::max(0, estimate - np_connecting);
-    // create more outgoing connections
-    LBOUT("Estimated connections needed: %d\n", estimate);
-    if (estimate > 0)
-    {
-      try {
-        nodes.create_connections(estimate);
+    for (auto& cls : classes) {
+      cls.queue.remove_if(
+          [](Waiting& client) {
+            return client.conn == nullptr || client.conn->is_connected() == false;
+          });
+    }
+
+    // clients waiting for each group, kept for has_waiting
+    auto& waiting = this->group_waiting;
+    waiting.assign(nodes.group_count(), 0);
+    for (auto& cls : classes) {
+      for (auto& client : cls.queue) {
+        if (client.group >= 0
+            && client.frontend->sessions < session_limit(*client.frontend))
+            waiting.at(client.group)++;
       }
-      catch (std::exception& e)
+    }
+    nodes.count_waiting(waiting);
+    if (h2_waiting > 0) {
+      for (const auto& h2 : h2_clients) h2.count_waiting(waiting);
+    }
+
+    for (int group = 0; group < nodes.group_count(); group++)
+    {
+      // calculating number of connection attempts to create
+      int np_connecting = nodes.pool_connecting(group);
+      int estimate = waiting[group] - (np_connecting + nodes.pool_size(group));
+      estimate = std::min(estimate, MAX_OUTGOING_ATTEMPTS);
+      estimate = std::max(0, estimate - np_connecting);
+      // create more outgoing connections
+      LBOUT("Estimated connections needed: %d (group %d)\n", estimate, group);
+      if (estimate > 0)
       {
-        this->throw_counter++;
-        // assuming the failure is due to not enough eph. ports
-        this->throw_retry_timer = Timers::oneshot(CONNECT_THROW_PERIOD,
-        [this] (int) {
-            this->throw_retry_timer = Timers::UNUSED_ID;
-            this->handle_connections();
-        });
-      }
-    } // estimate
+        try {
+          nodes.create_connections(estimate, group);
+        }
+        catch (std::exception& e)
+        {
+          this->throw_counter++;
+          // assuming the failure is due to not enough eph. ports
+          this->throw_retry_timer = Timers::oneshot(CONNECT_THROW_PERIOD,
+          [this] (int) {
+              this->throw_retry_timer = Timers::UNUSED_ID;
+              this->handle_connections();
+          });
+          return;
+        }
+      } // estimate
+    }
   } // handle_connections()
 
 #if !defined(LIVEUPDATE)
@@ -129,11 +599,17 @@ namespace microLB
   void init_liveupdate() {}
 #endif
 
-  Waiting::Waiting(net::Stream_ptr incoming)
-    : conn(std::move(incoming)), total(0)
+  Frontend::Frontend(const int i, const std::string& n, const int grp)
+    : idx(i), name(n), group(grp)  {}
+  Priority_class::Priority_class(const int i, const std::string& n)
+    : idx(i), name(n)  {}
+
+  Waiting::Waiting(net::Stream_ptr incoming, Frontend& fe, const int grp)
+    : conn(std::move(incoming)), frontend(&fe), total(0), group(grp)
   {
     assert(this->conn != nullptr);
     assert(this->conn->is_connected());
+    frontend->waiting++;
 
     // Release connection if it closes before it's assigned to a node.
     this->conn->on_close([this](){
@@ -143,4 +619,12 @@ namespace microLB
         this->conn = nullptr;
       });
   }
+  Waiting::~Waiting()
+  {
+    if (frontend == nullptr) return;
+    frontend->waiting--;
+    if (source.whole != 0) frontend->limiter->closed(source);
+    // closed before it got a session
+    if (capture_id != 0 && capture.enabled) capture.close(capture_id);
+  }
 }
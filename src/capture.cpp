@@ -0,0 +1,108 @@
+// This file is a part of the IncludeOS unikernel - www.includeos.org
+//
+// Copyright 2018-2019 IncludeOS AS, Oslo, Norway
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "capture.hpp"
+#include <os.hpp>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+// magic, version and record size
+#define CAPTURE_MAGIC    "microLBc"
+#define CAPTURE_VERSION  1
+#define HEADER_SIZE      16
+
+namespace microLB
+{
+  Capture capture;
+
+  void Capture::start(const Capture_config& config)
+  {
+    assert(config.limit > HEADER_SIZE);
+    assert(config.payload >= 0 && config.payload <= UINT16_MAX);
+    this->m_config = config;
+    this->m_start = os::nanos_since_boot();
+    this->m_dropped = 0;
+    m_buffer.clear();
+    m_buffer.resize(HEADER_SIZE);
+    memcpy(&m_buffer[0], CAPTURE_MAGIC, 8);
+    const uint32_t version = CAPTURE_VERSION;
+    const uint32_t size = sizeof(Capture_record);
+    memcpy(&m_buffer[8], &version, 4);
+    memcpy(&m_buffer[12], &size, 4);
+    this->enabled = true;
+  }
+
+  void Capture::add(const Capture_record& rec, const uint8_t* payload)
+  {
+    const size_t len = sizeof(rec) + rec.payload;
+    if (m_buffer.size() + len > m_config.limit) {
+      m_dropped++;
+      return;
+    }
+    const size_t pos = m_buffer.size();
+    m_buffer.resize(pos + len);
+    memcpy(&m_buffer[pos], &rec, sizeof(rec));
+    if (rec.payload > 0) memcpy(&m_buffer[pos + sizeof(rec)], payload, rec.payload);
+  }
+  void Capture::accept(const uint32_t id, const int frontend, const net::Socket client)
+  {
+    const uint32_t addr = (client.address().is_v4()) ? client.address().v4().whole : 0;
+    this->add({os::nanos_since_boot() - m_start, id, CAPTURE_ACCEPT, 0, 0,
+               frontend, addr});
+  }
+  void Capture::assign(const uint32_t id, const int node)
+  {
+    this->add({os::nanos_since_boot() - m_start, id, CAPTURE_ASSIGN, 0, 0, node, 0});
+  }
+  void Capture::data(const uint32_t id, const int dir, const uint8_t* data,
+                     const size_t len)
+  {
+    const uint16_t payload = std::min<size_t>(m_config.payload, len);
+    this->add({os::nanos_since_boot() - m_start, id, CAPTURE_DATA, (uint8_t) dir,
+               payload, (int32_t) len, 0}, data);
+  }
+  void Capture::close(const uint32_t id)
+  {
+    this->add({os::nanos_since_boot() - m_start, id, CAPTURE_CLOSE, 0, 0, 0, 0});
+  }
+  bool Capture::write(FILE* file) const
+  {
+    return fwrite(m_buffer.data(), 1, m_buffer.size(), file) == m_buffer.size();
+  }
+
+  Capture_reader::Capture_reader(const uint8_t* data, const size_t len)
+    : m_pos(data + HEADER_SIZE), m_end(data + len)
+  {
+    uint32_t version = 0, size = 0;
+    if (len >= HEADER_SIZE) {
+      memcpy(&version, data + 8, 4);
+      memcpy(&size, data + 12, 4);
+    }
+    if (len < HEADER_SIZE || memcmp(data, CAPTURE_MAGIC, 8) != 0
+        || version != CAPTURE_VERSION || size != sizeof(Capture_record))
+        throw std::runtime_error("Not a microLB capture");
+  }
+  bool Capture_reader::next(Capture_record& rec, const uint8_t*& payload)
+  {
+    if ((size_t) (m_end - m_pos) < sizeof(rec)) return false;
+    memcpy(&rec, m_pos, sizeof(rec));
+    if ((size_t) (m_end - m_pos) < sizeof(rec) + rec.payload) return false;
+    payload = m_pos + sizeof(rec);
+    m_pos += sizeof(rec) + rec.payload;
+    return true;
+  }
+}
@@ -0,0 +1,143 @@
+// This file is a part of the IncludeOS unikernel - www.includeos.org
+//
+// Copyright 2018-2019 IncludeOS AS, Oslo, Norway
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "client_hello.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+#define TLS_HANDSHAKE        22
+#define TLS_CLIENT_HELLO      1
+#define TLS_EXT_SERVER_NAME   0
+#define SNI_HOST_NAME         0
+#define MAX_RECORD_SIZE   (16384 + 2048)
+// anything larger is not treated as TLS
+#define MAX_HELLO_SIZE     16384
+#define MAX_NAME_LENGTH      255
+
+namespace microLB
+{
+  static inline uint32_t read16(const uint8_t* p)
+  {
+    return p[0] << 8 | p[1];
+  }
+  // skips a vector with a length field of n bytes
+  static bool skip_vector(const uint8_t*& p, const uint8_t* end, const int n)
+  {
+    if (end - p < n) return false;
+    const size_t len = (n == 1) ? p[0] : read16(p);
+    if ((size_t) (end - p - n) < len) return false;
+    p += n + len;
+    return true;
+  }
+
+  Client_hello::result_t Client_hello::feed(const uint8_t* data, size_t len)
+  {
+    while (len > 0 && m_result == MORE)
+    {
+      if (remaining == 0)
+      {
+        const size_t n = std::min<size_t>(sizeof(header) - header_len, len);
+        memcpy(&header[header_len], data, n);
+        header_len += n;
+        data += n;
+        len  -= n;
+        if (header_len < (int) sizeof(header)) break;
+        header_len = 0;
+        // handshake records, from SSL 3.0 onwards
+        if (header[0] != TLS_HANDSHAKE || header[1] != 3) return m_result = INVALID;
+        remaining = read16(&header[3]);
+        if (remaining == 0 || remaining > MAX_RECORD_SIZE) return m_result = INVALID;
+        continue;
+      }
+      const size_t n = std::min<size_t>(remaining, len);
+      if (message.size() + n > MAX_HELLO_SIZE) return m_result = INVALID;
+      message.insert(message.end(), data, data + n);
+      remaining -= n;
+      data += n;
+      len  -= n;
+      if (message.size() < 4) continue;
+      if (message[0] != TLS_CLIENT_HELLO) return m_result = INVALID;
+      const size_t total = 4 + (message[1] << 16 | message[2] << 8 | message[3]);
+      if (total > MAX_HELLO_SIZE) return m_result = INVALID;
+      if (message.size() >= total) {
+        m_result = this->parse_message(total);
+        message.clear();
+        message.shrink_to_fit();
+      }
+    }
+    return m_result;
+  }
+
+  Client_hello::result_t Client_hello::parse_message(const size_t len)
+  {
+    const uint8_t* p   = message.data() + 4;
+    const uint8_t* end = message.data() + len;
+    // version and random
+    if (end - p < 34) return INVALID;
+    p += 34;
+    // session id, cipher suites and compression methods
+    if (!skip_vector(p, end, 1) || !skip_vector(p, end, 2)
+        || !skip_vector(p, end, 1)) return INVALID;
+    // without extensions there is no server name
+    if (p == end) return DONE;
+    if (end - p < 2 || (size_t) (end - p - 2) < read16(p)) return INVALID;
+    end = p + 2 + read16(p);
+    p += 2;
+    while (p < end)
+    {
+      if (end - p < 4) return INVALID;
+      const int type = read16(p);
+      const size_t ext_len = read16(p + 2);
+      p += 4;
+      if ((size_t) (end - p) < ext_len) return INVALID;
+      if (type == TLS_EXT_SERVER_NAME) {
+        return parse_server_name(p, p + ext_len) ? DONE : INVALID;
+      }
+      p += ext_len;
+    }
+    return DONE;
+  }
+
+  bool Client_hello::parse_server_name(const uint8_t* p, const uint8_t* end)
+  {
+    if (end - p < 2 || (size_t) (end - p - 2) < read16(p)) return false;
+    end = p + 2 + read16(p);
+    p += 2;
+    while (p < end)
+    {
+      if (end - p < 3) return false;
+      const int type = p[0];
+      const size_t len = read16(p + 1);
+      p += 3;
+      if ((size_t) (end - p) < len) return false;
+      if (type == SNI_HOST_NAME)
+      {
+        if (len == 0 || len > MAX_NAME_LENGTH) return false;
+        m_server_name.assign((const char*) p, len);
+        // FNV-1a, so that names differing in case hash alike
+        uint32_t hash = 2166136261u;
+        for (const char c : m_server_name) {
+          hash = (hash ^ (uint8_t) tolower(c)) * 16777619u;
+        }
+        this->m_hash = (hash != 0) ? hash : 1;
+        return true;
+      }
+      p += len;
+    }
+    return true;
+  }
+}
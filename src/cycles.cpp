@@ -0,0 +1,117 @@
+// This file is a part of the IncludeOS unikernel - www.includeos.org
+//
+// Copyright 2018-2019 IncludeOS AS, Oslo, Norway
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "cycles.hpp"
+#include <os.hpp>
+#include <cinttypes>
+
+namespace microLB
+{
+  Cycle_stats cycles;
+
+  uint64_t cycle_clock() noexcept
+  {
+    return os::cycles_since_boot();
+  }
+
+  void Cycle_stats::reset() noexcept
+  {
+    // NOTE: open scopes keep counting from here
+    for (auto& counter : stage) counter = Stage_counter{};
+  }
+
+  void Cycle_stats::print(FILE* file) const
+  {
+    uint64_t total = 0;
+    for (const auto& counter : stage) total += counter.cycles;
+    for (int s = 0; s < STAGE_MAX; s++)
+    {
+      const auto& counter = stage[s];
+      fprintf(file, "%-12s %16" PRIu64 " cycles %5.1f%% %12" PRIu64 " calls %10.0f cycles/call\n",
+              stage_name((cycle_stage_t) s), counter.cycles,
+              (total > 0) ? counter.cycles * 100.0 / total : 0.0, counter.calls,
+              (counter.calls > 0) ? counter.cycles / (double) counter.calls : 0.0);
+    }
+  }
+
+  const char* Cycle_stats::stage_name(const cycle_stage_t s)
+  {
+    static const char* names[STAGE_MAX] = {
+      "accept",
+      "tls",
+      "queue",
+      "connections",
+      "assign",
+      "forward",
+      "teardown"
+    };
+    return (s < STAGE_MAX) ? names[s] : "unknown";
+  }
+
+  net::Stream_ptr stage_transport(net::Stream_ptr transport, const cycle_stage_t s,
+                                  Arena* arena)
+  {
+    if (cycles.enabled == false) return transport;
+    return net::Stream_ptr(make_pooled<Stage_stream> (arena, std::move(transport), s));
+  }
+
+  void Stage_stream::on_connect(ConnectCallback cb)
+  {
+    this->m_on_connect = std::move(cb);
+    if (m_on_connect == nullptr) {
+      m_inner->on_connect(nullptr);
+      return;
+    }
+    m_inner->on_connect(
+      [this] (net::Stream&) {
+        Stage_scope scope(m_stage);
+        m_on_connect(*this);
+      });
+  }
+  void Stage_stream::on_read(size_t n, ReadCallback cb)
+  {
+    this->m_on_read = std::move(cb);
+    if (m_on_read == nullptr) {
+      m_inner->on_read(n, nullptr);
+      return;
+    }
+    m_inner->on_read(n,
+      [this] (buffer_t buffer) {
+        Stage_scope scope(m_stage);
+        m_on_read(std::move(buffer));
+      });
+  }
+  void Stage_stream::on_data(DataCallback cb)
+  {
+    this->m_on_data = std::move(cb);
+    if (m_on_data == nullptr) {
+      m_inner->on_data(nullptr);
+      return;
+    }
+    m_inner->on_data(
+      [this] () {
+        Stage_scope scope(m_stage);
+        m_on_data();
+      });
+  }
+  void Stage_stream::reset_callbacks()
+  {
+    m_inner->reset_callbacks();
+    this->m_on_connect = nullptr;
+    this->m_on_read = nullptr;
+    this->m_on_data = nullptr;
+  }
+}
@@ -23,23 +23,91 @@ namespace microLB
   // default method for opening a TCP port for clients
   void Balancer::open_for_tcp(
         netstack_t&    interface,
-        const uint16_t client_port)
+        const uint16_t client_port,
+        const int      frontend)
   {
-    interface.tcp().listen(client_port,
-    [this] (net::tcp::Connection_ptr conn) {
+    this->get_frontend(frontend);
+    auto& listener = interface.tcp().listen(client_port,
+    [this, frontend] (net::tcp::Connection_ptr conn) {
       assert(conn != nullptr && "TCP sanity check");
-      this->incoming(std::make_unique<net::tcp::Stream> (conn));
+      Stage_scope scope(STAGE_ACCEPT);
+      const auto source = this->count_client(frontend, conn->remote());
+      this->incoming(net::Stream_ptr(
+          make_pooled<net::tcp::Stream> (&stream_pools.tcp, conn)),
+          -1, frontend, -1, source);
     });
+    this->limit_clients(listener, frontend);
 
     this->de_helper.clients = &interface;
     //this->de_helper.cli_ctx = nullptr;
   }
+  // TLS clients, whose records are forwarded like any TCP data
+  void Balancer::open_for_passthrough(
+        netstack_t&    interface,
+        const uint16_t client_port,
+        const int      frontend,
+        const bool     sni_affinity)
+  {
+    auto& fe = this->get_frontend(frontend);
+    assert(fe.tls_context == nullptr && fe.http2 == false);
+    fe.passthrough  = true;
+    fe.sni_affinity = sni_affinity;
+    this->open_for_tcp(interface, client_port, frontend);
+  }
+  Udp_service& Balancer::open_for_udp(
+        netstack_t&       interface,
+        const uint16_t    port,
+        netstack_t&       netout,
+        const int         group,
+        const Udp_config& config)
+  {
+    assert(group >= 0 && group < nodes.group_count());
+    udp_services.emplace_back(nodes, interface, port, netout, group, config);
+    return udp_services.back();
+  }
+  Nat_service& Balancer::open_for_nat(
+        netstack_t&       interface,
+        const uint16_t    port,
+        netstack_t&       netout,
+        const int         group,
+        const Nat_config& config)
+  {
+    assert(group >= 0 && group < nodes.group_count());
+    nat_services.emplace_back(nodes, interface, port, netout, group, config);
+    // services share the interfaces, so one forwarder serves them all
+    interface.set_forward_delg({this, &Balancer::nat_forward});
+    netout.set_forward_delg({this, &Balancer::nat_forward});
+    return nat_services.back();
+  }
+  void Balancer::nat_forward(net::IP4::IP_packet_ptr pkt, net::Inet& source,
+                             net::Conntrack::Entry_ptr ct)
+  {
+    for (auto& nat : nat_services)
+    {
+      if (nat.carries(source, ct)) {
+        nat.forward(std::move(pkt), source, ct);
+        return;
+      }
+    }
+    // we are not a router, only the flows of a service pass through
+    this->nat_dropped++;
+  }
+  void Balancer::init_stream_pools(const int session_limit)
+  {
+    // every session has both a client and a node stream
+    stream_pools.tcp.set_capacity(2 * session_limit);
+    stream_pools.tls.set_capacity(2 * session_limit);
+    stream_pools.stage.set_capacity(2 * session_limit);
+  }
   // default method for TCP nodes
   node_connect_function_t Balancer::connect_with_tcp(
           netstack_t& interface,
-          net::Socket socket)
+          net::Socket socket,
+          Stream_pools* pools)
   {
-return [&interface, socket] (timeout_t timeout, node_connect_result_t callback)
+    Arena* arena = (pools) ? &pools->tcp : nullptr;
+return node_connect_function_t::make_packed(
+    [&interface, socket, arena] (timeout_t timeout, node_connect_result_t callback)
     {
       net::tcp::Connection_ptr conn;
       try
@@ -62,19 +130,20 @@ return [&interface, socket] (timeout_t timeout, node_connect_result_t callback)
           }));
       conn->on_connect(
         net::tcp::Connection::ConnectCallback::make_packed(
-        [timer, callback] (net::tcp::Connection_ptr conn) {
+        [timer, arena, callback] (net::tcp::Connection_ptr conn) {
           // stop timeout after successful connect
           Timers::stop(timer);
           if (conn != nullptr) {
             // the connect() succeeded
             assert(conn->is_connected() && "TCP sanity check");
-            callback(std::make_unique<net::tcp::Stream>(conn));
+            callback(net::Stream_ptr(
+                make_pooled<net::tcp::Stream> (arena, conn)));
           }
           else {
             // the connect() failed
             callback(nullptr);
           }
         }));
-    };
+    });
   }
 }
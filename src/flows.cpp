@@ -0,0 +1,186 @@
+// This file is a part of the IncludeOS unikernel - www.includeos.org
+//
+// Copyright 2018-2019 IncludeOS AS, Oslo, Norway
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "flows.hpp"
+#include "hash_table.hpp"
+#include "nodes.hpp"
+#include "trace.hpp"
+#include <net/inet>
+#include <os.hpp>
+#include <algorithm>
+#include <exception>
+
+namespace microLB
+{
+  static inline uint32_t seconds_now()
+  {
+    return os::nanos_since_boot() / 1000000000ull;
+  }
+
+  Udp_service::Udp_service(Nodes& nodes, net::Inet& clients, const uint16_t port,
+                           net::Inet& netout, const int group, const Udp_config& config)
+    : m_nodes(nodes), m_netout(netout), m_socket(clients.udp().bind(port)),
+      m_group(group), m_config(config)
+  {
+    assert(config.table_size > 0);
+    assert(config.idle_timeout.count() > 0);
+    const uint32_t size = probe_table_size(config.table_size);
+    table.resize(size, Flow{0, 0, EMPTY, 0, -1, 0, 0, nullptr});
+    this->mask = size - 1;
+    this->build_ring();
+
+    m_socket.on_read({this, &Udp_service::from_client});
+    this->sweep_timer = Timers::periodic(config.idle_timeout, config.idle_timeout,
+      [this] (int) {
+        this->sweep();
+      });
+  }
+  Udp_service::~Udp_service()
+  {
+    if (sweep_timer != Timers::UNUSED_ID) Timers::stop(sweep_timer);
+    for (auto& flow : table) {
+      if (flow.state == ACTIVE) this->expire(flow);
+    }
+    m_socket.close();
+  }
+
+  void Udp_service::build_ring()
+  {
+    // NOTE: points come from node addresses, so the ring survives reordering
+    for (const int idx : m_nodes.group(m_group).members)
+    {
+      const auto sock = m_nodes.get_node(idx).address();
+      const uint64_t base = (uint64_t) sock.address().v4().whole << 16 | sock.port();
+      for (int v = 0; v < m_config.virtual_nodes; v++) {
+        ring.emplace_back(mix(base << 16 | v), idx);
+      }
+    }
+    std::sort(ring.begin(), ring.end());
+  }
+  int Udp_service::pick_node(const uint32_t hash) const
+  {
+    if (ring.empty()) return -1;
+    auto it = std::lower_bound(ring.begin(), ring.end(), std::make_pair(hash, -1));
+    // walk clockwise past inactive nodes
+    for (size_t i = 0; i < ring.size(); i++, it++)
+    {
+      if (it == ring.end()) it = ring.begin();
+      const auto& node = m_nodes.get_node(it->second);
+      if (node.is_active() || node.active_check() == false) return it->second;
+    }
+    return -1;
+  }
+
+  Udp_service::Flow* Udp_service::lookup(const uint32_t addr, const uint16_t port,
+                                         const uint32_t now)
+  {
+    const uint32_t hash = mix((uint64_t) addr << 16 | port);
+    bool found;
+    Flow* flow = probe(table, mask, hash, found,
+        [&] (Flow& f) {
+          if (f.state != ACTIVE || f.addr != addr || f.port != port) return false;
+          // lazy expiry, the sweep may not have run yet
+          if (now - f.last <= (uint32_t) m_config.idle_timeout.count()) return true;
+          this->expire(f);
+          return false;
+        },
+        [] (const Flow& f) { return f.state == EMPTY; },
+        [] (const Flow& f) { return f.state == EXPIRED; });
+    if (found)
+    {
+      const auto& node = m_nodes.get_node(flow->node);
+      if (node.is_active() || node.active_check() == false) return flow;
+      // the node went down, so the flow goes where a new one would
+      const int next = this->pick_node(hash);
+      if (next < 0) return nullptr;
+      flow->node = next;
+      this->moved++;
+      trace.add(TRACE_UDP_FLOW, next, this->flows);
+      return flow;
+    }
+    if (flow == nullptr) return nullptr;
+
+    // new flow
+    const int node = this->pick_node(hash);
+    if (node < 0) return nullptr;
+    net::UDPSocket* upstream;
+    try {
+      upstream = &m_netout.udp().bind();
+    } catch (std::exception& e) {
+      // out of ephemeral ports, the datagram is dropped
+      this->no_port++;
+      return nullptr;
+    }
+    *flow = Flow{addr, port, ACTIVE, 0, node, now, ++generation, upstream};
+    upstream->on_read(
+      [this, slot = uint32_t(flow - table.data()), gen = flow->generation]
+      (net::Addr, uint16_t, const char* data, size_t len) {
+        this->from_node(slot, gen, data, len);
+      });
+    this->flows++;
+    this->created++;
+    trace.add(TRACE_UDP_FLOW, node, this->flows);
+    return flow;
+  }
+  void Udp_service::expire(Flow& flow)
+  {
+    assert(flow.state == ACTIVE);
+    flow.upstream->close();
+    flow.upstream = nullptr;
+    flow.state = EXPIRED;
+    this->flows--;
+    this->expired++;
+  }
+
+  void Udp_service::from_client(net::Addr addr, const uint16_t port,
+                                const char* data, const size_t len)
+  {
+    this->datagrams++;
+    if (addr.is_v4() == false) {
+      this->dropped++;
+      return;
+    }
+    const uint32_t now = seconds_now();
+    auto* flow = this->lookup(addr.v4().whole, port, now);
+    if (flow == nullptr) {
+      this->dropped++;
+      return;
+    }
+    flow->last = now;
+    const auto dest = m_nodes.get_node(flow->node).address();
+    const uint16_t dport = (m_config.node_port) ? m_config.node_port : dest.port();
+    flow->upstream->sendto(dest.address(), dport, data, len);
+  }
+  void Udp_service::from_node(const uint32_t slot, const uint32_t gen,
+                              const char* data, const size_t len)
+  {
+    auto& flow = table.at(slot);
+    // the flow expired, and the slot may be someone else's now
+    if (flow.state != ACTIVE || flow.generation != gen) return;
+    flow.last = seconds_now();
+    m_socket.sendto(net::ip4::Addr(flow.addr), flow.port, data, len);
+  }
+
+  void Udp_service::sweep()
+  {
+    const uint32_t now = seconds_now();
+    const uint32_t timeout = m_config.idle_timeout.count();
+    for (auto& flow : table)
+    {
+      if (flow.state == ACTIVE && now - flow.last > timeout) this->expire(flow);
+    }
+  }
+}
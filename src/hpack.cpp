@@ -0,0 +1,397 @@
+// This file is a part of the IncludeOS unikernel - www.includeos.org
+//
+// Copyright 2018-2019 IncludeOS AS, Oslo, Norway
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "hpack.hpp"
+#include <cassert>
+
+// entries are charged for their strings, and this much more
+#define ENTRY_OVERHEAD   32
+#define HUFFMAN_EOS      256
+#define HUFFMAN_MAX_BITS 30
+
+namespace microLB
+{
+  // RFC 7541, Appendix A
+  static const header_t static_table[] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""}
+  };
+  static const size_t STATIC_ENTRIES = sizeof(static_table) / sizeof(static_table[0]);
+  static_assert(sizeof(static_table) / sizeof(static_table[0]) == 61,
+                "HPACK has 61 static entries");
+
+  // RFC 7541, Appendix B (the code is canonical)
+  static const uint32_t huffman_codes[257] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5,
+    0xfffffe6, 0xfffffe7, 0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9,
+    0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec, 0xfffffed, 0xfffffee,
+    0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9,
+    0xffffffa, 0xffffffb, 0x14, 0x3f8, 0x3f9, 0xffa,
+    0x1ff9, 0x15, 0xf8, 0x7fa, 0x3fa, 0x3fb,
+    0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b,
+    0x1c, 0x1d, 0x1e, 0x1f, 0x5c, 0xfb,
+    0x7ffc, 0x20, 0xffb, 0x3fc, 0x1ffa, 0x21,
+    0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e,
+    0x6f, 0x70, 0x71, 0x72, 0xfc, 0x73,
+    0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5,
+    0x25, 0x26, 0x27, 0x6, 0x74, 0x75,
+    0x28, 0x29, 0x2a, 0x7, 0x2b, 0x76,
+    0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd,
+    0x1ffd, 0xffffffc, 0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8,
+    0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9, 0x3fffd6, 0x7fffda,
+    0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1,
+    0x7fffe2, 0x7fffe3, 0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5,
+    0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef, 0x3fffda, 0x1fffdd,
+    0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf,
+    0x7fffeb, 0x7fffec, 0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2,
+    0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef, 0xfffea, 0x3fffe2,
+    0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2,
+    0x3fffe8, 0x1ffffec, 0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde,
+    0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed, 0x7fff2, 0x1fffe3,
+    0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3,
+    0x7ffffe4, 0x7ffffe5, 0xfffec, 0xfffff3, 0xfffed, 0x1fffe6,
+    0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3, 0x3fffea, 0x3fffeb,
+    0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8,
+    0x7ffffe9, 0x7ffffea, 0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed,
+    0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee, 0x3fffffff,
+  };
+  static const uint8_t huffman_lengths[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+     6, 10, 10, 12, 13,  6,  8, 11, 10, 10,  8, 11,  8,  6,  6,  6,
+     5,  5,  5,  6,  6,  6,  6,  6,  6,  6,  7,  8, 15,  6, 12, 10,
+    13,  6,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,
+     7,  7,  7,  7,  7,  7,  7,  7,  8,  7,  8, 13, 19, 13, 14,  6,
+    15,  5,  6,  5,  6,  5,  6,  6,  6,  5,  7,  7,  6,  6,  6,  5,
+     6,  7,  6,  5,  5,  6,  7,  7,  7,  7,  7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+  };
+
+  // canonical codes are consecutive within each length
+  struct Huffman_decoding {
+    Huffman_decoding()
+    {
+      uint32_t code = 0;
+      int sorted = 0;
+      for (int len = 1; len <= HUFFMAN_MAX_BITS; len++)
+      {
+        first_code[len] = code;
+        offset[len] = sorted;
+        for (int sym = 0; sym <= HUFFMAN_EOS; sym++) {
+          if (huffman_lengths[sym] == len) symbols[sorted++] = sym;
+        }
+        count[len] = sorted - offset[len];
+        code = (code + count[len]) << 1;
+      }
+      assert(sorted == HUFFMAN_EOS + 1);
+    }
+    uint32_t first_code[HUFFMAN_MAX_BITS + 1];
+    uint32_t count[HUFFMAN_MAX_BITS + 1];
+    uint32_t offset[HUFFMAN_MAX_BITS + 1];
+    uint16_t symbols[HUFFMAN_EOS + 1];
+  };
+
+  static bool huffman_decode(const uint8_t* data, const size_t len, std::string& out)
+  {
+    static const Huffman_decoding table;
+    uint32_t code = 0;
+    int bits = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+      for (int b = 7; b >= 0; b--)
+      {
+        code = (code << 1) | ((data[i] >> b) & 1);
+        if (++bits > HUFFMAN_MAX_BITS) return false;
+        const uint32_t index = code - table.first_code[bits];
+        if (code >= table.first_code[bits] && index < table.count[bits])
+        {
+          const int sym = table.symbols[table.offset[bits] + index];
+          if (sym == HUFFMAN_EOS) return false;
+          out.push_back(sym);
+          code = 0;
+          bits = 0;
+        }
+      }
+    }
+    // padding is the most significant bits of EOS (all ones)
+    return bits < 8 && code == (1u << bits) - 1;
+  }
+  static size_t huffman_length(const std::string& str)
+  {
+    size_t bits = 0;
+    for (const uint8_t c : str) bits += huffman_lengths[c];
+    return (bits + 7) / 8;
+  }
+  static void huffman_encode(const std::string& str, std::vector<uint8_t>& out)
+  {
+    uint64_t acc = 0;
+    int bits = 0;
+    for (const uint8_t c : str)
+    {
+      acc = (acc << huffman_lengths[c]) | huffman_codes[c];
+      bits += huffman_lengths[c];
+      while (bits >= 8) {
+        bits -= 8;
+        out.push_back(acc >> bits);
+      }
+    }
+    if (bits > 0) {
+      // pad with ones
+      out.push_back((acc << (8 - bits)) | (0xff >> bits));
+    }
+  }
+
+  static bool decode_int(const uint8_t*& p, const uint8_t* end, const int prefix,
+                         uint64_t& value)
+  {
+    if (p >= end) return false;
+    const uint8_t max = (1 << prefix) - 1;
+    value = *p++ & max;
+    if (value < max) return true;
+    for (int shift = 0; p < end && shift <= 28; shift += 7)
+    {
+      const uint8_t b = *p++;
+      value += uint64_t(b & 0x7f) << shift;
+      if ((b & 0x80) == 0) return true;
+    }
+    return false;
+  }
+  static void encode_int(std::vector<uint8_t>& out, const uint8_t first,
+                         const int prefix, uint64_t value)
+  {
+    const uint8_t max = (1 << prefix) - 1;
+    if (value < max) {
+      out.push_back(first | value);
+      return;
+    }
+    out.push_back(first | max);
+    value -= max;
+    while (value >= 128) {
+      out.push_back((value & 0x7f) | 0x80);
+      value >>= 7;
+    }
+    out.push_back(value);
+  }
+
+  static bool decode_string(const uint8_t*& p, const uint8_t* end, std::string& out)
+  {
+    if (p >= end) return false;
+    const bool huffman = (*p & 0x80) != 0;
+    uint64_t len = 0;
+    if (decode_int(p, end, 7, len) == false) return false;
+    if (len > (uint64_t) (end - p)) return false;
+    out.clear();
+    if (huffman) {
+      if (huffman_decode(p, len, out) == false) return false;
+    }
+    else {
+      out.assign((const char*) p, len);
+    }
+    p += len;
+    return true;
+  }
+  static void encode_string(const std::string& str, std::vector<uint8_t>& out)
+  {
+    const size_t hlen = huffman_length(str);
+    if (hlen < str.size()) {
+      encode_int(out, 0x80, 7, hlen);
+      huffman_encode(str, out);
+    }
+    else {
+      encode_int(out, 0x0, 7, str.size());
+      out.insert(out.end(), str.begin(), str.end());
+    }
+  }
+
+  const header_t* Hpack_decoder::lookup(const uint64_t index) const
+  {
+    if (index == 0) return nullptr;
+    if (index <= STATIC_ENTRIES) return &static_table[index - 1];
+    const uint64_t dynamic = index - STATIC_ENTRIES - 1;
+    if (dynamic >= table.size()) return nullptr;
+    return &table[dynamic];
+  }
+  void Hpack_decoder::evict(const size_t limit)
+  {
+    while (table_size > limit)
+    {
+      const auto& entry = table.back();
+      table_size -= entry.first.size() + entry.second.size() + ENTRY_OVERHEAD;
+      table.pop_back();
+    }
+  }
+  void Hpack_decoder::insert(header_t entry)
+  {
+    const size_t size = entry.first.size() + entry.second.size() + ENTRY_OVERHEAD;
+    // too large entries empty the table
+    if (size > size_limit) {
+      this->evict(0);
+      return;
+    }
+    this->evict(size_limit - size);
+    table.push_front(std::move(entry));
+    table_size += size;
+  }
+
+  bool Hpack_decoder::decode(const uint8_t* p, const size_t len, header_list_t& headers)
+  {
+    const uint8_t* end = p + len;
+    while (p < end)
+    {
+      const uint8_t first = *p;
+      uint64_t index = 0;
+      if (first & 0x80)
+      {
+        // indexed field
+        if (decode_int(p, end, 7, index) == false) return false;
+        const auto* entry = lookup(index);
+        if (entry == nullptr) return false;
+        headers.push_back(*entry);
+        continue;
+      }
+      if ((first & 0xe0) == 0x20)
+      {
+        // dynamic table size update
+        if (decode_int(p, end, 5, index) == false) return false;
+        if (index > max_size) return false;
+        this->size_limit = index;
+        this->evict(size_limit);
+        continue;
+      }
+      // literals, with incremental indexing, without, or never indexed
+      const bool indexing = (first & 0xc0) == 0x40;
+      if (decode_int(p, end, (indexing) ? 6 : 4, index) == false) return false;
+      header_t field;
+      if (index > 0) {
+        const auto* entry = lookup(index);
+        if (entry == nullptr) return false;
+        field.first = entry->first;
+      }
+      else if (decode_string(p, end, field.first) == false) return false;
+      if (decode_string(p, end, field.second) == false) return false;
+
+      if (indexing) this->insert(field);
+      headers.push_back(std::move(field));
+    }
+    return true;
+  }
+
+  void Hpack_encoder::encode(const std::string& name, const std::string& value,
+                             std::vector<uint8_t>& out) const
+  {
+    // literal without indexing, with an indexed name when possible
+    size_t index = 0;
+    for (size_t i = 0; i < STATIC_ENTRIES; i++) {
+      if (static_table[i].first == name) {
+        index = i + 1;
+        break;
+      }
+    }
+    encode_int(out, 0x0, 4, index);
+    if (index == 0) encode_string(name, out);
+    encode_string(value, out);
+  }
+  void Hpack_encoder::encode_status(const int status, std::vector<uint8_t>& out) const
+  {
+    // :status 200 is entry 8, and the rest follow it
+    static const int indexed[] = {200, 204, 206, 304, 400, 404, 500};
+    for (int i = 0; i < 7; i++) {
+      if (indexed[i] == status) {
+        encode_int(out, 0x80, 7, 8 + i);
+        return;
+      }
+    }
+    this->encode(":status", std::to_string(status), out);
+  }
+}
@@ -0,0 +1,320 @@
+// This file is a part of the IncludeOS unikernel - www.includeos.org
+//
+// Copyright 2018-2019 IncludeOS AS, Oslo, Norway
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "http.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <string_view>
+#include <strings.h>
+
+// anything larger is not treated as HTTP
+#define HTTP_MAX_HEADER   (32 * 1024)
+#define HTTP_MAX_LINE      4096
+
+namespace microLB
+{
+  static bool equals_nocase(std::string_view a, const char* b)
+  {
+    return a.size() == strlen(b) && strncasecmp(a.data(), b, a.size()) == 0;
+  }
+  // look for token in a comma-separated header value
+  static bool has_token(std::string_view value, const char* token)
+  {
+    while (!value.empty())
+    {
+      size_t comma = value.find(',');
+      auto item = value.substr(0, comma);
+      while (!item.empty() && item.front() == ' ') item.remove_prefix(1);
+      while (!item.empty() && item.back()  == ' ') item.remove_suffix(1);
+      if (equals_nocase(item, token)) return true;
+      if (comma == std::string_view::npos) break;
+      value.remove_prefix(comma + 1);
+    }
+    return false;
+  }
+
+  // a Content-Length value, only digits
+  static bool parse_length(std::string_view value, int64_t& length)
+  {
+    while (!value.empty() && (value.back() == ' ' || value.back() == '\t'))
+        value.remove_suffix(1);
+    if (value.empty() || value.size() > 18) return false;
+    length = 0;
+    for (const char c : value)
+    {
+      if (c < '0' || c > '9') return false;
+      length = length * 10 + (c - '0');
+    }
+    return true;
+  }
+
+  Http_framer::Http_framer(kind_t k, Http_framer* reqs)
+    : kind(k), requests(reqs)
+  {
+    assert(kind == REQUEST || requests != nullptr);
+  }
+
+  void Http_framer::feed(const uint8_t* data, size_t len)
+  {
+    while (len > 0 && state != TUNNEL)
+    {
+      size_t used = len;
+      switch (state) {
+      case HEADER:
+          used = parse_header(data, len);
+          break;
+      case BODY:
+      case CHUNK_DATA:
+          used = std::min<int64_t>(remaining, len);
+          remaining -= used;
+          if (remaining == 0) {
+            if (state == BODY) message_complete();
+            else state = CHUNK_CRLF;
+          }
+          break;
+      case CHUNK_SIZE:
+      case CHUNK_CRLF:
+      case TRAILER:
+          used = parse_line(data, len);
+          break;
+      case UNTIL_CLOSE:
+      case TUNNEL:
+          break;
+      }
+      data += used;
+      len  -= used;
+    }
+  }
+
+  size_t Http_framer::parse_header(const uint8_t* data, size_t len)
+  {
+    // ignore empty lines between messages
+    if (header.empty())
+    {
+      size_t skip = 0;
+      while (skip < len && (data[skip] == '\r' || data[skip] == '\n')) skip++;
+      if (skip > 0) return skip;
+    }
+    const size_t old = header.size();
+    header.append((const char*) data, len);
+    const size_t pos = header.find("\r\n\r\n", (old >= 3) ? old - 3 : 0);
+    if (pos == std::string::npos)
+    {
+      if (header.size() > HTTP_MAX_HEADER) this->tunnel();
+      return len;
+    }
+    const size_t end = pos + 4;
+    header.resize(end);
+    this->parse_message_header();
+    return end - old;
+  }
+
+  size_t Http_framer::parse_line(const uint8_t* data, size_t len)
+  {
+    auto* nl = (const uint8_t*) memchr(data, '\n', len);
+    const size_t used = (nl) ? (nl - data + 1) : len;
+    line.append((const char*) data, (nl) ? used - 1 : used);
+    if (line.size() > HTTP_MAX_LINE) {
+      this->tunnel();
+      return used;
+    }
+    if (nl == nullptr) return used;
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+
+    if (state == CHUNK_SIZE)
+    {
+      char* end = nullptr;
+      const long long size = strtoll(line.c_str(), &end, 16);
+      if (end == line.c_str() || size < 0) {
+        this->tunnel();
+        return used;
+      }
+      this->remaining = size;
+      // the last chunk is followed by trailers
+      state = (size > 0) ? CHUNK_DATA : TRAILER;
+    }
+    else if (state == CHUNK_CRLF)
+    {
+      if (!line.empty()) {
+        this->tunnel();
+        return used;
+      }
+      state = CHUNK_SIZE;
+    }
+    else if (line.empty()) // TRAILER
+    {
+      this->message_complete();
+    }
+    line.clear();
+    return used;
+  }
+
+  void Http_framer::parse_message_header()
+  {
+    std::string_view view {header};
+    const size_t eol = view.find("\r\n");
+    const auto start = view.substr(0, eol);
+
+    bool http10 = false;
+    int  status = 0;
+    method_t method = M_OTHER;
+    if (kind == REQUEST)
+    {
+      const size_t sp1 = start.find(' ');
+      const size_t sp2 = start.rfind(' ');
+      if (sp1 == std::string_view::npos || sp1 == sp2
+          || start.substr(sp2 + 1, 5) != "HTTP/") {
+        this->tunnel();
+        return;
+      }
+      const auto name = start.substr(0, sp1);
+      if (name == "HEAD") method = M_HEAD;
+      else if (name == "CONNECT") method = M_CONNECT;
+      http10 = (start.substr(sp2 + 1) == "HTTP/1.0");
+      m_target = start.substr(sp1 + 1, sp2 - sp1 - 1);
+      m_host.clear();
+    }
+    else
+    {
+      if (start.size() < 12 || start.substr(0, 5) != "HTTP/") {
+        this->tunnel();
+        return;
+      }
+      http10 = (start.substr(0, 8) == "HTTP/1.0");
+      status = atoi(start.data() + 9);
+    }
+
+    bool    chunked = false;
+    bool    encoded = false;
+    int64_t length  = -1;
+    bool    close   = http10;
+    // the node may frame it differently, so it is not HTTP to us
+    bool    ambiguous = false;
+    size_t  pos = eol + 2;
+    while (pos < view.size())
+    {
+      const size_t end = view.find("\r\n", pos);
+      if (end == pos) break;
+      auto field = view.substr(pos, end - pos);
+      pos = end + 2;
+
+      const size_t colon = field.find(':');
+      if (colon == std::string_view::npos) continue;
+      const auto name = field.substr(0, colon);
+      auto value = field.substr(colon + 1);
+      while (!value.empty() && (value.front() == ' ' || value.front() == '\t'))
+          value.remove_prefix(1);
+
+      if (equals_nocase(name, "Content-Length")) {
+        // duplicates, even equal ones, and anything but a number
+        if (length >= 0 || parse_length(value, length) == false) ambiguous = true;
+      }
+      else if (equals_nocase(name, "Transfer-Encoding")) {
+        if (encoded) ambiguous = true;
+        encoded = true;
+        chunked = has_token(value, "chunked");
+      }
+      else if (kind == REQUEST && equals_nocase(name, "Host")) {
+        m_host = value;
+        while (!m_host.empty() && m_host.back() == ' ') m_host.pop_back();
+      }
+      else if (equals_nocase(name, "Connection")) {
+        if (has_token(value, "close")) close = true;
+        else if (has_token(value, "keep-alive")) close = false;
+      }
+    }
+    header.clear();
+    if (close) this->m_keep_alive = false;
+    // chunked must end a request body, and can't come with a length
+    if (kind == REQUEST && encoded && chunked == false) ambiguous = true;
+    if (ambiguous || (encoded && length >= 0))
+    {
+      // neither reused nor routed on
+      m_host.clear();
+      m_target.clear();
+      this->tunnel();
+      return;
+    }
+
+    if (kind == REQUEST)
+    {
+      m_headers++;
+      methods.push_back(method);
+      if (method == M_CONNECT) {
+        this->tunnel();
+        return;
+      }
+      // requests without length have no body
+      this->begin_body(chunked, std::max<int64_t>(length, 0));
+      return;
+    }
+    // interim responses have no body, and are not the answer
+    if (status >= 100 && status < 200)
+    {
+      if (status == 101) this->tunnel(); // switching protocols
+      return;
+    }
+    method_t answered = M_OTHER;
+    if (!requests->methods.empty()) {
+      answered = requests->methods.front();
+      requests->methods.pop_front();
+    }
+    if (answered == M_CONNECT && status >= 200 && status < 300) {
+      this->tunnel();
+    }
+    else if (answered == M_HEAD || status == 204 || status == 304) {
+      this->begin_body(false, 0);
+    }
+    else if (chunked || length >= 0) {
+      this->begin_body(chunked, length);
+    }
+    else {
+      // the response ends when the connection closes
+      this->state = UNTIL_CLOSE;
+      this->m_keep_alive = false;
+    }
+  }
+
+  void Http_framer::begin_body(bool chunked, int64_t length)
+  {
+    if (chunked) {
+      this->state = CHUNK_SIZE;
+    }
+    else if (length > 0) {
+      this->state = BODY;
+      this->remaining = length;
+    }
+    else {
+      this->message_complete();
+    }
+  }
+
+  void Http_framer::message_complete()
+  {
+    this->state = HEADER;
+    this->m_messages++;
+  }
+
+  void Http_framer::tunnel()
+  {
+    this->state = TUNNEL;
+    this->m_keep_alive = false;
+    this->header.clear();
+    this->line.clear();
+  }
+}
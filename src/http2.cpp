@@ -0,0 +1,1089 @@
+// This file is a part of the IncludeOS unikernel - www.includeos.org
+//
+// Copyright 2018-2019 IncludeOS AS, Oslo, Norway
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "http2.hpp"
+#include "balancer.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+// the largest frame we accept, which is also the protocol default
+#define H2_MAX_FRAME         16384
+#define H2_MAX_HEADER_BLOCK  65536
+#define H2_MAX_STREAMS       100
+#define H2_INITIAL_WINDOW    65535
+// received data is acknowledged in batches of this much
+#define H2_WINDOW_BATCH      32768
+// stop reading from a node while this much waits for the client
+#define H2_MAX_PENDING       65536
+#define HTTP1_MAX_LINE       8192
+#define HTTP1_MAX_HEADER     65536
+
+static const char   h2_preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+static const size_t H2_PREFACE_LEN = sizeof(h2_preface) - 1;
+
+namespace microLB
+{
+  enum h2_frame_t : uint8_t {
+    H2_DATA = 0, H2_HEADERS, H2_PRIORITY, H2_RST_STREAM, H2_SETTINGS,
+    H2_PUSH_PROMISE, H2_PING, H2_GOAWAY, H2_WINDOW_UPDATE, H2_CONTINUATION
+  };
+  enum h2_flag_t : uint8_t {
+    H2_ACK = 0x1, H2_END_STREAM = 0x1, H2_END_HEADERS = 0x4,
+    H2_PADDED = 0x8, H2_PRIO = 0x20
+  };
+  enum h2_error_t : uint32_t {
+    H2_NO_ERROR = 0, H2_PROTOCOL_ERROR, H2_INTERNAL_ERROR, H2_FLOW_CONTROL_ERROR,
+    H2_SETTINGS_TIMEOUT, H2_STREAM_CLOSED, H2_FRAME_SIZE_ERROR, H2_REFUSED_STREAM,
+    H2_CANCEL, H2_COMPRESSION_ERROR, H2_CONNECT_ERROR, H2_ENHANCE_YOUR_CALM
+  };
+  enum h2_setting_t : uint16_t {
+    H2_HEADER_TABLE_SIZE = 1, H2_ENABLE_PUSH, H2_MAX_CONCURRENT_STREAMS,
+    H2_INITIAL_WINDOW_SIZE, H2_MAX_FRAME_SIZE, H2_MAX_HEADER_LIST_SIZE
+  };
+
+  static inline uint32_t read32(const uint8_t* p)
+  {
+    return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | p[3];
+  }
+  static inline void write32(uint8_t* p, const uint32_t value)
+  {
+    p[0] = value >> 24; p[1] = value >> 16; p[2] = value >> 8; p[3] = value;
+  }
+  static inline char lower(const char c)
+  {
+    return (c >= 'A' && c <= 'Z') ? c + 32 : c;
+  }
+  // field names (and methods) are tokens, without separators or spaces
+  static bool is_token(const std::string& str)
+  {
+    if (str.empty()) return false;
+    for (const char c : str) {
+      if (c <= 32 || c >= 127 || strchr("\"(),/:;<=>?@[\\]{}", c)) return false;
+    }
+    return true;
+  }
+  // nothing that could end a line in the HTTP/1.1 request
+  static bool is_field_value(const std::string& str)
+  {
+    for (const char c : str) {
+      if (c == '\r' || c == '\n' || c == '\0') return false;
+    }
+    return true;
+  }
+  static std::string trim(const std::string& str, size_t begin, size_t end)
+  {
+    while (begin < end && (str[begin] == ' ' || str[begin] == '\t')) begin++;
+    while (end > begin && (str[end-1] == ' ' || str[end-1] == '\t')) end--;
+    return str.substr(begin, end - begin);
+  }
+  static bool is_hop_by_hop(const std::string& name)
+  {
+    return name == "connection" || name == "keep-alive" || name == "proxy-connection"
+        || name == "transfer-encoding" || name == "upgrade";
+  }
+
+  void Http1_response::reset(const bool head_request)
+  {
+    *this = Http1_response{};
+    this->head = head_request;
+  }
+  bool Http1_response::read_line(const uint8_t*& p, const uint8_t* end)
+  {
+    while (p < end) {
+      const char c = *p++;
+      if (c == '\n') {
+        if (line.empty() == false && line.back() == '\r') line.pop_back();
+        return true;
+      }
+      line.push_back(c);
+    }
+    return false;
+  }
+  bool Http1_response::feed(const uint8_t* data, const size_t len)
+  {
+    const uint8_t* p   = data;
+    const uint8_t* end = data + len;
+    while (p < end)
+    {
+      switch (state) {
+      case BODY:
+      case CHUNK_DATA:
+        {
+          const size_t n = std::min<uint64_t>(remaining, end - p);
+          body.insert(body.end(), p, p + n);
+          p += n;
+          remaining -= n;
+          if (remaining == 0) {
+            if (state == BODY) this->done();
+            else state = CHUNK_END;
+          }
+        }
+        break;
+      case UNTIL_CLOSE:
+        body.insert(body.end(), p, end);
+        p = end;
+        break;
+      case DONE:
+        // more than the response, so the connection can't be trusted
+        this->keep_alive = false;
+        return true;
+      default:
+        {
+          const uint8_t* start = p;
+          const bool full = read_line(p, end);
+          if (state == STATUS || state == HEADER) {
+            header_bytes += p - start;
+            if (header_bytes > HTTP1_MAX_HEADER) return false;
+          }
+          if (full == false) return line.size() <= HTTP1_MAX_LINE;
+          bool ok = true;
+          switch (state) {
+          case STATUS:
+            ok = parse_status();
+            break;
+          case HEADER:
+            ok = (line.empty()) ? end_headers() : parse_header();
+            break;
+          case CHUNK_SIZE:
+            {
+              // hex digits, possibly followed by extensions
+              uint64_t size = 0;
+              size_t i = 0;
+              for (; i < line.size() && isxdigit((unsigned char) line[i]); i++) {
+                if (i >= 15) return false;
+                const char c = lower(line[i]);
+                size = size * 16 + ((c <= '9') ? c - '0' : c - 'a' + 10);
+              }
+              ok = (i > 0);
+              remaining = size;
+              state = (size > 0) ? CHUNK_DATA : TRAILER;
+            }
+            break;
+          case CHUNK_END:
+            ok = line.empty();
+            state = CHUNK_SIZE;
+            break;
+          case TRAILER:
+            // trailers are not forwarded
+            if (line.empty()) this->done();
+            break;
+          default:
+            assert(0 && "Not a line state");
+          }
+          line.clear();
+          if (ok == false) return false;
+        }
+        break;
+      }
+    }
+    return true;
+  }
+  bool Http1_response::parse_status()
+  {
+    // HTTP/1.x NNN reason
+    if (line.size() < 12 || line.compare(0, 7, "HTTP/1.") != 0 || line[8] != ' ')
+        return false;
+    int code = 0;
+    for (int i = 9; i < 12; i++) {
+      if (line[i] < '0' || line[i] > '9') return false;
+      code = code * 10 + (line[i] - '0');
+    }
+    if (code < 100) return false;
+    this->status = code;
+    this->http10 = (line[7] == '0');
+    this->state  = HEADER;
+    return true;
+  }
+  bool Http1_response::parse_header()
+  {
+    // folded lines are obsolete, and rejected
+    if (line[0] == ' ' || line[0] == '\t') return false;
+    const size_t colon = line.find(':');
+    if (colon == std::string::npos) return false;
+    std::string name = line.substr(0, colon);
+    if (is_token(name) == false) return false;
+    for (auto& c : name) c = lower(c);
+    auto value = trim(line, colon + 1, line.size());
+    if (name == "content-length")
+    {
+      int64_t length = 0;
+      for (const char c : value) {
+        if (c < '0' || c > '9' || length > INT64_MAX / 10 - 10) return false;
+        length = length * 10 + (c - '0');
+      }
+      if (value.empty() || (content_length >= 0 && content_length != length))
+          return false;
+      // a transfer encoding overrides the length
+      if (content_length != -2) this->content_length = length;
+    }
+    else if (name == "transfer-encoding")
+    {
+      // only the last coding counts
+      std::string coding;
+      for (const char c : value) coding.push_back(lower(c));
+      this->chunked = coding.size() >= 7
+                   && coding.compare(coding.size() - 7, 7, "chunked") == 0;
+      this->content_length = -2; // framed by the encoding
+    }
+    headers.emplace_back(std::move(name), std::move(value));
+    return true;
+  }
+  bool Http1_response::end_headers()
+  {
+    if (status < 200)
+    {
+      // interim responses are not forwarded, and upgrades not supported
+      if (status == 101) return false;
+      this->reset(head);
+      return true;
+    }
+    // the connection header also names other hop-by-hop headers
+    std::vector<std::string> listed;
+    bool close = http10;
+    for (const auto& hdr : headers)
+    {
+      if (hdr.first != "connection") continue;
+      size_t begin = 0;
+      while (begin <= hdr.second.size())
+      {
+        size_t end = hdr.second.find(',', begin);
+        if (end == std::string::npos) end = hdr.second.size();
+        auto token = trim(hdr.second, begin, end);
+        for (auto& c : token) c = lower(c);
+        if (token == "close") close = true;
+        else if (token == "keep-alive" && http10) close = false;
+        else if (token.empty() == false) listed.push_back(std::move(token));
+        begin = end + 1;
+      }
+    }
+    header_list_t kept;
+    for (auto& hdr : headers)
+    {
+      if (is_hop_by_hop(hdr.first)) continue;
+      if (std::find(listed.begin(), listed.end(), hdr.first) != listed.end()) continue;
+      // the length is only known without a transfer encoding
+      if (hdr.first == "content-length" && content_length == -2) continue;
+      kept.push_back(std::move(hdr));
+    }
+    this->headers.swap(kept);
+    this->keep_alive = !close;
+    this->headers_done = true;
+
+    if (head || status == 204 || status == 304) {
+      this->done();
+    }
+    else if (content_length == -2) {
+      if (chunked) state = CHUNK_SIZE;
+      else {
+        state = UNTIL_CLOSE;
+        keep_alive = false;
+      }
+    }
+    else if (content_length >= 0) {
+      remaining = content_length;
+      if (remaining == 0) this->done();
+      else state = BODY;
+    }
+    else {
+      state = UNTIL_CLOSE;
+      keep_alive = false;
+    }
+    return true;
+  }
+  void Http1_response::done()
+  {
+    this->state = DONE;
+    this->complete = true;
+  }
+  bool Http1_response::finish()
+  {
+    if (state == UNTIL_CLOSE) this->done();
+    this->keep_alive = false;
+    return this->complete;
+  }
+
+  Http2_connection::Http2_connection(Balancer& lb, net::Stream_ptr conn, const int fe,
+                                     const net::ip4::Addr src)
+    : frontend(fe), source(src), m_lb(lb), client(std::move(conn))
+  {
+    auto& front = m_lb.get_frontend(frontend);
+    front.sessions++;
+    front.total++;
+  }
+  Http2_connection::~Http2_connection()
+  {
+    this->close();
+  }
+
+  void Http2_connection::start()
+  {
+    client->on_data({this, &Http2_connection::read_client});
+    client->on_close({this, &Http2_connection::client_closed});
+    // our settings go first, the rest are protocol defaults
+    uint8_t settings[6];
+    settings[0] = 0;
+    settings[1] = H2_MAX_CONCURRENT_STREAMS;
+    write32(&settings[2], H2_MAX_STREAMS);
+    this->write_frame(H2_SETTINGS, 0, 0, settings, sizeof(settings));
+    this->flush();
+    // the preface may have arrived with the handshake
+    if (m_closed == false && client->next_size() > 0) this->read_client();
+  }
+  void Http2_connection::read_client()
+  {
+    Stage_scope scope(STAGE_FORWARD);
+    while (m_closed == false && client->next_size() > 0)
+    {
+      auto buffer = client->read_next();
+      inbuf.insert(inbuf.end(), buffer->begin(), buffer->end());
+    }
+    if (m_closed == false && this->process_input()) this->flush();
+  }
+  void Http2_connection::client_closed()
+  {
+    this->close();
+  }
+
+  bool Http2_connection::process_input()
+  {
+    size_t pos = 0;
+    if (m_preface == false)
+    {
+      const size_t n = std::min(inbuf.size(), H2_PREFACE_LEN);
+      if (memcmp(inbuf.data(), h2_preface, n) != 0) {
+        this->connection_error(H2_PROTOCOL_ERROR);
+        return false;
+      }
+      if (n < H2_PREFACE_LEN) return true;
+      m_preface = true;
+      pos = H2_PREFACE_LEN;
+    }
+    while (inbuf.size() - pos >= 9)
+    {
+      const uint8_t* hdr = &inbuf[pos];
+      const uint32_t len = uint32_t(hdr[0]) << 16 | uint32_t(hdr[1]) << 8 | hdr[2];
+      const uint8_t  type  = hdr[3];
+      const uint8_t  flags = hdr[4];
+      const uint32_t id  = read32(&hdr[5]) & 0x7fffffff;
+      if (len > H2_MAX_FRAME) {
+        this->connection_error(H2_FRAME_SIZE_ERROR);
+        return false;
+      }
+      if (inbuf.size() - pos - 9 < len) break;
+      // the preface ends with the clients settings
+      if (m_settings == false && type != H2_SETTINGS) {
+        this->connection_error(H2_PROTOCOL_ERROR);
+        return false;
+      }
+      m_settings = true;
+      if (this->handle_frame(type, flags, id, hdr + 9, len) == false) return false;
+      if (m_closed) return false;
+      pos += 9 + len;
+    }
+    inbuf.erase(inbuf.begin(), inbuf.begin() + pos);
+    return true;
+  }
+
+  bool Http2_connection::handle_frame(const uint8_t type, const uint8_t flags,
+                                      const uint32_t id, const uint8_t* payload,
+                                      const uint32_t len)
+  {
+    // a header block can't be interrupted
+    if (header_stream != 0 && (type != H2_CONTINUATION || id != header_stream)) {
+      this->connection_error(H2_PROTOCOL_ERROR);
+      return false;
+    }
+    switch (type) {
+    case H2_DATA:
+      return this->handle_data(flags, id, payload, len);
+    case H2_HEADERS:
+      return this->handle_headers(flags, id, payload, len);
+    case H2_CONTINUATION:
+      if (header_stream == 0) break;
+      if (header_block.size() + len > H2_MAX_HEADER_BLOCK) {
+        this->connection_error(H2_ENHANCE_YOUR_CALM);
+        return false;
+      }
+      header_block.insert(header_block.end(), payload, payload + len);
+      if (flags & H2_END_HEADERS) return this->end_headers();
+      return true;
+    case H2_PRIORITY:
+      // streams are served in arrival order
+      if (id == 0 || len != 5) break;
+      return true;
+    case H2_RST_STREAM:
+      if (id == 0 || id > last_stream || len != 4) break;
+      if (streams.count(id)) {
+        this->resets++;
+        this->close_stream(id);
+      }
+      return true;
+    case H2_SETTINGS:
+      return this->handle_settings(flags, id, payload, len);
+    case H2_PING:
+      if (id != 0 || len != 8) break;
+      if ((flags & H2_ACK) == 0) this->write_frame(H2_PING, H2_ACK, 0, payload, len);
+      return true;
+    case H2_GOAWAY:
+      if (id != 0 || len < 8) break;
+      // streams in progress are completed, then the connection is closed
+      this->m_goaway = true;
+      return true;
+    case H2_WINDOW_UPDATE:
+      return this->handle_window_update(id, payload, len);
+    case H2_PUSH_PROMISE:
+      // clients can't push
+      break;
+    default:
+      // unknown frame types are ignored
+      return true;
+    }
+    this->connection_error(H2_PROTOCOL_ERROR);
+    return false;
+  }
+
+  bool Http2_connection::handle_headers(const uint8_t flags, const uint32_t id,
+                                        const uint8_t* payload, const uint32_t len)
+  {
+    // client streams are odd-numbered
+    if (id == 0 || (id & 1) == 0) {
+      this->connection_error(H2_PROTOCOL_ERROR);
+      return false;
+    }
+    size_t offset = 0, padding = 0;
+    if (flags & H2_PADDED) {
+      if (len < 1) {
+        this->connection_error(H2_PROTOCOL_ERROR);
+        return false;
+      }
+      padding = payload[0];
+      offset = 1;
+    }
+    if (flags & H2_PRIO) offset += 5;
+    if (offset + padding > len) {
+      this->connection_error(H2_PROTOCOL_ERROR);
+      return false;
+    }
+    header_block.assign(payload + offset, payload + len - padding);
+    this->header_stream = id;
+    this->header_end_stream = flags & H2_END_STREAM;
+    if (flags & H2_END_HEADERS) return this->end_headers();
+    return true;
+  }
+
+  bool Http2_connection::end_headers()
+  {
+    const uint32_t id = this->header_stream;
+    this->header_stream = 0;
+    // every block changes the decoder state, even the refused ones
+    header_list_t headers;
+    if (decoder.decode(header_block.data(), header_block.size(), headers) == false) {
+      this->connection_error(H2_COMPRESSION_ERROR);
+      return false;
+    }
+    header_block.clear();
+
+    auto it = streams.find(id);
+    if (it != streams.end())
+    {
+      // trailers end the request, and are not forwarded
+      auto& st = it->second;
+      if (header_end_stream == false || st.request_done) {
+        this->reset_stream(id, H2_PROTOCOL_ERROR);
+        return true;
+      }
+      st.request_done = true;
+      if (st.chunked) {
+        static const char last_chunk[] = "0\r\n\r\n";
+        st.request.insert(st.request.end(), last_chunk, last_chunk + 5);
+      }
+      this->forward_request(st);
+      return true;
+    }
+    // frames for streams we have closed may still be on their way
+    if (id <= last_stream) return true;
+    last_stream = id;
+    if (m_goaway || streams.size() >= H2_MAX_STREAMS
+        || m_lb.memory_pressure() >= MEMORY_HARD) {
+      this->reset_stream(id, H2_REFUSED_STREAM);
+      return true;
+    }
+    this->open_stream(id, headers, header_end_stream);
+    return true;
+  }
+
+  void Http2_connection::open_stream(const uint32_t id, const header_list_t& headers,
+                                     const bool end_stream)
+  {
+    std::string method, path, scheme, authority, host, cookie;
+    std::string fields;
+    bool regular = false;
+    bool has_length = false;
+    for (const auto& hdr : headers)
+    {
+      const auto& name  = hdr.first;
+      const auto& value = hdr.second;
+      if (is_field_value(value) == false) {
+        this->reset_stream(id, H2_PROTOCOL_ERROR);
+        return;
+      }
+      if (name.empty() == false && name[0] == ':')
+      {
+        // pseudo-headers come first, once each
+        std::string* field = nullptr;
+        if (name == ":method") field = &method;
+        else if (name == ":path") field = &path;
+        else if (name == ":scheme") field = &scheme;
+        else if (name == ":authority") field = &authority;
+        if (regular || field == nullptr || field->empty() == false || value.empty()) {
+          this->reset_stream(id, H2_PROTOCOL_ERROR);
+          return;
+        }
+        *field = value;
+        continue;
+      }
+      regular = true;
+      if (is_token(name) == false || is_hop_by_hop(name)
+          || std::any_of(name.begin(), name.end(), [] (char c) { return c >= 'A' && c <= 'Z'; }))
+      {
+        this->reset_stream(id, H2_PROTOCOL_ERROR);
+        return;
+      }
+      if (name == "te") {
+        if (value != "trailers") {
+          this->reset_stream(id, H2_PROTOCOL_ERROR);
+          return;
+        }
+        continue;
+      }
+      // split cookies are joined again for HTTP/1.1
+      if (name == "cookie") {
+        if (cookie.empty() == false) cookie += "; ";
+        cookie += value;
+        continue;
+      }
+      if (name == "host") {
+        host = value;
+        continue;
+      }
+      if (name == "content-length") has_length = true;
+      fields += name + ": " + value + "\r\n";
+    }
+    if (method == "CONNECT") {
+      // tunnels are not supported
+      this->respond(id, 501, end_stream);
+      return;
+    }
+    if (is_token(method) == false || scheme.empty() || path.empty()
+        || path.find(' ') != std::string::npos
+        || (path[0] != '/' && !(method == "OPTIONS" && path == "*")))
+    {
+      this->reset_stream(id, H2_PROTOCOL_ERROR);
+      return;
+    }
+    if (authority.empty()) authority = host;
+
+    std::string head = method + " " + path + " HTTP/1.1\r\n";
+    if (authority.empty() == false) head += "host: " + authority + "\r\n";
+    if (cookie.empty() == false) head += "cookie: " + cookie + "\r\n";
+    head += fields;
+    bool chunked = false;
+    if (end_stream == false && has_length == false) {
+      // the body length is only known at the end of the stream
+      head += "transfer-encoding: chunked\r\n";
+      chunked = true;
+    }
+    else if (end_stream && has_length == false
+        && (method == "POST" || method == "PUT" || method == "PATCH")) {
+      head += "content-length: 0\r\n";
+    }
+    head += "\r\n";
+
+    auto& st = streams[id];
+    st.id = id;
+    st.request.assign(head.begin(), head.end());
+    st.chunked = chunked;
+    st.request_done = end_stream;
+    st.recv_window = H2_INITIAL_WINDOW;
+    st.send_window = peer_initial_window;
+    st.response.reset(method == "HEAD");
+    const int group = m_lb.router.route(authority, path);
+    st.group = (group >= 0) ? group : m_lb.get_frontend(frontend).group;
+    this->requests++;
+    this->attach(st, true);
+  }
+
+  bool Http2_connection::handle_data(const uint8_t flags, const uint32_t id,
+                                     const uint8_t* payload, const uint32_t len)
+  {
+    if (id == 0 || id > last_stream) {
+      this->connection_error(H2_PROTOCOL_ERROR);
+      return false;
+    }
+    // the connection window counts every frame, also for closed streams
+    if (len > conn_recv_window) {
+      this->connection_error(H2_FLOW_CONTROL_ERROR);
+      return false;
+    }
+    conn_recv_window -= len;
+    conn_unacked += len;
+    if (conn_unacked >= H2_WINDOW_BATCH) {
+      this->window_update(0, conn_unacked);
+      conn_recv_window += conn_unacked;
+      conn_unacked = 0;
+    }
+    auto it = streams.find(id);
+    if (it == streams.end()) return true;
+    auto& st = it->second;
+    if (st.request_done) {
+      this->reset_stream(id, H2_STREAM_CLOSED);
+      return true;
+    }
+    if (len > st.recv_window) {
+      this->reset_stream(id, H2_FLOW_CONTROL_ERROR);
+      return true;
+    }
+    size_t offset = 0, padding = 0;
+    if (flags & H2_PADDED) {
+      if (len < 1 || payload[0] >= len) {
+        this->connection_error(H2_PROTOCOL_ERROR);
+        return false;
+      }
+      padding = payload[0];
+      offset = 1;
+    }
+    st.recv_window -= len;
+    st.unacked += len;
+    const size_t size = len - offset - padding;
+    if (size > 0)
+    {
+      if (st.chunked) {
+        char chunk[24];
+        const int n = snprintf(chunk, sizeof(chunk), "%zx\r\n", size);
+        st.request.insert(st.request.end(), chunk, chunk + n);
+      }
+      st.request.insert(st.request.end(), payload + offset, payload + offset + size);
+      if (st.chunked) {
+        st.request.push_back('\r');
+        st.request.push_back('\n');
+      }
+    }
+    if (flags & H2_END_STREAM)
+    {
+      st.request_done = true;
+      if (st.chunked) {
+        static const char last_chunk[] = "0\r\n\r\n";
+        st.request.insert(st.request.end(), last_chunk, last_chunk + 5);
+      }
+    }
+    this->forward_request(st);
+    return true;
+  }
+
+  bool Http2_connection::handle_settings(const uint8_t flags, const uint32_t id,
+                                         const uint8_t* payload, const uint32_t len)
+  {
+    if (id != 0 || (len % 6) != 0 || ((flags & H2_ACK) && len != 0)) {
+      this->connection_error((id != 0) ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+      return false;
+    }
+    if (flags & H2_ACK) return true;
+    bool window_grew = false;
+    for (uint32_t i = 0; i < len; i += 6)
+    {
+      const uint16_t param = payload[i] << 8 | payload[i+1];
+      const uint32_t value = read32(&payload[i+2]);
+      switch (param) {
+      case H2_INITIAL_WINDOW_SIZE:
+        {
+          if (value > 0x7fffffff) {
+            this->connection_error(H2_FLOW_CONTROL_ERROR);
+            return false;
+          }
+          // applies to the open streams too
+          const int64_t delta = int64_t(value) - peer_initial_window;
+          for (auto& it : streams) it.second.send_window += delta;
+          peer_initial_window = value;
+          window_grew = delta > 0;
+        }
+        break;
+      case H2_MAX_FRAME_SIZE:
+        if (value < 16384 || value > 16777215) {
+          this->connection_error(H2_PROTOCOL_ERROR);
+          return false;
+        }
+        peer_max_frame = value;
+        break;
+      case H2_ENABLE_PUSH:
+        if (value > 1) {
+          this->connection_error(H2_PROTOCOL_ERROR);
+          return false;
+        }
+        break;
+      default:
+        // we don't push, and never use the dynamic table for encoding
+        break;
+      }
+    }
+    this->write_frame(H2_SETTINGS, H2_ACK, 0, nullptr, 0);
+    if (window_grew) this->handle_window_update(0, nullptr, 0);
+    return true;
+  }
+
+  bool Http2_connection::handle_window_update(const uint32_t id, const uint8_t* payload,
+                                              const uint32_t len)
+  {
+    // also called without a frame, after the initial window grew
+    if (payload != nullptr)
+    {
+      if (len != 4) {
+        this->connection_error(H2_FRAME_SIZE_ERROR);
+        return false;
+      }
+      const uint32_t increment = read32(payload) & 0x7fffffff;
+      if (id == 0)
+      {
+        conn_send_window += increment;
+        if (increment == 0 || conn_send_window > 0x7fffffff) {
+          this->connection_error(H2_FLOW_CONTROL_ERROR);
+          return false;
+        }
+      }
+      else
+      {
+        auto it = streams.find(id);
+        if (it == streams.end()) return true;
+        it->second.send_window += increment;
+        if (increment == 0 || it->second.send_window > 0x7fffffff) {
+          this->reset_stream(id, H2_FLOW_CONTROL_ERROR);
+          return true;
+        }
+        this->progress(it->second);
+        return true;
+      }
+    }
+    // every stream may continue, and may finish while doing so
+    std::vector<uint32_t> ids;
+    for (auto& it : streams) {
+      if (it.second.pending.empty() == false) ids.push_back(it.first);
+    }
+    for (const uint32_t sid : ids) {
+      auto it = streams.find(sid);
+      if (it != streams.end()) this->progress(it->second);
+    }
+    return true;
+  }
+
+  void Http2_connection::attach(H2_stream& st, const bool signal)
+  {
+    if (st.upstream != nullptr) return;
+    int node = -1;
+    // streams wait like other clients until the gate opens
+    auto conn = (m_lb.is_warm()) ? m_lb.nodes.lend_connection(node, st.group) : nullptr;
+    if (conn == nullptr)
+    {
+      if (st.waiting == false) {
+        st.waiting = true;
+        waiting.push_back(st.id);
+        m_lb.h2_waiting++;
+      }
+      // continue when the pool signals new connections
+      if (signal) m_lb.get_pool_signal()();
+      return;
+    }
+    if (st.waiting) {
+      st.waiting = false;
+      m_lb.h2_waiting--;
+    }
+    st.node = node;
+    st.upstream = std::move(conn);
+    trace.add(TRACE_H2_STREAM, st.id, node, streams.size());
+    st.upstream->on_data(
+      [this, id = st.id] () {
+        this->read_upstream(id);
+      });
+    st.upstream->on_close(
+      [this, id = st.id] () {
+        this->upstream_closed(id);
+      });
+    this->forward_request(st);
+  }
+  void Http2_connection::forward_request(H2_stream& st)
+  {
+    if (st.upstream == nullptr) return;
+    if (st.request.empty() == false) {
+      st.upstream->write(st.request.data(), st.request.size());
+      st.request.clear();
+    }
+    // the client may send more, now that the node has taken it
+    if (st.request_done == false && st.unacked > 0) {
+      this->window_update(st.id, st.unacked);
+      st.recv_window += st.unacked;
+      st.unacked = 0;
+    }
+  }
+  void Http2_connection::count_waiting(std::vector<int>& per_group) const
+  {
+    for (const uint32_t id : waiting)
+    {
+      auto it = streams.find(id);
+      if (it != streams.end() && it->second.waiting) per_group.at(it->second.group)++;
+    }
+  }
+  void Http2_connection::serve_waiting()
+  {
+    const size_t count = waiting.size();
+    for (size_t i = 0; i < count && waiting.empty() == false; i++)
+    {
+      const uint32_t id = waiting.front();
+      waiting.pop_front();
+      auto it = streams.find(id);
+      // skip streams that are gone or already served
+      if (it == streams.end() || it->second.waiting == false) continue;
+      auto& st = it->second;
+      if (m_lb.nodes.pool_size(st.group) == 0) {
+        waiting.push_back(id);
+        continue;
+      }
+      this->attach(st, false);
+      // the pool was not usable after all
+      if (st.waiting) waiting.push_back(id);
+    }
+    this->flush();
+  }
+
+  void Http2_connection::read_upstream(const uint32_t id)
+  {
+    Stage_scope scope(STAGE_FORWARD);
+    auto it = streams.find(id);
+    if (it == streams.end()) return;
+    this->progress(it->second);
+    this->flush();
+  }
+  void Http2_connection::upstream_closed(const uint32_t id)
+  {
+    auto it = streams.find(id);
+    if (it == streams.end()) return;
+    auto& st = it->second;
+    // the rest of the response may still be unread
+    auto conn = std::move(st.upstream);
+    conn->reset_callbacks();
+    bool ok = true;
+    while (ok && conn->next_size() > 0) {
+      auto buffer = conn->read_next();
+      ok = st.response.feed(buffer->data(), buffer->size());
+    }
+    // NOTE: the stream is destroyed inside its own close callback
+    conn = nullptr;
+    if (ok == false || st.response.finish() == false) {
+      this->fail_stream(st);
+    }
+    else {
+      this->progress(st);
+    }
+    this->flush();
+  }
+
+  void Http2_connection::progress(H2_stream& st)
+  {
+    // read from the node for as long as the client keeps up
+    while (st.upstream != nullptr && st.response.complete == false
+        && st.pending.size() < H2_MAX_PENDING && st.upstream->next_size() > 0)
+    {
+      auto buffer = st.upstream->read_next();
+      if (st.response.feed(buffer->data(), buffer->size()) == false) {
+        this->fail_stream(st);
+        return;
+      }
+    }
+    if (st.response.headers_done && st.headers_sent == false)
+    {
+      std::vector<uint8_t> block;
+      encoder.encode_status(st.response.status, block);
+      for (const auto& hdr : st.response.headers) {
+        encoder.encode(hdr.first, hdr.second, block);
+      }
+      const bool end = st.response.complete && st.response.body.empty();
+      this->send_headers(st.id, block, end);
+      st.headers_sent = true;
+      st.end_sent = end;
+    }
+    if (st.response.body.empty() == false) {
+      st.pending.insert(st.pending.end(), st.response.body.begin(), st.response.body.end());
+      st.response.body.clear();
+    }
+    // the node is done before the client has everything
+    if (st.response.complete && st.upstream != nullptr) this->release_upstream(st);
+
+    size_t sent = 0;
+    while (st.headers_sent && sent < st.pending.size())
+    {
+      const int64_t n = std::min({int64_t(st.pending.size() - sent), int64_t(peer_max_frame),
+                                  conn_send_window, st.send_window});
+      if (n <= 0) break;
+      const bool end = st.response.complete && sent + n == st.pending.size();
+      this->write_frame(H2_DATA, end ? H2_END_STREAM : 0, st.id, &st.pending[sent], n);
+      sent += n;
+      conn_send_window -= n;
+      st.send_window   -= n;
+      st.end_sent = end;
+    }
+    st.pending.erase(st.pending.begin(), st.pending.begin() + sent);
+    // the body ended with what was already sent
+    if (st.response.complete && st.headers_sent && st.end_sent == false
+        && st.pending.empty())
+    {
+      this->write_frame(H2_DATA, H2_END_STREAM, st.id, nullptr, 0);
+      st.end_sent = true;
+    }
+    if (st.end_sent)
+    {
+      // the client doesn't have to finish a request that is answered
+      if (st.request_done) this->close_stream(st.id);
+      else this->reset_stream(st.id, H2_NO_ERROR);
+    }
+  }
+  void Http2_connection::release_upstream(H2_stream& st)
+  {
+    auto conn = std::move(st.upstream);
+    conn->reset_callbacks();
+    // the node must have read the whole request to take another
+    if (st.response.keep_alive && st.request_done && st.request.empty()) {
+      m_lb.nodes.return_connection(st.node, std::move(conn));
+    }
+    else {
+      conn->close();
+    }
+  }
+  void Http2_connection::fail_stream(H2_stream& st)
+  {
+    if (st.upstream != nullptr) {
+      st.upstream->reset_callbacks();
+      st.upstream->close();
+      st.upstream = nullptr;
+    }
+    if (st.headers_sent == false) this->respond(st.id, 502, st.request_done);
+    else this->reset_stream(st.id, H2_INTERNAL_ERROR);
+  }
+
+  void Http2_connection::send_headers(const uint32_t id, const std::vector<uint8_t>& block,
+                                      const bool end_stream)
+  {
+    // blocks larger than a frame continue in CONTINUATION frames
+    size_t offset = 0;
+    uint8_t type = H2_HEADERS;
+    do {
+      const size_t n = std::min<size_t>(block.size() - offset, peer_max_frame);
+      uint8_t flags = (offset + n == block.size()) ? H2_END_HEADERS : 0;
+      if (type == H2_HEADERS && end_stream) flags |= H2_END_STREAM;
+      this->write_frame(type, flags, id, block.data() + offset, n);
+      offset += n;
+      type = H2_CONTINUATION;
+    } while (offset < block.size());
+  }
+  void Http2_connection::respond(const uint32_t id, const int status, const bool end_request)
+  {
+    std::vector<uint8_t> block;
+    encoder.encode_status(status, block);
+    encoder.encode("content-length", "0", block);
+    this->send_headers(id, block, true);
+    if (end_request) this->close_stream(id);
+    else this->reset_stream(id, H2_NO_ERROR);
+  }
+  void Http2_connection::reset_stream(const uint32_t id, const uint32_t code)
+  {
+    uint8_t payload[4];
+    write32(payload, code);
+    this->write_frame(H2_RST_STREAM, 0, id, payload, sizeof(payload));
+    this->close_stream(id);
+  }
+  void Http2_connection::close_stream(const uint32_t id)
+  {
+    auto it = streams.find(id);
+    if (it == streams.end()) return;
+    auto& st = it->second;
+    if (st.waiting) m_lb.h2_waiting--;
+    if (st.upstream != nullptr) {
+      st.upstream->reset_callbacks();
+      st.upstream->close();
+    }
+    streams.erase(it);
+  }
+  void Http2_connection::connection_error(const uint32_t code)
+  {
+    uint8_t payload[8];
+    write32(&payload[0], last_stream);
+    write32(&payload[4], code);
+    this->write_frame(H2_GOAWAY, 0, 0, payload, sizeof(payload));
+    this->flush();
+    this->close();
+  }
+
+  void Http2_connection::write_frame(const uint8_t type, const uint8_t flags,
+                                     const uint32_t id, const void* payload,
+                                     const size_t len)
+  {
+    uint8_t hdr[9];
+    hdr[0] = len >> 16; hdr[1] = len >> 8; hdr[2] = len;
+    hdr[3] = type;
+    hdr[4] = flags;
+    write32(&hdr[5], id);
+    outbuf.insert(outbuf.end(), hdr, hdr + 9);
+    if (len > 0) {
+      auto* data = (const uint8_t*) payload;
+      outbuf.insert(outbuf.end(), data, data + len);
+    }
+  }
+  void Http2_connection::window_update(const uint32_t id, const uint32_t increment)
+  {
+    uint8_t payload[4];
+    write32(payload, increment);
+    this->write_frame(H2_WINDOW_UPDATE, 0, id, payload, sizeof(payload));
+  }
+  void Http2_connection::flush()
+  {
+    if (m_closed) return;
+    // one write per event, whatever the number of frames
+    if (outbuf.empty() == false) {
+      Stage_scope tls(STAGE_TLS);
+      client->write(outbuf.data(), outbuf.size());
+      outbuf.clear();
+    }
+    if (m_goaway && streams.empty()) this->close();
+  }
+  void Http2_connection::close()
+  {
+    if (m_closed) return;
+    m_closed = true;
+    for (auto& it : streams)
+    {
+      auto& st = it.second;
+      if (st.waiting) m_lb.h2_waiting--;
+      if (st.upstream != nullptr) {
+        st.upstream->reset_callbacks();
+        st.upstream->close();
+      }
+    }
+    streams.clear();
+    waiting.clear();
+    client->reset_callbacks();
+    if (client->is_closing() == false && client->is_closed() == false) client->close();
+    m_lb.get_frontend(frontend).sessions--;
+    m_lb.release_client(frontend, source);
+    m_lb.h2_closed();
+  }
+}
@@ -0,0 +1,155 @@
+// This file is a part of the IncludeOS unikernel - www.includeos.org
+//
+// Copyright 2018-2019 IncludeOS AS, Oslo, Norway
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "limiter.hpp"
+#include "hash_table.hpp"
+#include <cassert>
+#include <cstdio>
+
+#define LB_VERBOSE 0
+#if LB_VERBOSE
+#define LBOUT(fmt, ...) printf(fmt, ##__VA_ARGS__)
+#else
+#define LBOUT(fmt, ...) /** **/
+#endif
+
+namespace microLB
+{
+  Client_limiter::Client_limiter(const int table_size, const Client_limits& h,
+                                 const int prefix, const Client_limits& s)
+    : host(h), subnet(s),
+      subnet_prefix(prefix), subnet_mask(prefix_mask(prefix))
+  {
+    assert(table_size > 0);
+    assert(prefix > 0 && prefix < 32);
+    const uint32_t size = probe_table_size(table_size);
+    table.resize(size, Entry{0, 0, 0, 0, 0.0f, 0});
+    this->mask = size - 1;
+  }
+
+  bool Client_limiter::is_stale(const Entry& entry, const uint32_t now) const noexcept
+  {
+    if (entry.sessions > 0) return false;
+    const auto& lim = limits_for(entry.prefix);
+    if (lim.rate <= 0.0f) return true;
+    const float tokens = entry.tokens + (now - entry.last) * 1e-3f * lim.rate;
+    return tokens >= lim.burst;
+  }
+
+  void Client_limiter::refill(Entry& entry, const uint32_t now) const noexcept
+  {
+    const auto& lim = limits_for(entry.prefix);
+    entry.tokens += (now - entry.last) * 1e-3f * lim.rate;
+    if (entry.tokens > lim.burst) entry.tokens = lim.burst;
+    entry.last = now;
+  }
+
+  Client_limiter::Entry*
+  Client_limiter::lookup(const uint32_t addr, const uint8_t prefix,
+                         const uint32_t now, const bool create)
+  {
+    // NOTE: addresses are in network order, so every bit must be mixed
+    // into the low bits, as clients of a network share the first octets
+    const uint32_t hash = mix((uint64_t) addr << 8 | prefix);
+    bool found;
+    Entry* entry = probe(table, mask, hash, found,
+        [=] (const Entry& e) { return e.prefix == prefix && e.addr == addr; },
+        // nothing is ever erased, so the probe ends at an empty slot
+        [] (const Entry& e) { return e.prefix == 0; },
+        [&] (const Entry& e) { return is_stale(e, now); });
+    if (found) return entry;
+    // a new source is let through untracked without a free slot
+    if (create == false || entry == nullptr) return nullptr;
+
+    const auto& lim = limits_for(prefix);
+    *entry = Entry{addr, prefix, 0, 0, lim.burst, now};
+    return entry;
+  }
+
+  bool Client_limiter::admit(const net::ip4::Addr source, const uint64_t now_ms)
+  {
+    const uint32_t now = now_ms;
+    Entry* entries[2] = {nullptr, nullptr};
+    if (host.enabled())
+        entries[0] = lookup(source.whole, 32, now, true);
+    if (subnet.enabled())
+        entries[1] = lookup(source.whole & subnet_mask, subnet_prefix, now, true);
+    if ((host.enabled() && entries[0] == nullptr)
+     || (subnet.enabled() && entries[1] == nullptr)) overflows++;
+
+    // check everything before taking any tokens
+    for (auto* entry : entries)
+    {
+      if (entry == nullptr) continue;
+      const auto& lim = limits_for(entry->prefix);
+      if (lim.sessions > 0 && entry->sessions >= lim.sessions) {
+        LBOUT("Limiter: %s has too many sessions\n", source.to_string().c_str());
+        session_limited++;
+        return false;
+      }
+      if (lim.rate > 0.0f) {
+        this->refill(*entry, now);
+        if (entry->tokens < 1.0f) {
+          LBOUT("Limiter: %s is rate limited\n", source.to_string().c_str());
+          rate_limited++;
+          return false;
+        }
+      }
+    }
+    for (auto* entry : entries)
+    {
+      if (entry != nullptr && limits_for(entry->prefix).rate > 0.0f)
+          entry->tokens -= 1.0f;
+    }
+    admitted++;
+    return true;
+  }
+
+  void Client_limiter::opened(const net::ip4::Addr source, const uint64_t now_ms)
+  {
+    Entry* entries[2] = {nullptr, nullptr};
+    if (host.enabled())
+        entries[0] = lookup(source.whole, 32, now_ms, true);
+    if (subnet.enabled())
+        entries[1] = lookup(source.whole & subnet_mask, subnet_prefix, now_ms, true);
+    for (auto* entry : entries)
+    {
+      if (entry != nullptr && entry->sessions < UINT16_MAX) entry->sessions++;
+    }
+  }
+  void Client_limiter::closed(const net::ip4::Addr source)
+  {
+    Entry* entries[2] = {nullptr, nullptr};
+    if (host.enabled())
+        entries[0] = lookup(source.whole, 32, 0, false);
+    if (subnet.enabled())
+        entries[1] = lookup(source.whole & subnet_mask, subnet_prefix, 0, false);
+    for (auto* entry : entries)
+    {
+      // the entry may have been untracked when the table was full
+      if (entry != nullptr && entry->sessions > 0) entry->sessions--;
+    }
+  }
+
+  int Client_limiter::in_use(const uint64_t now_ms) const
+  {
+    int count = 0;
+    for (const auto& entry : table) {
+      if (entry.prefix != 0 && is_stale(entry, now_ms) == false) count++;
+    }
+    return count;
+  }
+}
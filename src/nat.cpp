@@ -0,0 +1,113 @@
+// This file is a part of the IncludeOS unikernel - www.includeos.org
+//
+// Copyright 2018-2019 IncludeOS AS, Oslo, Norway
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "nat.hpp"
+#include "nodes.hpp"
+#include "trace.hpp"
+#include <net/inet>
+
+namespace microLB
+{
+  using Verdict = net::Filter_verdict_type;
+
+  // both interfaces must see the same connections
+  static std::shared_ptr<net::Conntrack>
+  shared_conntrack(net::Inet& clients, net::Inet& netout, const size_t size)
+  {
+    auto ct = clients.conntrack();
+    if (ct == nullptr) {
+      ct = std::make_shared<net::Conntrack>();
+      clients.enable_conntrack(ct);
+    }
+    if (netout.conntrack() != ct) netout.enable_conntrack(ct);
+    if (ct->maximum_entries < size) {
+      ct->maximum_entries = size;
+      ct->reserve(size);
+    }
+    return ct;
+  }
+
+  Nat_service::Nat_service(Nodes& nodes, net::Inet& clients, const uint16_t port,
+                           net::Inet& netout, const int group, const Nat_config& config)
+    : m_nodes(nodes), m_clients(clients), m_netout(netout),
+      m_vip(clients.ip_addr(), port), m_group(group),
+      m_ct(shared_conntrack(clients, netout, config.table_size)),
+      m_napt(m_ct)
+  {
+    assert(config.table_size > 0);
+    assert(&clients != &netout && "NAT needs separate client and node interfaces");
+    clients.ip_obj().prerouting_chain().chain.push_back({this, &Nat_service::client_in});
+    clients.ip_obj().postrouting_chain().chain.push_back({this, &Nat_service::client_out});
+    netout.ip_obj().prerouting_chain().chain.push_back({this, &Nat_service::node_in});
+    netout.ip_obj().postrouting_chain().chain.push_back({this, &Nat_service::node_out});
+    // NOTE: the balancer installs the forwarder of each interface
+  }
+
+  // client -> VIP: pick a node for new connections, then rewrite the destination
+  Nat_service::Filter_verdict
+  Nat_service::client_in(IP4::IP_packet_ptr pkt, net::Inet&, Conntrack::Entry_ptr ct)
+  {
+    if (is_flow(ct) == false || pkt->ip_dst() != m_vip.address().v4()) {
+      return {std::move(pkt), Verdict::ACCEPT};
+    }
+    // the reply tuple leaves the VIP once the connection has a node
+    if ((ct->second.src == m_vip) == false) {
+      m_napt.dnat(*pkt, ct);
+      return {std::move(pkt), Verdict::ACCEPT};
+    }
+    const int node = m_nodes.select_node(m_group);
+    if (node < 0) {
+      this->dropped++;
+      return {std::move(pkt), Verdict::DROP};
+    }
+    m_napt.dnat(*pkt, ct, m_nodes.get_node(node).address());
+    this->created++;
+    trace.add(TRACE_NAT_FLOW, node, this->active_flows());
+    return {std::move(pkt), Verdict::ACCEPT};
+  }
+  // node -> client: restore the VIP as source
+  Nat_service::Filter_verdict
+  Nat_service::client_out(IP4::IP_packet_ptr pkt, net::Inet&, Conntrack::Entry_ptr ct)
+  {
+    if (is_flow(ct) && pkt->ip_src() != m_vip.address().v4()) {
+      m_napt.snat(*pkt, ct);
+    }
+    return {std::move(pkt), Verdict::ACCEPT};
+  }
+  // node -> us: back to the client address
+  Nat_service::Filter_verdict
+  Nat_service::node_in(IP4::IP_packet_ptr pkt, net::Inet& stack, Conntrack::Entry_ptr ct)
+  {
+    if (is_flow(ct)) m_napt.demasquerade(*pkt, stack, ct);
+    return {std::move(pkt), Verdict::ACCEPT};
+  }
+  // us -> node: the node replies to our address, not the client's
+  Nat_service::Filter_verdict
+  Nat_service::node_out(IP4::IP_packet_ptr pkt, net::Inet& stack, Conntrack::Entry_ptr ct)
+  {
+    if (is_flow(ct)) m_napt.masquerade(*pkt, stack, ct);
+    return {std::move(pkt), Verdict::ACCEPT};
+  }
+
+  void Nat_service::forward(IP4::IP_packet_ptr pkt, net::Inet& source,
+                            Conntrack::Entry_ptr ct)
+  {
+    assert(carries(source, ct));
+    auto& dest = (&source == &m_clients) ? m_netout : m_clients;
+    this->forwarded++;
+    dest.ip_obj().ship(std::move(pkt), IP4::ADDR_ANY, ct);
+  }
+}
@@ -16,12 +16,17 @@
 
 #include "node.hpp"
 #include "balancer.hpp"
+#include <os.hpp>
+#include <algorithm>
 
 // checking if nodes are dead or not
 #define ACTIVE_INITIAL_PERIOD     8s
 #define ACTIVE_CHECK_PERIOD      30s
 // connection attempt timeouts
 #define CONNECT_TIMEOUT          10s
+// connect times kept per node, and needed before the timeout adapts
+#define CONNECT_SAMPLES          64
+#define CONNECT_MIN_SAMPLES       8
 
 #define LB_VERBOSE 0
 #if LB_VERBOSE
@@ -34,9 +39,11 @@ namespace microLB
 {
   Node::Node(Balancer& balancer, const net::Socket addr,
              node_connect_function_t func, bool da, int idx)
-    : m_connect(func), m_socket(addr), m_idx(idx), do_active_check(da)
+    : m_nodes(&balancer.nodes), m_idx(idx), do_active_check(da),
+      m_connect(func), m_socket(addr), m_timeout(CONNECT_TIMEOUT)
   {
     assert(this->m_connect != nullptr);
+    assert(this->m_idx >= 0 && "Nodes are indexed by their owner");
     this->m_pool_signal = balancer.get_pool_signal();
     // periodically connect to node and determine if active
     if (this->do_active_check)
@@ -60,6 +67,7 @@ namespace microLB
   {
     // set as inactive
     this->active = false;
+    m_nodes->node_active_changed(m_idx);
     if (this->do_active_check)
     {
       // begin checking active again
@@ -83,6 +91,7 @@ namespace microLB
   {
     // set as active
     this->active = true;
+    m_nodes->node_active_changed(m_idx);
     if (this->do_active_check)
     {
       // stop active checking for now
@@ -97,39 +106,110 @@ namespace microLB
   {
     // connecting to node atm.
     this->connecting++;
-    this->m_connect(CONNECT_TIMEOUT,
-      [this] (net::Stream_ptr stream)
+    m_nodes->node_connecting_changed(m_idx, 1);
+    trace.add(TRACE_CONNECT_START, this->m_idx, this->connecting);
+    if (m_nodes->connect_policy().hedge_delay.count() > 0) this->arm_hedge();
+    this->m_connect(this->connect_timeout(),
+      [this, start = os::nanos_since_boot()] (net::Stream_ptr stream)
       {
         // no longer connecting
         assert(this->connecting > 0);
         this->connecting --;
+        m_nodes->node_connecting_changed(m_idx, -1);
+        this->connect_done(start, stream != nullptr);
+        if (this->race_lost || this->racing >= 0) {
+          if (this->finish_race(stream != nullptr) == false) {
+            // the other node connected first
+            stream->reset_callbacks();
+            stream->close();
+            return;
+          }
+        }
         // success
         if (stream != nullptr)
         {
           assert(stream->is_connected());
-          LBOUT("Node %d connected to %s (%ld total)\n",
-                this->m_idx, stream->remote().to_string().c_str(), pool.size());
+          trace.add(TRACE_CONNECT_END, this->m_idx, 1, pool.size());
           this->pool.push_back(std::move(stream));
+          m_nodes->node_pool_changed(m_idx, 1);
           // stop any active check
           this->stop_active_check();
           // signal change in pool
+          trace.add(TRACE_POOL_SIGNAL, this->m_idx, pool.size());
           this->m_pool_signal();
         }
         else // failure
         {
-          LBOUT("Node %d failed to connect out (%ld total)\n",
-                this->m_idx, pool.size());
+          trace.add(TRACE_CONNECT_END, this->m_idx, 0, pool.size());
           // restart active check
           this->restart_active_check();
         }
       });
   }
+  timeout_t Node::connect_timeout() const noexcept
+  {
+    const auto& policy = m_nodes->connect_policy();
+    if (policy.adaptive() == false) return CONNECT_TIMEOUT;
+    // too little is known about the node yet
+    if (connect_times.size() < CONNECT_MIN_SAMPLES) return policy.ceiling;
+    return this->m_timeout;
+  }
+  void Node::connect_done(const uint64_t start, const bool success)
+  {
+    if (this->hedge_timer != Timers::UNUSED_ID) {
+      Timers::stop(this->hedge_timer);
+      this->hedge_timer = Timers::UNUSED_ID;
+    }
+    // the other attempts may still be slow
+    if (this->connecting > 0 && m_nodes->connect_policy().hedge_delay.count() > 0) {
+      this->arm_hedge();
+    }
+    // failures are mostly timeouts, which say nothing new
+    if (success == false) return;
+    const uint64_t micros = (os::nanos_since_boot() - start) / 1000;
+    const uint32_t sample = std::min<uint64_t>(micros, UINT32_MAX);
+    if (connect_times.size() < CONNECT_SAMPLES) {
+      connect_times.push_back(sample);
+    } else {
+      connect_times[connect_next] = sample;
+      connect_next = (connect_next + 1) % CONNECT_SAMPLES;
+    }
+    const auto& policy = m_nodes->connect_policy();
+    if (policy.adaptive() == false || connect_times.size() < CONNECT_MIN_SAMPLES) return;
+    auto times = connect_times;
+    auto p99 = times.begin() + (times.size() * 99) / 100;
+    std::nth_element(times.begin(), p99, times.end());
+    const auto timeout = timeout_t((int64_t) (*p99 * policy.multiplier / 1000));
+    this->m_timeout = std::clamp(timeout, policy.floor, policy.ceiling);
+  }
+  bool Node::finish_race(const bool success)
+  {
+    const bool lost = this->race_lost;
+    const int other = this->racing;
+    this->racing = -1;
+    this->race_lost = false;
+    if (lost) return success == false;
+    // the other connect may still be pooled when this one failed
+    if (success) m_nodes->get_node(other).lose_race();
+    else m_nodes->get_node(other).race(-1);
+    return true;
+  }
+  void Node::arm_hedge()
+  {
+    if (this->hedge_timer != Timers::UNUSED_ID) return;
+    this->hedge_timer = Timers::oneshot(m_nodes->connect_policy().hedge_delay,
+      [this] (int) {
+        this->hedge_timer = Timers::UNUSED_ID;
+        if (this->connecting > 0) m_nodes->hedge_connect(m_idx);
+      });
+  }
   net::Stream_ptr Node::get_connection()
   {
     while (pool.empty() == false) {
       auto conn = std::move(pool.back());
       assert(conn != nullptr);
       pool.pop_back();
+      m_nodes->node_pool_changed(m_idx, -1);
       if (conn->is_connected()) {
         return conn;
       }
@@ -141,5 +221,38 @@ namespace microLB
     }
     return nullptr;
   }
+  int Node::shrink_pool(const int keep)
+  {
+    const int excess = (int) pool.size() - keep;
+    if (excess <= 0) return 0;
+    // connections are taken from the back
+    for (int i = 0; i < excess; i++) {
+      pool[i]->reset_callbacks();
+      pool[i]->close();
+    }
+    pool.erase(pool.begin(), pool.begin() + excess);
+    m_nodes->node_pool_changed(m_idx, -excess);
+    return excess;
+  }
+  void Node::return_connection(net::Stream_ptr conn)
+  {
+    assert(conn != nullptr);
+    if (conn->is_connected() == false || conn->is_writable() == false)
+    {
+      conn->close();
+      return;
+    }
+    trace.add(TRACE_POOL_SIGNAL, this->m_idx, pool.size() + 1);
+    this->pool.push_back(std::move(conn));
+    m_nodes->node_pool_changed(m_idx, 1);
+    // signal change in pool, after the callback returning it
+    m_nodes->signal_pool();
+  }
+  void Node::set_rates(const Rate_limits& limits)
+  {
+    if (limits.enabled())
+      this->m_shaper = std::make_unique<Shaper> (limits, os::nanos_since_boot());
+    else
+      this->m_shaper = nullptr;
+  }
 }
-
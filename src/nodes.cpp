@@ -15,7 +15,10 @@
 // limitations under the License.
 
 #include "nodes.hpp"
+#include "balancer.hpp"
+#include "hash_table.hpp"
 #include <net/tcp/stream.hpp>
+#include <os.hpp>
 
 #define LB_VERBOSE 0
 #if LB_VERBOSE
@@ -26,83 +29,371 @@
 
 namespace microLB
 {
-  void Nodes::create_connections(int total)
+  Nodes::Nodes(Balancer& b, bool ac)
+    : m_lb(b), do_active_check(ac)
   {
-    // temporary iterator
+    groups.emplace_back("default");
+  }
+  int Nodes::add_group(const std::string& name)
+  {
+    assert(find_group(name) < 0 && "Node group names must be unique");
+    groups.emplace_back(name);
+    groups.back().ready.resize(nodes.size());
+    groups.back().active.resize(nodes.size());
+    return groups.size() - 1;
+  }
+  int Nodes::find_group(const std::string& name) const
+  {
+    for (size_t i = 0; i < groups.size(); i++) {
+      if (groups[i].name == name) return i;
+    }
+    return -1;
+  }
+  void Nodes::create_connections(int total, const int group_idx)
+  {
+    auto& group = groups.at(group_idx);
+    const auto& members = group.members;
+    if (members.empty()) return;
     for (int i = 0; i < total; i++)
     {
-      bool dest_found = false;
-      // look for next active node up to *size* times
-      for (size_t i = 0; i < nodes.size(); i++)
+      // next active node, round-robin
+      const int iter = group.active.next(group.conn_iterator);
+      if (iter >= 0)
       {
-        const int iter = conn_iterator;
-        conn_iterator = (conn_iterator + 1) % nodes.size();
-        // if the node is active, connect immediately
-        auto& dest_node = nodes[iter];
-        if (dest_node.is_active()) {
-          dest_node.connect();
-          dest_found = true;
-          break;
-        }
-      }
-      // if no active node found, simply delegate to the next node
-      if (dest_found == false)
-      {
-        // with active-checks we can return here later when we get a connection
-        if (this->do_active_check) return;
-        const int iter = conn_iterator;
-        conn_iterator = (conn_iterator + 1) % nodes.size();
+        group.conn_iterator = iter + 1;
         nodes[iter].connect();
+        continue;
       }
+      // with active-checks we can return here later when we get a connection
+      if (this->do_active_check) return;
+      // if no active node found, simply delegate to the next node
+      auto it = std::lower_bound(members.begin(), members.end(), group.conn_iterator);
+      if (it == members.end()) it = members.begin();
+      group.conn_iterator = *it + 1;
+      nodes[*it].connect();
+    }
+  }
+  int Nodes::select_node(const int group_idx)
+  {
+    auto& group = groups.at(group_idx);
+    const auto& members = group.members;
+    if (members.empty()) return -1;
+    const int iter = group.active.next(group.flow_iterator);
+    if (iter >= 0)
+    {
+      group.flow_iterator = iter + 1;
+      return iter;
     }
+    // without active-checks every node is assumed to be up
+    if (this->do_active_check) return -1;
+    auto it = std::lower_bound(members.begin(), members.end(), group.flow_iterator);
+    if (it == members.end()) it = members.begin();
+    group.flow_iterator = *it + 1;
+    return *it;
   }
-  net::Stream_ptr Nodes::assign(net::Stream_ptr conn)
+  net::Stream_ptr Nodes::get_connection(int& node, const int group_idx, const int avoid)
   {
-    for (size_t i = 0; i < nodes.size(); i++)
+    auto& group = groups.at(group_idx);
+    // nodes leave the index as their pools run dry
+    while (group.ready.empty() == false)
     {
-      auto outgoing = nodes[algo_iterator].get_connection();
+      int iter = group.ready.next(group.algo_iterator);
+      // prefer another node, when there is one
+      if (iter == avoid && group.ready.size() > 1) iter = group.ready.next(iter + 1);
+      auto outgoing = nodes[iter].get_connection();
       // algorithm here //
-      algo_iterator = (algo_iterator + 1) % nodes.size();
+      group.algo_iterator = iter + 1;
       // check if connection was retrieved
       if (outgoing != nullptr)
       {
         assert(outgoing->is_connected());
-        LBOUT("Assigning client to node %d (%s)\n",
-              algo_iterator, outgoing->to_string().c_str());
-        //Should we some way hold track of the session object ?
-        auto& session = this->create_session(
-              std::move(conn), std::move(outgoing));
+        node = iter;
+        return outgoing;
+      }
+    }
+    return nullptr;
+  }
+  net::Stream_ptr Nodes::get_affine_connection(int& node, const int group_idx,
+                                               const uint32_t key)
+  {
+    const auto& group = groups.at(group_idx);
+    // rendezvous hashing, so that only the keys of a node
+    // move elsewhere when it goes down
+    int best = -1;
+    uint32_t best_score = 0;
+    for (const int idx : group.members)
+    {
+      if (this->do_active_check && group.active.test(idx) == false) continue;
+      const uint32_t score = mix((uint64_t) key << 32 | idx);
+      if (best < 0 || score > best_score) {
+        best = idx;
+        best_score = score;
+      }
+    }
+    if (best >= 0)
+    {
+      auto outgoing = nodes[best].get_connection();
+      if (outgoing != nullptr) {
+        assert(outgoing->is_connected());
+        node = best;
+        return outgoing;
+      }
+    }
+    // rather another node than waiting for that one
+    return this->get_connection(node, group_idx);
+  }
+  net::Stream_ptr Nodes::assign(net::Stream_ptr conn, const int group)
+  {
+    Stage_scope scope(STAGE_ASSIGN);
+    int node = -1;
+    auto outgoing = this->get_connection(node, group);
+    if (outgoing == nullptr) return conn;
+
+    const auto client = conn->remote();
+    auto& session = this->create_session(std::move(conn), std::move(outgoing), node);
+    trace.add(TRACE_ASSIGN, session.self, node, session.frontend);
+    if (capture.enabled) {
+      session.capture_id = capture.next_id();
+      capture.accept(session.capture_id, session.frontend, client);
+      capture.assign(session.capture_id, node);
+    }
+    return nullptr;
+  }
+  bool Nodes::assign(Waiting& client)
+  {
+    Stage_scope scope(STAGE_ASSIGN);
+    int node = -1;
+    auto outgoing = (client.affinity != 0)
+        ? this->get_affine_connection(node, client.group, client.affinity)
+        : this->get_connection(node, client.group);
+    if (outgoing == nullptr) return false;
 
-        return nullptr;
+    auto& session = this->create_session(
+          std::move(client.conn), std::move(outgoing), node, client.frontend->idx);
+    trace.add(TRACE_ASSIGN, session.self, node, session.frontend);
+    // the session now holds the clients place in the limiter
+    session.source = client.source;
+    client.source  = net::ip4::Addr{};
+    session.capture_id = client.capture_id;
+    client.capture_id  = 0;
+    if (capture.enabled) capture.assign(session.capture_id, node);
+    // client data read while routing goes first
+    if (client.readq.empty() == false)
+    {
+      session.replay(client.readq);
+      session.flush_incoming();
+    }
+    return true;
+  }
+  void Nodes::set_http_mode(const bool enabled)
+  {
+    this->m_http_mode = enabled;
+    this->m_routes_requests = enabled && m_lb.router.has_request_rules();
+  }
+  int Nodes::route_request(const Http_framer& request, const int frontend) const
+  {
+    const int group = m_lb.router.route(request.host(), request.target());
+    if (group >= 0) return group;
+    // unmatched requests go to the group of the frontend
+    if (frontend < (int) m_lb.frontends.size()) return m_lb.frontends[frontend].group;
+    return 0;
+  }
+  bool Nodes::reattach(Session& session)
+  {
+    assert(session.is_attached() == false);
+    int node = -1;
+    auto outgoing = this->get_connection(node, session.group, session.retry.avoid_node);
+    if (outgoing == nullptr)
+    {
+      // continue when the pool signals new connections
+      if (session.waiting == false) {
+        session.waiting = true;
+        this->waiting.push_back(session.self);
+        m_lb.get_pool_signal()();
+      }
+      return false;
+    }
+    trace.add(TRACE_REATTACH, session.self, node);
+    session.attach(std::move(outgoing), node);
+    if (capture.enabled) capture.assign(session.capture_id, node);
+    return true;
+  }
+  void Nodes::detach(Session& session)
+  {
+    assert(session.is_attached());
+    session.flush_pending(Shaper::UPLOAD);
+    auto conn = std::move(session.outgoing);
+    conn->reset_callbacks();
+    const int node = session.node;
+    session.node = -1;
+    trace.add(TRACE_DETACH, session.self, node);
+    nodes.at(node).return_connection(std::move(conn));
+  }
+  net::Stream_ptr Nodes::lend_connection(int& node, const int group)
+  {
+    return this->get_connection(node, group);
+  }
+  void Nodes::return_connection(const int node, net::Stream_ptr conn)
+  {
+    nodes.at(node).return_connection(std::move(conn));
+  }
+  int Nodes::shrink_pools(const int keep)
+  {
+    int closed = 0;
+    for (auto& node : nodes) closed += node.shrink_pool(keep);
+    return closed;
+  }
+  void Nodes::count_memory(Memory_usage& usage, const Memory_budget& budget) const
+  {
+    for (const auto& session : sessions)
+    {
+      if (session.is_alive() == false) continue;
+      usage.sessions += session.buffered() + budget.connection_size;
+      // layered streams are TLS
+      if (session.incoming->transport() != nullptr) usage.tls += budget.tls_size;
+      if (session.is_attached()) {
+        usage.sessions += budget.connection_size;
+        if (session.outgoing->transport() != nullptr) usage.tls += budget.tls_size;
       }
     }
-    return conn;
+    usage.pools += (size_t) (m_pool + m_connecting) * budget.connection_size;
   }
-  int Nodes::pool_connecting() const {
-    int count = 0;
-    for (auto& node : nodes) count += node.connection_attempts();
-    return count;
+  size_t Nodes::shed_sessions(const size_t bytes)
+  {
+    std::vector<std::pair<size_t, int>> largest;
+    for (const auto& session : sessions)
+    {
+      if (session.is_alive() == false) continue;
+      const size_t held = session.buffered();
+      if (held > 0) largest.emplace_back(held, session.self);
+    }
+    std::sort(largest.begin(), largest.end(), std::greater<>());
+    size_t freed = 0;
+    for (const auto& entry : largest)
+    {
+      if (freed >= bytes) break;
+      auto& session = sessions.at(entry.second);
+      // drop whatever is queued, instead of sending it
+      session.incoming->reset_callbacks();
+      session.incoming->abort();
+      if (session.is_attached()) {
+        session.outgoing->reset_callbacks();
+        session.outgoing->abort();
+      }
+      this->close_session(session.self);
+      freed += entry.first;
+    }
+    return freed;
   }
-  int Nodes::pool_size() const {
-    int count = 0;
-    for (auto& node : nodes) count += node.pool_size();
-    return count;
+  void Nodes::shape_nodes(const Rate_limits& limits)
+  {
+    for (auto& node : nodes) node.set_rates(limits);
+    if (limits.enabled()) this->enable_shaping();
   }
-  Session& Nodes::create_session(net::Stream_ptr client, net::Stream_ptr outgoing)
+  uint64_t Nodes::shape(Session& session, const Shaper::direction_t dir,
+                        const size_t bytes)
+  {
+    const uint64_t now = os::nanos_since_boot();
+    Shaper* shapers[3] = {
+      session.shaper.get(),
+      (session.frontend < (int) m_lb.frontends.size())
+          ? m_lb.frontends[session.frontend].shaper.get() : nullptr,
+      (session.node >= 0) ? nodes[session.node].shaper() : nullptr
+    };
+    // the slowest bucket decides, and nothing is taken until all agree
+    uint64_t wait = 0;
+    for (auto* shaper : shapers) {
+      if (shaper) wait = std::max(wait, shaper->wait_time(dir, now));
+    }
+    if (wait > 0) return wait;
+    for (auto* shaper : shapers) {
+      if (shaper) shaper->consume(dir, bytes);
+    }
+    return 0;
+  }
+  void Nodes::count_waiting(std::vector<int>& per_group) const
+  {
+    for (const int idx : waiting)
+    {
+      auto& session = sessions.at(idx);
+      if (session.waiting && session.is_alive()) per_group.at(session.group)++;
+    }
+  }
+  void Nodes::serve_waiting()
+  {
+    const size_t count = waiting.size();
+    for (size_t i = 0; i < count && waiting.empty() == false; i++)
+    {
+      const int idx = waiting.front();
+      waiting.pop_front();
+      auto& session = sessions.at(idx);
+      // skip sessions that are gone or already served
+      if (session.waiting == false) continue;
+      if (session.is_alive() == false || session.is_attached()) {
+        session.waiting = false;
+        continue;
+      }
+      // keep waiting until its own group has connections
+      if (this->pool_size(session.group) == 0) {
+        waiting.push_back(idx);
+        continue;
+      }
+      session.waiting = false;
+      session.flush_incoming();
+    }
+  }
+  void Nodes::node_pool_changed(const int node, const int delta)
+  {
+    auto& group = groups[node_groups[node]];
+    group.pool += delta;
+    this->m_pool += delta;
+    group.ready.set(node, nodes[node].pool_size() > 0);
+  }
+  void Nodes::node_connecting_changed(const int node, const int delta)
+  {
+    groups[node_groups[node]].connecting += delta;
+    this->m_connecting += delta;
+  }
+  void Nodes::node_active_changed(const int node)
+  {
+    auto& active = groups[node_groups[node]].active;
+    const bool now = nodes[node].is_active();
+    if (active.test(node) != now) this->m_active += (now) ? 1 : -1;
+    active.set(node, now);
+  }
+
+  Session& Nodes::create_session(net::Stream_ptr client, net::Stream_ptr outgoing,
+                                 const int node, const int frontend)
   {
     int idx = -1;
     if (free_sessions.empty()) {
       idx = sessions.size();
-      sessions.emplace_back(*this, idx, std::move(client), std::move(outgoing));
+      sessions.emplace_back(*this, idx, std::move(client), std::move(outgoing), node);
     } else {
       idx = free_sessions.back();
-      new (&sessions[idx]) Session(*this, idx, std::move(client), std::move(outgoing));
+      new (&sessions[idx]) Session(*this, idx, std::move(client), std::move(outgoing), node);
       free_sessions.pop_back();
     }
+    if (node >= 0) sessions[idx].group = node_groups.at(node);
+    if (m_coalesce.size > 0) sessions[idx].coalesce[Shaper::UPLOAD] = &m_coalesce;
+    sessions[idx].frontend = frontend;
+    if (frontend < (int) m_lb.frontends.size()) {
+      auto& fe = m_lb.frontends[frontend];
+      fe.sessions++;
+      fe.total++;
+      if (fe.coalesce.size > 0) sessions[idx].coalesce[Shaper::DOWNLOAD] = &fe.coalesce;
+      // opaque TLS, never framed as HTTP
+      if (fe.passthrough) sessions[idx].http = nullptr;
+      if (fe.session_rates.enabled()) {
+        sessions[idx].shaper =
+            std::make_unique<Shaper> (fe.session_rates, os::nanos_since_boot());
+      }
+    }
     session_total++;
     session_cnt++;
     LBOUT("New session %d  (current = %d, total = %ld)\n",
           idx, session_cnt, session_total);
+    if (on_session_open) on_session_open(sessions[idx]);
     return sessions[idx];
   }
   Session& Nodes::get_session(int idx)
@@ -120,11 +411,19 @@ namespace microLB
 
       // free session destroying potential unique ptr objects
       session.incoming = nullptr;
-      auto out_tcp = dynamic_cast<net::tcp::Stream*>(session.outgoing->bottom_transport())->tcp();
-      session.outgoing = nullptr;
-      // if we don't have anything to write to the backend, abort it.
-      if(not out_tcp->sendq_size())
-        out_tcp->abort();
+      session.http = nullptr;
+      session.waiting = false;
+      session.readq.clear();
+      session.stop_timers();
+      if (session.is_attached())
+      {
+        // only TCP connections can be aborted here (found when attached)
+        auto out_tcp = (session.node_tcp) ? session.node_tcp->tcp() : nullptr;
+        session.outgoing = nullptr;
+        // if we don't have anything to write to the backend, abort it.
+        if(out_tcp != nullptr && not out_tcp->sendq_size())
+          out_tcp->abort();
+      }
       free_sessions.push_back(session.self);
       LBOUT("Session %d destroyed  (total = %d)\n", session.self, session_cnt);
     }
@@ -132,20 +431,203 @@ namespace microLB
   }
   void Nodes::close_session(int idx)
   {
+    Stage_scope scope(STAGE_TEARDOWN);
     auto& session = get_session(idx);
+    // coalesced data still goes to whichever side is open, such as
+    // the last of a response from a node that has closed
+    session.flush_pending(Shaper::UPLOAD);
+    session.flush_pending(Shaper::DOWNLOAD);
     // remove connections
     session.incoming->reset_callbacks();
-    session.outgoing->reset_callbacks();
+    if (session.is_attached()) session.outgoing->reset_callbacks();
     closed_sessions.push_back(session.self);
+    if (session.frontend < (int) m_lb.frontends.size()) {
+      auto& frontend = m_lb.frontends[session.frontend];
+      frontend.sessions--;
+      if (session.source.whole != 0) frontend.limiter->closed(session.source);
+    }
+    session.source = net::ip4::Addr{};
 
     destroy_sessions();
 
     session_cnt--;
-    LBOUT("Session %d closed  (total = %d)\n", session.self, session_cnt);
+    trace.add(TRACE_SESSION_CLOSE, session.self, session.node, session_cnt);
+    if (capture.enabled) capture.close(session.capture_id);
     if (on_session_close) on_session_close(session.self, session_cnt, session_total);
   }
+  void Nodes::set_retry_policy(const Retry_policy& policy)
+  {
+    this->m_retry = policy;
+    this->retry_budget = Token_bucket(policy.budget, std::max(1.0f, policy.budget),
+                                      os::nanos_since_boot());
+  }
+  void Nodes::signal_pool()
+  {
+    if (pool_timer.is_running()) return;
+    pool_timer.start(std::chrono::milliseconds(0),
+      [this] () {
+        m_lb.get_pool_signal()();
+      });
+  }
+  void Nodes::response_changed(const int64_t delta)
+  {
+    this->m_response_bytes += delta;
+    if (delta >= 0 || room_waiting.empty() || response_room() == false) return;
+    // once the session that freed the room is done
+    if (room_timer.is_running()) return;
+    room_timer.start(std::chrono::milliseconds(0),
+      [this] () {
+        auto waiting = std::move(room_waiting);
+        room_waiting.clear();
+        for (const int idx : waiting)
+        {
+          if (idx >= (int) sessions.size()) continue;
+          auto& session = sessions[idx];
+          if (session.is_alive() && session.is_attached()) session.flush_outgoing();
+        }
+      });
+  }
+  void Nodes::wait_for_room(Session& session)
+  {
+    if (std::find(room_waiting.begin(), room_waiting.end(), session.self)
+        == room_waiting.end()) room_waiting.push_back(session.self);
+  }
+  void Nodes::mark_ready(Session& session, const Shaper::direction_t dir)
+  {
+    if (session.ready == 0) ready_sessions.push_back(session.self);
+    session.ready |= 1 << dir;
+    // once the current event loop turn is done
+    if (batch_timer.is_running() == false) {
+      batch_timer.start(std::chrono::milliseconds(0), {this, &Nodes::run_batch});
+    }
+  }
+  bool Nodes::batch_quota(Session& session, const Shaper::direction_t dir,
+                          const size_t bytes)
+  {
+    // forwarding outside of a turn, such as from timers, is not limited
+    if (this->m_in_batch == false) return true;
+    if (this->m_quota <= 0) {
+      this->mark_ready(session, dir);
+      return false;
+    }
+    this->m_quota -= bytes;
+    return true;
+  }
+  void Nodes::run_batch()
+  {
+    Stage_scope scope(STAGE_FORWARD);
+    // sessions queued during this turn go to the next one
+    batch.swap(ready_sessions);
+    int64_t work = (m_batching.tick > 0) ? m_batching.tick : INT64_MAX;
+    size_t next = 0;
+    this->m_in_batch = true;
+    while (next < batch.size() && work > 0)
+    {
+      auto& session = sessions[batch[next++]];
+      const uint8_t ready = session.ready;
+      session.ready = 0;
+      for (const auto dir : {Shaper::UPLOAD, Shaper::DOWNLOAD})
+      {
+        if ((ready & (1 << dir)) == 0 || session.is_alive() == false) continue;
+        this->m_quota = m_batching.quantum;
+        if (dir == Shaper::UPLOAD)
+            session.flush_incoming();
+        else if (session.is_attached() || session.response_bytes > 0)
+            session.flush_outgoing();
+        work -= m_batching.quantum - m_quota;
+      }
+    }
+    this->m_in_batch = false;
+    // the sessions left out go first next time
+    if (next < batch.size())
+    {
+      ready_sessions.insert(ready_sessions.begin(), batch.begin() + next, batch.end());
+      if (batch_timer.is_running() == false) {
+        batch_timer.start(std::chrono::milliseconds(0), {this, &Nodes::run_batch});
+      }
+    }
+    batch.clear();
+  }
+  void Nodes::set_connect_policy(const Connect_policy& policy)
+  {
+    assert(policy.floor <= policy.ceiling);
+    this->m_connect = policy;
+  }
+  void Nodes::hedge_connect(const int node)
+  {
+    const int gidx = node_groups.at(node);
+    auto& group = groups.at(gidx);
+    // clients only wait on the node while the pool is empty, and
+    // otherwise the connect is a check, or fills the pool ahead of time
+    if (group.pool > 0 || m_lb.has_waiting(gidx) == false) return;
+    const auto& members = group.members;
+    auto it = std::upper_bound(members.begin(), members.end(), node);
+    for (size_t i = 0; i < members.size(); i++, it++)
+    {
+      if (it == members.end()) it = members.begin();
+      const int other = *it;
+      if (other == node || nodes[other].connection_attempts() > 0) continue;
+      if (this->do_active_check && group.active.test(other) == false) continue;
+      trace.add(TRACE_HEDGE, node, other);
+      // whichever connects first is kept
+      nodes[node].race(other);
+      nodes[other].race(node);
+      try {
+        nodes[other].connect();
+      } catch (std::exception& e) {
+        nodes[node].race(-1);
+        nodes[other].race(-1);
+        // do nothing, the slow connect may still succeed
+        LBOUT("Hedge to node %d exception %s\n", other, e.what());
+      }
+      return;
+    }
+  }
+  void Nodes::node_closed(const int idx)
+  {
+    auto& session = get_session(idx);
+    if (session.retry.armed && session.retry.reset
+        && session.retry.attempts < m_retry.attempts)
+    {
+      if (m_retry.budget <= 0.0f || retry_budget.consume(os::nanos_since_boot())) {
+        this->retry(session);
+        return;
+      }
+    }
+    if (this->buffers_responses() && session.finish_response()) return;
+    this->close_session(idx);
+  }
+  void Nodes::retry(Session& session)
+  {
+    assert(session.is_attached() && session.readq.empty());
+    trace.add(TRACE_RETRY, session.self, session.node, session.retry.attempts + 1);
+    // NOTE: called from the close handler of the node connection
+    this->retire(std::move(session.outgoing));
+    // the unsent data is also in the retry buffer
+    session.pending[Shaper::UPLOAD] = nullptr;
+    session.retry.attempts++;
+    session.retry.avoid_node = session.node;
+    session.node = -1;
+    session.readq = std::move(session.retry.sent);
+    session.retry.sent.clear();
+    session.retry.armed = false;
+    // sends the client data again, or waits for a connection
+    session.flush_incoming();
+  }
+  void Nodes::retire(net::Stream_ptr stream)
+  {
+    stream->reset_callbacks();
+    retired.push_back(std::move(stream));
+    if (cleanup_timer.is_running()) return;
+    cleanup_timer.start(std::chrono::milliseconds(0),
+      [this] () {
+        retired.clear();
+      });
+  }
   void Nodes::close_all_sessions()
   {
+    for (auto& session : sessions) session.stop_timers();
+    room_waiting.clear();
     sessions.clear();
     free_sessions.clear();
   }
@@ -20,14 +20,88 @@
 #include <net/openssl/tls_stream.hpp>
 #include <net/inet>
 #include <net/tcp/stream.hpp>
+#include <openssl/pem.h>
+#include <os.hpp>
+#include <cstring>
 
 namespace microLB
 {
+  static int client_server_name(SSL*, int*, void*)
+  {
+    // accept every name, and keep it for routing
+    return SSL_TLSEXT_ERR_OK;
+  }
+  static int client_alpn_select(SSL*, const unsigned char** out, unsigned char* outlen,
+                                const unsigned char* in, unsigned int inlen, void*)
+  {
+    // HTTP/2 when offered, otherwise what we always spoke
+    static const unsigned char h2[] = "\x02h2";
+    static const unsigned char http11[] = "\x08http/1.1";
+    auto** selected = const_cast<unsigned char**> (out);
+    if (SSL_select_next_proto(selected, outlen, h2, sizeof(h2) - 1, in, inlen)
+        == OPENSSL_NPN_NEGOTIATED) return SSL_TLSEXT_ERR_OK;
+    if (SSL_select_next_proto(selected, outlen, http11, sizeof(http11) - 1, in, inlen)
+        == OPENSSL_NPN_NEGOTIATED) return SSL_TLSEXT_ERR_OK;
+    return SSL_TLSEXT_ERR_NOACK;
+  }
+  static bool negotiated_http2(const SSL* ssl)
+  {
+    const unsigned char* proto = nullptr;
+    unsigned int len = 0;
+    SSL_get0_alpn_selected(ssl, &proto, &len);
+    return len == 2 && memcmp(proto, "h2", 2) == 0;
+  }
+
+  // Every node has a client context of its own, derived from the shared
+  // one, which keeps the nodes last session. The stream starts its
+  // handshake as soon as it is created, so the session is set when the
+  // handshake starts, found through the context of the streams SSL.
+  static int node_session_index = -1;
+
+  static void free_node_session(void*, void* session, CRYPTO_EX_DATA*, int, long, void*)
+  {
+    if (session != nullptr) SSL_SESSION_free((SSL_SESSION*) session);
+  }
+  static void node_tls_info(const SSL* ssl, int where, int)
+  {
+    if ((where & SSL_CB_HANDSHAKE_START) == 0 || SSL_get_session(ssl) != nullptr) return;
+    // resume the previous session with this node, if any
+    auto* session = (SSL_SESSION*) SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl),
+                                                      node_session_index);
+    if (session != nullptr) SSL_set_session((SSL*) ssl, session);
+  }
+  static int node_tls_new_session(SSL* ssl, SSL_SESSION* session)
+  {
+    auto* ctx = SSL_get_SSL_CTX(ssl);
+    auto* previous = (SSL_SESSION*) SSL_CTX_get_ex_data(ctx, node_session_index);
+    if (previous != nullptr) SSL_SESSION_free(previous);
+    // we are keeping the reference, until replaced or the context is freed
+    SSL_CTX_set_ex_data(ctx, node_session_index, session);
+    return 1;
+  }
+  static std::shared_ptr<SSL_CTX> create_node_context(SSL_CTX* shared)
+  {
+    SSL_CTX* ctx = SSL_CTX_new(TLS_client_method());
+    assert(ctx != nullptr);
+    // verified like the shared context
+    X509_STORE* store = SSL_CTX_get_cert_store(shared);
+    X509_STORE_up_ref(store);
+    SSL_CTX_set_cert_store(ctx, store);
+    SSL_CTX_set_verify(ctx, SSL_CTX_get_verify_mode(shared), nullptr);
+    // keep one session, and resume it on reconnect
+    SSL_CTX_set_session_cache_mode(ctx,
+          SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, node_tls_new_session);
+    SSL_CTX_set_info_callback(ctx, node_tls_info);
+    return std::shared_ptr<SSL_CTX> (ctx, SSL_CTX_free);
+  }
+
   void Balancer::open_for_ossl(
         netstack_t&        interface,
         const uint16_t     client_port,
         const std::string& tls_cert,
-        const std::string& tls_key)
+        const std::string& tls_key,
+        const int          frontend)
   {
     fs::memdisk().init_fs(
     [] (fs::error_t err, fs::File_system&) {
@@ -37,25 +111,177 @@ namespace microLB
     openssl::init();
     openssl::verify_rng();
 
-    this->tls_context = openssl::create_server(tls_cert, tls_key);
+    auto& fe = this->get_frontend(frontend);
+    assert(fe.tls_context == nullptr && "One certificate per frontend");
+    auto* ctx = openssl::create_server(tls_cert, tls_key);
+    SSL_CTX_set_tlsext_servername_callback(ctx, client_server_name);
+    if (fe.http2) SSL_CTX_set_alpn_select_cb(ctx, client_alpn_select, nullptr);
+    fe.tls_context = ctx;
+    fe.tls_free = [ctx] () {
+        SSL_CTX_free(ctx);
+      };
 
-    interface.tcp().listen(client_port,
-      [this] (net::tcp::Connection_ptr conn) {
+    auto& listener = interface.tcp().listen(client_port,
+      [this, ctx, frontend] (net::tcp::Connection_ptr conn) {
         if (conn != nullptr)
         {
-          auto* stream = new openssl::TLS_stream(
-              (SSL_CTX*) this->tls_context,
-              std::make_unique<net::tcp::Stream>(conn)
+          Stage_scope scope(STAGE_ACCEPT);
+          // handshakes count towards the limits of the client
+          const auto source = this->count_client(frontend, conn->remote());
+          // the handshake and the records are processed in transport callbacks
+          auto* stream = make_pooled<openssl::TLS_stream> (
+              &stream_pools.tls,
+              ctx,
+              stage_transport(
+                  net::Stream_ptr(make_pooled<net::tcp::Stream> (&stream_pools.tcp, conn)),
+                  STAGE_TLS, &stream_pools.stage)
           );
           stream->on_connect(
-            [this, stream] (auto&) {
-              this->incoming(std::unique_ptr<openssl::TLS_stream> (stream));
+            [this, stream, frontend, source] (auto&) {
+              // the negotiated protocol and server name, from the streams own SSL
+              const SSL* ssl = stream->get_ssl();
+              if (negotiated_http2(ssl)) {
+                this->incoming_http2(std::unique_ptr<openssl::TLS_stream> (stream),
+                                     frontend, source);
+                return;
+              }
+              // route and classify on the server name (SNI), if there are rules for it
+              int group = -1;
+              int cls = -1;
+              if (router.has_server_name_rules() || router.has_server_name_classes())
+              {
+                const char* name = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+                if (name != nullptr) {
+                  group = router.route_server_name(name);
+                  cls = router.classify_server_name(name);
+                }
+              }
+              this->incoming(std::unique_ptr<openssl::TLS_stream> (stream),
+                             group, frontend, cls, source);
             });
           stream->on_close(
-            [stream] () {
-              delete stream;
+            [this, stream, frontend, source] () {
+              // the handshake failed
+              this->release_client(frontend, source);
+              stream->reset_callbacks();
+              // not from within its own callback
+              Timers::oneshot(std::chrono::milliseconds(0),
+                  [stream] (int) { delete stream; });
             });
         }
       });
+    this->limit_clients(listener, frontend);
   } // open_ossl(...)
+
+  void* Balancer::create_node_tls_context(
+        const bool         verify_peer,
+        const std::string& ca_cert)
+  {
+    assert(this->node_tls_context == nullptr);
+    openssl::init();
+    if (node_session_index < 0) {
+      node_session_index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr,
+                                                     free_node_session);
+    }
+
+    SSL_CTX* ctx = SSL_CTX_new(TLS_client_method());
+    assert(ctx != nullptr);
+
+    if (verify_peer)
+    {
+      assert(!ca_cert.empty() && "Verifying nodes requires a CA certificate");
+      fs::memdisk().init_fs(
+      [] (fs::error_t err, fs::File_system&) {
+        assert(!err);
+      });
+      auto pem = fs::memdisk().fs().read_file(ca_cert).to_string();
+      BIO* bio = BIO_new_mem_buf(pem.data(), pem.size());
+      X509_STORE* store = SSL_CTX_get_cert_store(ctx);
+      int certs = 0;
+      while (X509* cert = PEM_read_bio_X509(bio, nullptr, nullptr, nullptr))
+      {
+        X509_STORE_add_cert(store, cert);
+        X509_free(cert);
+        certs++;
+      }
+      BIO_free(bio);
+      if (certs == 0)
+          throw std::runtime_error("No CA certificates in " + ca_cert);
+      SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, nullptr);
+    }
+    else {
+      SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, nullptr);
+    }
+
+    this->node_tls_context = ctx;
+    this->de_helper.nod_ctx = ctx;
+    this->node_tls_free = [ctx] () {
+        SSL_CTX_free(ctx);
+      };
+    return ctx;
+  }
+
+  // TLS nodes: the handshake is completed before the connection
+  // is handed to the pool, so that clients never wait for it
+  node_connect_function_t Balancer::connect_with_tls(
+          netstack_t& interface,
+          net::Socket socket,
+          void*       tls_ctx,
+          Stream_pools* pools)
+  {
+    assert(tls_ctx != nullptr && "Missing node TLS context");
+    auto tcp_connect = connect_with_tcp(interface, socket, pools);
+    // lives as long as the node, with its session
+    auto node_ctx = create_node_context((SSL_CTX*) tls_ctx);
+
+    return node_connect_function_t::make_packed(
+      [tcp_connect, node_ctx, pools] (timeout_t timeout, node_connect_result_t callback)
+      {
+        // the handshake gets what the connect left of the timeout
+        const uint64_t deadline = os::nanos_since_boot()
+            + std::chrono::duration_cast<std::chrono::nanoseconds>(timeout).count();
+        tcp_connect(timeout, node_connect_result_t::make_packed(
+        [node_ctx, pools, callback, deadline] (net::Stream_ptr transport)
+        {
+          if (transport == nullptr) {
+            callback(nullptr);
+            return;
+          }
+          auto* stream = make_pooled<openssl::TLS_stream> (
+              (pools) ? &pools->tls : nullptr, node_ctx.get(),
+              stage_transport(std::move(transport), STAGE_TLS,
+                              (pools) ? &pools->stage : nullptr), true);
+          const uint64_t now = os::nanos_since_boot();
+          const auto left = std::chrono::nanoseconds((deadline > now) ? deadline - now : 0);
+          int timer = Timers::oneshot(left,
+              Timers::handler_t::make_packed(
+              [stream, callback] (int) {
+                stream->reset_callbacks();
+                stream->abort();
+                delete stream;
+                callback(nullptr);
+              }));
+          stream->on_connect(
+            net::Stream::ConnectCallback::make_packed(
+            [timer, stream, callback] (net::Stream&) {
+              // stop timeout after successful handshake
+              Timers::stop(timer);
+              stream->reset_callbacks();
+              callback(net::Stream_ptr(stream));
+            }));
+          stream->on_close(
+            net::Stream::CloseCallback::make_packed(
+            [timer, stream, callback] () {
+              // the handshake failed
+              Timers::stop(timer);
+              stream->reset_callbacks();
+              // not from within its own callback
+              Timers::oneshot(std::chrono::milliseconds(0),
+                  Timers::handler_t::make_packed(
+                  [stream] (int) { delete stream; }));
+              callback(nullptr);
+            }));
+        }));
+      });
+  }
 }
@@ -0,0 +1,159 @@
+// This file is a part of the IncludeOS unikernel - www.includeos.org
+//
+// Copyright 2018-2019 IncludeOS AS, Oslo, Norway
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "router.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+
+// host names are compared lowercase, and without port
+#define MAX_HOST_LENGTH   255
+
+namespace microLB
+{
+  static std::string normalize_host(std::string_view host)
+  {
+    // strip port, but not from IPv6 literals
+    const size_t colon = host.rfind(':');
+    if (colon != std::string_view::npos && host.find(']') == std::string_view::npos) {
+      host = host.substr(0, colon);
+    }
+    if (!host.empty() && host.back() == '.') host.remove_suffix(1);
+    std::string result(host.substr(0, MAX_HOST_LENGTH));
+    for (auto& c : result) c = tolower(c);
+    return result;
+  }
+
+  void Router::Trie::insert(std::string_view prefix, const int group)
+  {
+    int v = 0;
+    for (const char c : prefix)
+    {
+      auto& edges = vertices[v].edges;
+      auto it = std::lower_bound(edges.begin(), edges.end(), c,
+          [] (const auto& edge, char ch) { return edge.first < ch; });
+      if (it != edges.end() && it->first == c) {
+        v = it->second;
+        continue;
+      }
+      const int next = vertices.size();
+      edges.insert(it, {c, next});
+      // NOTE: invalidates edges
+      vertices.emplace_back();
+      v = next;
+    }
+    vertices[v].group = group;
+  }
+  int Router::Trie::longest_match(std::string_view path) const
+  {
+    int v = 0;
+    int match = vertices[0].group;
+    for (const char c : path)
+    {
+      auto& edges = vertices[v].edges;
+      auto it = std::lower_bound(edges.begin(), edges.end(), c,
+          [] (const auto& edge, char ch) { return edge.first < ch; });
+      if (it == edges.end() || it->first != c) break;
+      v = it->second;
+      if (vertices[v].group >= 0) match = vertices[v].group;
+    }
+    return match;
+  }
+
+  template <typename T>
+  T& Router::Host_table<T>::insert(const std::string& host)
+  {
+    if (host.size() > 2 && host[0] == '*' && host[1] == '.') {
+      return wildcard[host.substr(1)];
+    }
+    return exact[host];
+  }
+  template <typename T>
+  const T* Router::Host_table<T>::find(std::string_view host) const
+  {
+    if (!exact.empty()) {
+      auto it = exact.find(std::string(host));
+      if (it != exact.end()) return &it->second;
+    }
+    if (!wildcard.empty())
+    {
+      // try every parent domain, the most specific first
+      size_t dot = host.find('.');
+      while (dot != std::string_view::npos)
+      {
+        auto it = wildcard.find(std::string(host.substr(dot)));
+        if (it != wildcard.end()) return &it->second;
+        dot = host.find('.', dot + 1);
+      }
+    }
+    return nullptr;
+  }
+  template <typename T>
+  T* Router::Host_table<T>::find(std::string_view host)
+  {
+    return const_cast<T*> (
+        static_cast<const Host_table<T>*> (this)->find(host));
+  }
+
+  void Router::add_rule(const std::string& host, const std::string& path,
+                        const int group)
+  {
+    assert(group >= 0);
+    if (host.empty()) {
+      any_host.insert(path, group);
+      m_any_host = true;
+    }
+    else {
+      hosts.insert(normalize_host(host)).insert(path, group);
+    }
+  }
+  void Router::add_server_name(const std::string& name, const int group)
+  {
+    assert(group >= 0);
+    server_names.insert(normalize_host(name)) = group;
+  }
+  void Router::add_server_name_class(const std::string& name, const int cls)
+  {
+    assert(cls >= 0);
+    server_name_classes.insert(normalize_host(name)) = cls;
+  }
+
+  int Router::route(std::string_view host, std::string_view path) const
+  {
+    // ignore the query string
+    path = path.substr(0, path.find('?'));
+    if (!hosts.exact.empty() || !hosts.wildcard.empty())
+    {
+      auto* trie = hosts.find(normalize_host(host));
+      if (trie != nullptr) {
+        const int group = trie->longest_match(path);
+        if (group >= 0) return group;
+      }
+    }
+    if (m_any_host) return any_host.longest_match(path);
+    return -1;
+  }
+  int Router::route_server_name(std::string_view name) const
+  {
+    auto* group = server_names.find(normalize_host(name));
+    return (group) ? *group : -1;
+  }
+  int Router::classify_server_name(std::string_view name) const
+  {
+    auto* cls = server_name_classes.find(normalize_host(name));
+    return (cls) ? *cls : -1;
+  }
+}
@@ -63,7 +63,8 @@ namespace microLB
         netstack_t&        interface,
         const uint16_t     client_port,
         const std::string& cert_path,
-        const std::string& key_path)
+        const std::string& key_path,
+        const int          frontend)
   {
     fs::memdisk().init_fs(
     [] (fs::error_t err, fs::File_system&) {
@@ -72,35 +73,53 @@ namespace microLB
     auto ca_cert = fs::memdisk().fs().read_file(cert_path).to_string();
     auto ca_key  = fs::memdisk().fs().read_file(key_path).to_string();
 
-    this->tls_context = s2n_create_config(ca_cert, ca_key);
-    assert(this->tls_context != nullptr);
+    auto& fe = this->get_frontend(frontend);
+    assert(fe.tls_context == nullptr && "One certificate per frontend");
+    auto* config = s2n_create_config(ca_cert, ca_key);
+    assert(config != nullptr);
+    fe.tls_context = config;
 
     // deserialization settings
-    this->de_helper.cli_ctx = this->tls_context;
+    // NOTE: restored client streams all use the first TLS config
+    if (this->de_helper.cli_ctx == nullptr)
+        this->de_helper.cli_ctx = config;
     this->de_helper.clients = &interface;
 
-    this->tls_free = [this] () {
-        s2n_config_free((s2n_config*) this->tls_context);
+    fe.tls_free = [config] () {
+        s2n_config_free(config);
       };
 
-    interface.tcp().listen(client_port,
-      [this] (net::tcp::Connection_ptr conn) {
+    auto& listener = interface.tcp().listen(client_port,
+      [this, config, frontend] (net::tcp::Connection_ptr conn) {
         if (conn != nullptr)
         {
-          auto* stream = new s2n::TLS_stream(
-              (s2n_config*) this->tls_context,
-              std::make_unique<net::tcp::Stream>(conn),
+          Stage_scope scope(STAGE_ACCEPT);
+          // handshakes count towards the limits of the client
+          const auto source = this->count_client(frontend, conn->remote());
+          auto* stream = make_pooled<s2n::TLS_stream> (
+              &stream_pools.tls,
+              config,
+              stage_transport(
+                  net::Stream_ptr(make_pooled<net::tcp::Stream> (&stream_pools.tcp, conn)),
+                  STAGE_TLS, &stream_pools.stage),
               false
             );
           stream->on_connect(
-            [this, stream] (auto&) {
-              this->incoming(std::unique_ptr<s2n::TLS_stream> (stream));
+            [this, stream, frontend, source] (auto&) {
+              this->incoming(std::unique_ptr<s2n::TLS_stream> (stream),
+                             -1, frontend, -1, source);
             });
           stream->on_close(
-            [stream] () {
-              delete stream;
+            [this, stream, frontend, source] () {
+              // the handshake failed
+              this->release_client(frontend, source);
+              stream->reset_callbacks();
+              // not from within its own callback
+              Timers::oneshot(std::chrono::milliseconds(0),
+                  [stream] (int) { delete stream; });
             });
         }
       });
+    this->limit_clients(listener, frontend);
   } // open_s2n(...)
 }
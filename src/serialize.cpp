@@ -32,12 +32,23 @@ using namespace liu;
 
 namespace microLB
 {
+  // Fields added since the first release follow the original ones, just
+  // before the marker, so that older state restores with defaults here,
+  // and pop_marker() skips them when older versions restore this state.
+  static int optional_int(Restore& store, const uint16_t id, const int fallback)
+  {
+    if (store.is_end() || store.is_int() == false || store.get_id() != id) return fallback;
+    const int value = store.as_int();
+    store.go_next();
+    return value;
+  }
+
   void Nodes::serialize(Storage& store)
   {
     store.add<int64_t>(100, this->session_total);
     store.put_marker(100);
 
-    LBOUT("Serialize %llu sessions\n", this->session_cnt);
+    trace.add(TRACE_SERIALIZE, this->session_cnt);
     store.add_int(102, this->session_cnt);
 
     int alive = 0;
@@ -55,8 +66,19 @@ namespace microLB
 
   void Session::serialize(Storage& store)
   {
+    // coalesced data is not kept across the update
+    this->flush_pending(Shaper::UPLOAD);
+    this->flush_pending(Shaper::DOWNLOAD);
+    // and buffered responses go to the client now
+    for (auto& buffer : response) incoming->write(std::move(buffer));
+    parent.response_changed(-(int64_t) response_bytes);
+    response.clear();
+    response_bytes = 0;
     store.add_stream(*incoming);
-    store.add_stream(*outgoing);
+    // sessions between HTTP requests have no node connection
+    // NOTE: which versions before HTTP mode can't restore
+    if (outgoing != nullptr) store.add_stream(*outgoing);
+    store.add_int(121, this->frontend);
     store.put_marker(120);
   }
 
@@ -77,23 +99,31 @@ namespace microLB
   }
 
   inline std::unique_ptr<net::Stream>
-      deserialize_stream(liu::Restore& store, net::Inet& stack, void* ctx, bool outgoing)
+      deserialize_stream(liu::Restore& store, DeserializationHelper& helper, bool outgoing)
   {
     assert(store.is_stream());
     const int subid = store.get_id();
     std::unique_ptr<net::Stream> result = nullptr;
+    auto* stack = (outgoing) ? helper.nodes : helper.clients;
+    void* ctx   = (outgoing) ? helper.nod_ctx : helper.cli_ctx;
 
     switch (subid) {
       case net::tcp::Stream::SUBID: // TCP
-          result = store.as_tcp_stream(stack.tcp()); store.go_next();
+          assert(stack != nullptr);
+          result = store.as_tcp_stream(stack->tcp()); store.go_next();
           break;
       case s2n::TLS_stream::SUBID: { // S2N
-          auto transp = store.as_tcp_stream(stack.tcp());
+          assert(stack != nullptr);
+          auto transp = store.as_tcp_stream(stack->tcp());
           store.go_next();
           result = store.as_tls_stream(ctx, outgoing, std::move(transp));
           store.go_next();
         } break;
       default:
+          if (helper.restore_stream) {
+            result = helper.restore_stream(store, subid, outgoing);
+            break;
+          }
           throw std::runtime_error("Unimplemented subid " + std::to_string(subid));
     }
     return result;
@@ -110,13 +140,21 @@ namespace microLB
     // since we are remaking all the sessions, reduce total
     this->session_total -= tot_sessions;
 
-    LBOUT("Deserialize %llu sessions\n", tot_sessions);
+    trace.add(TRACE_DESERIALIZE, tot_sessions);
     for(auto i = 0; i < static_cast<int>(tot_sessions); i++)
     {
-      auto incoming = deserialize_stream(store, *helper.clients, helper.cli_ctx, false);
-      auto outgoing = deserialize_stream(store, *helper.nodes,   helper.nod_ctx, true);
+      auto incoming = deserialize_stream(store, helper, false);
+      net::Stream_ptr outgoing = nullptr;
+      if (store.is_stream()) {
+        outgoing = deserialize_stream(store, helper, true);
+      }
+      int frontend = optional_int(store, 121, 0);
+      if (frontend < 0 || frontend >= (int) m_lb.frontends.size()) frontend = 0;
       store.pop_marker(120);
-      this->create_session(std::move(incoming), std::move(outgoing));
+      auto& session = this->create_session(std::move(incoming), std::move(outgoing),
+                                           -1, frontend);
+      // the HTTP framing state is lost, so attached sessions stay attached
+      if (session.is_attached()) session.http = nullptr;
     }
   }
 
@@ -124,11 +162,38 @@ namespace microLB
   {
     //store.add_connection(10, this->conn);
     store.add_stream(*this->conn);
+    store.add_int(11, this->group);
+    store.add_int(14, this->frontend->idx);
+    store.add_int(15, this->cls);
+    store.add_int(12, (int) readq.size());
+    for (auto& buffer : readq) {
+      store.add_buffer(13, buffer->data(), buffer->size());
+    }
     store.put_marker(10);
   }
-  Waiting::Waiting(liu::Restore& store, DeserializationHelper& helper)
+  Waiting::Waiting(liu::Restore& store, Balancer& balancer)
   {
-    this->conn = deserialize_stream(store, *helper.clients, helper.cli_ctx, false);
+    auto& helper = balancer.de_helper;
+    this->conn = deserialize_stream(store, helper, false);
+    this->group = optional_int(store, 11, -1);
+    int fidx = optional_int(store, 14, 0);
+    // the frontend may not exist in the new configuration
+    if (fidx < 0 || fidx >= (int) balancer.frontends.size()) fidx = 0;
+    this->frontend = &balancer.get_frontend(fidx);
+    this->frontend->waiting++;
+    this->cls = optional_int(store, 15, 0);
+    // the class may not exist in the new configuration
+    if (this->cls < 0 || this->cls >= (int) balancer.classes.size()) this->cls = 0;
+    // clients that were still being routed go to the frontends group
+    if (this->group < 0 || this->group >= balancer.nodes.group_count())
+        this->group = this->frontend->group;
+    const int chunks = optional_int(store, 12, 0);
+    for (int i = 0; i < chunks && store.is_buffer() && store.get_id() == 13; i++)
+    {
+      auto buffer = store.as_buffer(); store.go_next();
+      this->readq.push_back(
+          net::tcp::construct_buffer(buffer.begin(), buffer.end()));
+    }
     store.pop_marker(10);
   }
 
@@ -137,9 +202,9 @@ namespace microLB
     store.add_int(0, this->throw_counter);
     store.put_marker(0);
     /// wait queue
-    store.add_int(1, (int) queue.size());
-    for (auto& client : queue) {
-      client.serialize(store);
+    store.add_int(1, this->wait_queue());
+    for (auto& cls : classes) {
+      for (auto& client : cls.queue) client.serialize(store);
     }
     /// nodes
     nodes.serialize(store);
@@ -147,7 +212,8 @@ namespace microLB
   void Balancer::deserialize(Restore& store)
   {
     // can't proceed without these two interfaces
-    if (de_helper.clients == nullptr || de_helper.nodes == nullptr)
+    if ((de_helper.clients == nullptr || de_helper.nodes == nullptr)
+        && de_helper.restore_stream == nullptr)
     {
       throw std::runtime_error("Missing deserialization interfaces. Forget to set them?");
     }
@@ -156,8 +222,16 @@ namespace microLB
     store.pop_marker(0);
     /// wait queue
     int wsize = store.as_int(); store.go_next();
-    for (int i = 0; i < wsize; i++) {
-      queue.emplace_back(store, de_helper);
+    auto& fallback = this->get_class(0).queue;
+    for (int i = 0; i < wsize; i++)
+    {
+      fallback.emplace_back(store, *this);
+      // move it to its own class, without moving the client itself
+      const int cidx = fallback.back().cls;
+      if (cidx != 0) {
+        auto& target = classes[cidx].queue;
+        target.splice(target.end(), fallback, std::prev(fallback.end()));
+      }
     }
     /// nodes
     nodes.deserialize(store, this->de_helper);
@@ -165,6 +239,8 @@ namespace microLB
 
   void Balancer::resume_callback(liu::Restore& store)
   {
+    // sessions are carried over, so there is nothing to wait for
+    if (this->is_warm() == false) this->open_gate(false);
     try {
       this->deserialize(store);
     }
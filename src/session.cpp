@@ -16,44 +16,527 @@
 
 #include "session.hpp"
 #include "nodes.hpp"
+#include "capture.hpp"
+#include "cycles.hpp"
+#include "stream_pool.hpp"
+#include <net/tcp/common.hpp>
+#include <net/tcp/stream.hpp>
+#if defined(MICROLB_TLS)
+#include <net/openssl/tls_stream.hpp>
+#endif
+#include <timers>
+#include <typeinfo>
 
 namespace microLB
 {
+  // Stream calls made directly on a known stream type, instead of through
+  // its vtable. Direct<net::Stream> is any other stream, called as usual.
+  template <typename S>
+  struct Direct {
+    static size_t next_size(S& s) { return s.S::next_size(); }
+    static net::Stream::buffer_t read_next(S& s) { return s.S::read_next(); }
+    static bool is_writable(S& s) { return s.S::is_writable(); }
+    static void write(S& s, net::Stream::buffer_t buffer) { s.S::write(std::move(buffer)); }
+    static bool is_layered(S& s) { return s.S::transport() != nullptr; }
+  };
+  template <>
+  struct Direct<net::Stream> {
+    typedef net::Stream S;
+    static size_t next_size(S& s) { return s.next_size(); }
+    static net::Stream::buffer_t read_next(S& s) { return s.read_next(); }
+    static bool is_writable(S& s) { return s.is_writable(); }
+    static void write(S& s, net::Stream::buffer_t buffer) { s.write(std::move(buffer)); }
+    static bool is_layered(S& s) { return s.transport() != nullptr; }
+  };
+  typedef net::tcp::Stream tcp_stream_t;
+#if defined(MICROLB_TLS)
+  typedef openssl::TLS_stream tls_stream_t;
+#endif
+
+  // exact types only, as derived streams may behave differently,
+  // but a Pooled<T> is a T that was allocated from an arena
+  template <typename T>
+  static bool is_stream(const std::type_info& type)
+  {
+    return type == typeid(T) || type == typeid(Pooled<T>);
+  }
+
+  // the TCP stream at the bottom of a stream, if any
+  static tcp_stream_t* tcp_under(net::Stream& stream)
+  {
+    auto* bottom = stream.bottom_transport();
+    return (is_stream<tcp_stream_t>(typeid(*bottom)))
+        ? static_cast<tcp_stream_t*>(bottom) : nullptr;
+  }
+
+  forwarding_t forwarding_for(const std::type_info& client, const std::type_info& node)
+  {
+    const bool tcp[2] = {is_stream<tcp_stream_t>(client), is_stream<tcp_stream_t>(node)};
+#if defined(MICROLB_TLS)
+    const bool tls[2] = {is_stream<tls_stream_t>(client), is_stream<tls_stream_t>(node)};
+    if (tls[0] && tcp[1]) return FORWARD_TLS_TCP;
+    if (tls[0] && tls[1]) return FORWARD_TLS_TLS;
+    if (tcp[0] && tls[1]) return FORWARD_TCP_TLS;
+#endif
+    if (tcp[0] && tcp[1]) return FORWARD_TCP_TCP;
+    return FORWARD_ANY;
+  }
+  // calls fn with the client and node streams, as their concrete types
+  template <typename Fn>
+  static void with_streams(Session& s, Fn&& fn)
+  {
+    switch (s.forwarding) {
+    case FORWARD_TCP_TCP:
+      fn(static_cast<tcp_stream_t&>(*s.incoming), static_cast<tcp_stream_t&>(*s.outgoing));
+      return;
+#if defined(MICROLB_TLS)
+    case FORWARD_TCP_TLS:
+      fn(static_cast<tcp_stream_t&>(*s.incoming), static_cast<tls_stream_t&>(*s.outgoing));
+      return;
+    case FORWARD_TLS_TCP:
+      fn(static_cast<tls_stream_t&>(*s.incoming), static_cast<tcp_stream_t&>(*s.outgoing));
+      return;
+    case FORWARD_TLS_TLS:
+      fn(static_cast<tls_stream_t&>(*s.incoming), static_cast<tls_stream_t&>(*s.outgoing));
+      return;
+#endif
+    default:
+      fn(*s.incoming, *s.outgoing);
+    }
+  }
+
   // use indexing to access Session because std::vector
   Session::Session(Nodes& n, int idx,
-                   net::Stream_ptr inc, net::Stream_ptr out)
-      : parent(n), self(idx), incoming(std::move(inc)),
-                              outgoing(std::move(out))
+                   net::Stream_ptr inc, net::Stream_ptr out, int nd)
+      : parent(n), self(idx), node(-1), incoming(std::move(inc))
   {
-    incoming->on_data({this, &Session::flush_incoming});
+    this->client_tcp = tcp_under(*incoming);
+    if (parent.batching())
+        incoming->on_data({this, &Session::incoming_ready});
+    else
+        incoming->on_data({this, &Session::flush_incoming});
     incoming->on_close(
     [&nodes = n, idx] () {
         nodes.close_session(idx);
     });
+    // sessions waiting on the client to send what it has read again
+    incoming->on_write(
+    [this] (size_t) {
+        this->written(Shaper::DOWNLOAD);
+    });
+
+    if (parent.http_mode()) {
+      this->http = std::make_unique<Http_exchange> ();
+    }
+    if (out != nullptr) {
+      this->attach(std::move(out), nd);
+    }
+  }
 
-    outgoing->on_data({this, &Session::flush_outgoing});
+  void Session::attach(net::Stream_ptr out, int nd)
+  {
+    assert(this->outgoing == nullptr);
+    this->outgoing = std::move(out);
+    this->node = nd;
+
+    if (parent.batching())
+        outgoing->on_data({this, &Session::outgoing_ready});
+    else
+        outgoing->on_data({this, &Session::flush_outgoing});
     outgoing->on_close(
-    [&nodes = n, idx] () {
-        nodes.close_session(idx);
+    [&nodes = parent, idx = self] () {
+        nodes.node_closed(idx);
+    });
+    outgoing->on_write(
+    [this] (size_t) {
+        this->written(Shaper::UPLOAD);
     });
+    // the stream types don't change, so look them up once
+    this->forwarding = forwarding_for(typeid(*incoming), typeid(*outgoing));
+    this->node_tcp = tcp_under(*outgoing);
+    // keep what the client sends, until the node responds
+    retry.armed = parent.retry_policy().buffer > 0 && node_tcp != nullptr;
+    retry.sent.clear();
+    retry.bytes = 0;
+    retry.reset = false;
+    // nothing is queued towards the new node yet
+    write_wait[Shaper::UPLOAD] = false;
+    if (retry.armed) {
+      // the close callback doesn't say why, so remember resets here
+      // NOTE: reset_callbacks() on the stream removes this again
+      node_tcp->tcp()->on_disconnect(
+      [this] (net::tcp::Connection_ptr conn, net::tcp::Connection::Disconnect dc) {
+          using Disconnect = net::tcp::Connection::Disconnect;
+          this->retry.reset = dc == Disconnect(Disconnect::RESET)
+                           || dc == Disconnect(Disconnect::REFUSED);
+          conn->close();
+        });
+    }
+  }
+  void Session::retain(const net::Stream::buffer_t& buffer)
+  {
+    if (retry.armed == false) return;
+    retry.bytes += buffer->size();
+    if (retry.bytes > parent.retry_policy().buffer) {
+      // too much to replay, so the node can no longer be replaced
+      retry.armed = false;
+      retry.sent.clear();
+      return;
+    }
+    retry.sent.push_back(buffer);
+  }
+
+  void Session::replay(readq_t& data)
+  {
+    assert(this->is_attached());
+    Stage_scope tls(STAGE_TLS, outgoing->transport() != nullptr);
+    for (auto& buffer : data)
+    {
+      if (this->http) http->request.feed(buffer->data(), buffer->size());
+      this->retain(buffer);
+      this->outgoing->write(std::move(buffer));
+    }
+    data.clear();
+  }
+
+  void Session::incoming_ready()
+  {
+    parent.mark_ready(*this, Shaper::UPLOAD);
+  }
+  void Session::outgoing_ready()
+  {
+    parent.mark_ready(*this, Shaper::DOWNLOAD);
   }
 
   void Session::flush_incoming()
   {
     assert(this->is_alive());
-    while((this->incoming->next_size() > 0) and this->outgoing->is_writable())
+    Stage_scope scope(STAGE_FORWARD);
+    if (this->is_attached() == false)
+    {
+      // the node is gone, only its response is left to send
+      if (this->draining) return;
+      // between requests, the next one may go to any node
+      if (parent.routes_requests())
+      {
+        // the request header decides the group
+        auto& request = http->request;
+        while (this->incoming->next_size() > 0
+            && request.headers() == http->response.messages()
+            && request.is_tunnel() == false)
+        {
+          auto buffer = this->incoming->read_next();
+          if (capture.enabled) {
+            capture.data(capture_id, Shaper::UPLOAD, buffer->data(), buffer->size());
+          }
+          request.feed(buffer->data(), buffer->size());
+          this->readq.push_back(std::move(buffer));
+        }
+        if (this->readq.empty()) return;
+        if (request.headers() == http->response.messages()
+            && request.is_tunnel() == false) return;
+        this->group = parent.route_request(request, this->frontend);
+      }
+      else if (this->incoming->next_size() == 0 && this->readq.empty()) return;
+
+      if (parent.reattach(*this) == false) return;
+      // already seen by the request framer
+      Stage_scope tls(STAGE_TLS, outgoing->transport() != nullptr);
+      for (auto& buffer : this->readq) {
+        this->retain(buffer);
+        this->outgoing->write(std::move(buffer));
+      }
+      this->readq.clear();
+    }
+    with_streams(*this, [this] (auto& client, auto& node) {
+        this->upload(client, node);
+      });
+  }
+  template <typename Client, typename Node>
+  void Session::upload(Client& client, Node& node)
+  {
+    while (Direct<Client>::next_size(client) > 0 && Direct<Node>::is_writable(node))
     {
-      this->outgoing->write(this->incoming->read_next());
+      if (parent.throttling()
+          && this->defer(Shaper::UPLOAD, Direct<Client>::next_size(client))) return;
+      auto buffer = Direct<Client>::read_next(client);
+      if (capture.enabled) {
+        capture.data(capture_id, Shaper::UPLOAD, buffer->data(), buffer->size());
+      }
+      if (this->http) http->request.feed(buffer->data(), buffer->size());
+      this->retain(buffer);
+      this->forward(node, Shaper::UPLOAD, std::move(buffer));
     }
   }
 
   void Session::flush_outgoing()
   {
     assert(this->is_alive());
-    while((this->outgoing->next_size() > 0) and this->incoming->is_writable())
+    Stage_scope scope(STAGE_FORWARD);
+    if (parent.buffers_responses()) {
+      this->flush_response();
+      return;
+    }
+    with_streams(*this, [this] (auto& client, auto& node) {
+        this->download(client, node);
+      });
+  }
+  template <typename Client, typename Node>
+  void Session::download(Client& client, Node& node)
+  {
+    while (Direct<Node>::next_size(node) > 0 && Direct<Client>::is_writable(client))
     {
-      this->incoming->write(this->outgoing->read_next());
+      if (parent.throttling()
+          && this->defer(Shaper::DOWNLOAD, Direct<Node>::next_size(node))) return;
+      auto buffer = Direct<Node>::read_next(node);
+      if (capture.enabled) {
+        capture.data(capture_id, Shaper::DOWNLOAD, buffer->data(), buffer->size());
+      }
+      // the node has responded, and can't be replaced anymore
+      if (retry.armed) {
+        retry = Retry_state();
+      }
+      if (this->http) http->response.feed(buffer->data(), buffer->size());
+      this->forward(client, Shaper::DOWNLOAD, std::move(buffer));
+
+      if (this->http && http->is_reusable())
+      {
+        // the response is complete, so don't wait for more
+        this->flush_pending(Shaper::DOWNLOAD);
+        parent.detach(*this);
+        // the client may already be sending the next request
+        if (this->incoming->next_size() > 0) this->flush_incoming();
+        return;
+      }
     }
   }
 
+  void Session::flush_response()
+  {
+    size_t limit = parent.response_buffering().session;
+    if (parent.buffer_cap() > 0) limit = std::min(limit, (size_t) parent.buffer_cap());
+    bool progress = true;
+    while (progress)
+    {
+      progress = false;
+      // read ahead of the client, within the budgets
+      while (this->is_attached() && this->outgoing->next_size() > 0
+          && this->response_bytes < limit && parent.response_room())
+      {
+        this->buffer_response(this->outgoing->read_next());
+        if (this->http && http->is_reusable())
+        {
+          // the node is done, while the client may still be reading
+          parent.detach(*this);
+          // the client may already be sending the next request
+          if (this->incoming->next_size() > 0) this->flush_incoming();
+          break;
+        }
+      }
+      // then as much as the client takes
+      while (this->response.empty() == false && this->incoming->is_writable())
+      {
+        if (this->defer(Shaper::DOWNLOAD, response.front()->size())) return;
+        auto buffer = std::move(response.front());
+        response.pop_front();
+        this->response_bytes -= buffer->size();
+        parent.response_changed(-(int64_t) buffer->size());
+        this->forward(Shaper::DOWNLOAD, std::move(buffer));
+        progress = true;
+      }
+    }
+    if (this->draining && this->response.empty())
+    {
+      this->flush_pending(Shaper::DOWNLOAD);
+      parent.close_session(this->self);
+      return;
+    }
+    // the other sessions hold the whole budget
+    if (this->is_attached() && this->outgoing->next_size() > 0 && this->response.empty()) {
+      parent.wait_for_room(*this);
+    }
+  }
+
+  void Session::buffer_response(net::Stream::buffer_t buffer)
+  {
+    if (capture.enabled) {
+      capture.data(capture_id, Shaper::DOWNLOAD, buffer->data(), buffer->size());
+    }
+    // the node has responded, and can't be replaced anymore
+    if (retry.armed) {
+      retry = Retry_state();
+    }
+    if (this->http) http->response.feed(buffer->data(), buffer->size());
+    this->response_bytes += buffer->size();
+    parent.response_changed(buffer->size());
+    this->response.push_back(std::move(buffer));
+  }
+  bool Session::finish_response()
+  {
+    // what the node sent before closing is kept, regardless of the budgets
+    while (this->outgoing->next_size() > 0) {
+      this->buffer_response(this->outgoing->read_next());
+    }
+    if (this->response_bytes == 0) return false;
+    // NOTE: called from the close handler of the node connection
+    parent.retire(std::move(this->outgoing));
+    this->draining = true;
+    this->flush_response();
+    return true;
+  }
+  bool Session::defer(const Shaper::direction_t dir, const size_t bytes)
+  {
+    // already waiting for tokens
+    if (shape_timer[dir] != Timers::UNUSED_ID) return true;
+    // the destination writes again when it has sent some of what it has
+    if (this->write_wait[dir]) return true;
+    // batching: the rest waits for the next turn
+    if (parent.batching() && parent.batch_quota(*this, dir, bytes) == false) return true;
+    // under memory pressure, wait for the other side to catch up first
+    const bool full = parent.buffer_cap() > 0
+        && this->queued(dir) > (size_t) parent.buffer_cap();
+    // buffered responses wait for the client to send what it has
+    if (full || (dir == Shaper::DOWNLOAD && this->response_bytes > 0
+              && this->queued(dir) >= parent.response_buffering().window))
+    {
+      this->write_wait[dir] = true;
+      return true;
+    }
+    uint64_t wait = 0;
+    if (parent.shaping())
+        wait = parent.shape(*this, dir, bytes);
+    if (wait == 0) return false;
+    this->resume_after(dir, wait);
+    return true;
+  }
+  void Session::resume_after(const Shaper::direction_t dir, const uint64_t nanos)
+  {
+    if (shape_timer[dir] != Timers::UNUSED_ID) return;
+    // leave the data in the stream, so that the sender is slowed down
+    shape_timer[dir] = Timers::oneshot(std::chrono::nanoseconds(nanos),
+    [this, dir] (int) {
+        this->shape_timer[dir] = Timers::UNUSED_ID;
+        this->resume(dir);
+      });
+  }
+  void Session::written(const Shaper::direction_t dir)
+  {
+    if (this->write_wait[dir] == false) return;
+    this->write_wait[dir] = false;
+    this->resume(dir);
+  }
+  void Session::resume(const Shaper::direction_t dir)
+  {
+    if (this->is_alive() == false) return;
+    if (dir == Shaper::UPLOAD)
+        this->flush_incoming();
+    else if (this->is_attached() || this->response_bytes > 0)
+        this->flush_outgoing();
+  }
+  void Session::forward(const Shaper::direction_t dir, net::Stream::buffer_t buffer)
+  {
+    auto& dest = (dir == Shaper::UPLOAD) ? *this->outgoing : *this->incoming;
+    this->forward(dest, dir, std::move(buffer));
+  }
+  template <typename Dest>
+  void Session::forward(Dest& dest, const Shaper::direction_t dir,
+                        net::Stream::buffer_t buffer)
+  {
+    const auto* config = this->coalesce[dir];
+    if (config == nullptr || buffer->size() >= (size_t) config->size)
+    {
+      // keep the order of the data
+      if (pending[dir] != nullptr) this->flush_pending(dir);
+      // layered streams encrypt as they write
+      Stage_scope tls(STAGE_TLS, Direct<Dest>::is_layered(dest));
+      Direct<Dest>::write(dest, std::move(buffer));
+      return;
+    }
+    auto& data = this->pending[dir];
+    if (data == nullptr)
+    {
+      // take over the buffer, when nobody else has it
+      if (buffer.use_count() == 1) {
+        data = std::move(buffer);
+        data->reserve(config->size);
+      }
+      else {
+        data = net::tcp::construct_buffer(buffer->begin(), buffer->end());
+        data->reserve(config->size);
+      }
+    }
+    else {
+      data->insert(data->end(), buffer->begin(), buffer->end());
+    }
+    if (data->size() >= (size_t) config->size) {
+      this->flush_pending(dir);
+    }
+    else if (flush_timer[dir] == Timers::UNUSED_ID)
+    {
+      // bound the latency added to small writes
+      flush_timer[dir] = Timers::oneshot(config->delay,
+      [this, dir] (int) {
+          Stage_scope scope(STAGE_FORWARD);
+          this->flush_timer[dir] = Timers::UNUSED_ID;
+          this->flush_pending(dir);
+          // the gathered data may be what the session was waiting on
+          this->written(dir);
+        });
+    }
+  }
+  void Session::flush_pending(const Shaper::direction_t dir)
+  {
+    if (flush_timer[dir] != Timers::UNUSED_ID) {
+      Timers::stop(flush_timer[dir]);
+      flush_timer[dir] = Timers::UNUSED_ID;
+    }
+    if (pending[dir] == nullptr) return;
+    auto* dest = (dir == Shaper::UPLOAD) ? this->outgoing.get() : this->incoming.get();
+    // dropped only when its destination is gone
+    if (dest != nullptr && dest->is_writable()) {
+      Stage_scope tls(STAGE_TLS, dest->transport() != nullptr);
+      dest->write(std::move(pending[dir]));
+    }
+    pending[dir] = nullptr;
+  }
+  size_t Session::queued(const Shaper::direction_t dir) const
+  {
+    const bool up = (dir == Shaper::UPLOAD);
+    auto* dest = (up) ? this->outgoing.get() : this->incoming.get();
+    auto* tcp  = (up) ? this->node_tcp : this->client_tcp;
+    size_t bytes = (pending[dir] != nullptr) ? pending[dir]->size() : 0;
+    // unsent data of the TCP connection under the stream
+    if (dest != nullptr && tcp != nullptr) bytes += tcp->tcp()->sendq_remaining();
+    return bytes;
+  }
+  size_t Session::buffered() const
+  {
+    size_t bytes = retry.bytes + response_bytes;
+    for (const auto& buffer : readq) bytes += buffer->size();
+    return bytes + queued(Shaper::UPLOAD) + queued(Shaper::DOWNLOAD);
+  }
+  void Session::stop_timers()
+  {
+    for (int* timers : {shape_timer, flush_timer})
+    {
+      for (int i = 0; i < 2; i++)
+      {
+        if (timers[i] != Timers::UNUSED_ID) {
+          Timers::stop(timers[i]);
+          timers[i] = Timers::UNUSED_ID;
+        }
+      }
+    }
+    this->shaper = nullptr;
+    write_wait[0] = false;
+    write_wait[1] = false;
+    // flushed when the session closed, unless the destination was gone
+    pending[0] = nullptr;
+    pending[1] = nullptr;
+    retry = Retry_state();
+    parent.response_changed(-(int64_t) response_bytes);
+    response.clear();
+    response_bytes = 0;
+    draining = false;
+  }
 }
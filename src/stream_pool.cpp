@@ -0,0 +1,114 @@
+// This file is a part of the IncludeOS unikernel - www.includeos.org
+//
+// Copyright 2018-2019 IncludeOS AS, Oslo, Norway
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "stream_pool.hpp"
+#include <cassert>
+#include <new>
+
+#define ARENA_ALIGN   16
+
+namespace microLB
+{
+  struct Arena::Slab {
+    size_t slot_size;
+    size_t in_use   = 0;
+    bool   orphaned = false;
+    void*  free_list = nullptr;
+    char*  memory   = nullptr;
+  };
+  // in front of every object, pointing back to its slab
+  // while in use, or to the next free slot while free
+  struct alignas(ARENA_ALIGN) Header {
+    union {
+      Arena::Slab* slab;
+      Header*      next;
+    };
+  };
+
+  static void free_slab(Arena::Slab* slab)
+  {
+    ::operator delete(slab->memory, std::align_val_t{ARENA_ALIGN});
+    delete slab;
+  }
+
+  Arena::~Arena()
+  {
+    if (slab == nullptr) return;
+    // objects still in use keep the slab alive,
+    // and the last one to be deallocated frees it
+    if (slab->in_use > 0) slab->orphaned = true;
+    else free_slab(slab);
+  }
+
+  void Arena::set_capacity(const size_t slots)
+  {
+    assert(slab == nullptr && "Arena capacity must be set before use");
+    this->m_capacity = slots;
+  }
+  size_t Arena::in_use() const noexcept
+  {
+    return (slab) ? slab->in_use : 0;
+  }
+
+  void* Arena::allocate(const size_t bytes)
+  {
+    if (slab == nullptr && m_capacity > 0)
+    {
+      // the first object decides the slot size
+      slab = new Slab;
+      slab->slot_size = (bytes + ARENA_ALIGN-1) & ~(size_t) (ARENA_ALIGN-1);
+      const size_t stride = sizeof(Header) + slab->slot_size;
+      slab->memory = (char*) ::operator new(stride * m_capacity,
+                                            std::align_val_t{ARENA_ALIGN});
+      // thread all slots onto the free list
+      for (size_t i = m_capacity; i > 0; i--)
+      {
+        auto* hdr = (Header*) &slab->memory[(i-1) * stride];
+        hdr->next = (Header*) slab->free_list;
+        slab->free_list = hdr;
+      }
+    }
+    if (slab != nullptr && slab->free_list != nullptr && bytes <= slab->slot_size)
+    {
+      auto* hdr = (Header*) slab->free_list;
+      slab->free_list = hdr->next;
+      slab->in_use++;
+      hdr->slab = this->slab;
+      return hdr + 1;
+    }
+    // slab exhausted (or unused)
+    auto* hdr = (Header*) ::operator new(sizeof(Header) + bytes,
+                                         std::align_val_t{ARENA_ALIGN});
+    hdr->slab = nullptr;
+    return hdr + 1;
+  }
+
+  void Arena::deallocate(void* ptr) noexcept
+  {
+    if (ptr == nullptr) return;
+    auto* hdr  = (Header*) ptr - 1;
+    auto* slab = hdr->slab;
+    if (slab == nullptr) {
+      ::operator delete(hdr, std::align_val_t{ARENA_ALIGN});
+      return;
+    }
+    assert(slab->in_use > 0);
+    hdr->next = (Header*) slab->free_list;
+    slab->free_list = hdr;
+    slab->in_use--;
+    if (slab->orphaned && slab->in_use == 0) free_slab(slab);
+  }
+}
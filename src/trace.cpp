@@ -0,0 +1,82 @@
+// This file is a part of the IncludeOS unikernel - www.includeos.org
+//
+// Copyright 2018-2019 IncludeOS AS, Oslo, Norway
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "trace.hpp"
+#include <os.hpp>
+#include <cinttypes>
+
+namespace microLB
+{
+  Trace_ring trace;
+
+  uint64_t trace_clock() noexcept
+  {
+    return os::nanos_since_boot();
+  }
+
+  uint64_t Trace_ring::read(uint64_t cursor, read_func_t func) const
+  {
+    const uint64_t end = this->total();
+    // records older than one lap have been overwritten
+    if (end - cursor > MICROLB_TRACE_SIZE || cursor > end) {
+      cursor = (end > MICROLB_TRACE_SIZE) ? end - MICROLB_TRACE_SIZE : 0;
+    }
+    for (; cursor < end; cursor++) {
+      func(ring[cursor & (MICROLB_TRACE_SIZE-1)]);
+    }
+    return end;
+  }
+
+  void Trace_ring::print(FILE* file, const uint64_t count) const
+  {
+    const uint64_t end = this->total();
+    const uint64_t begin = (end > count) ? end - count : 0;
+    this->read(begin,
+      [file] (const Trace_record& rec) {
+        fprintf(file, "[%" PRIu64 ".%09" PRIu64 "] %-14s %d %d %d\n",
+                rec.nanos / 1000000000, rec.nanos % 1000000000,
+                event_name(rec.event), rec.a, rec.b, rec.c);
+      });
+  }
+
+  const char* Trace_ring::event_name(const uint16_t event)
+  {
+    static const char* names[TRACE_EVENT_MAX] = {
+      "none",
+      "accept",
+      "reject",
+      "queue",
+      "route",
+      "assign",
+      "connect_start",
+      "connect_end",
+      "pool_signal",
+      "reattach",
+      "detach",
+      "session_close",
+      "retry",
+      "udp_flow",
+      "nat_flow",
+      "serialize",
+      "deserialize",
+      "warm_start",
+      "h2_stream",
+      "memory",
+      "hedge"
+    };
+    return (event < TRACE_EVENT_MAX) ? names[event] : "unknown";
+  }
+}